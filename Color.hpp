@@ -3,6 +3,8 @@
 
 #include <math.h>
 
+#include "FastMath.hpp"
+
 template<class T>
 static T saturated( T a ){
 	return a > 1.0 ? 1.0 : a < 0.0 ? 0.0 : a;
@@ -62,7 +64,15 @@ public:
     }
     Color operator^( const float & k ) const
     {
-        return Color( pow( r, k ), pow( g, k ), pow( b, k ) );
+#if SSE
+        if ( g_math_quality == MATH_FAST )
+        {
+            Color ret;
+            *( __m128* )&ret = fast_pow_ps( *( const __m128* )this, _mm_set1_ps( k ) );
+            return ret;
+        }
+#endif
+        return Color( fpow( r, k ), fpow( g, k ), fpow( b, k ) );
     }
     bool is_black() const
     {
@@ -87,10 +97,7 @@ public:
     }
     void gamma_correction()
     {
-    	float gamma = 1.0f / 2.2f;
-    	r = pow( r, gamma );
-    	g = pow( g, gamma );
-    	b = pow( b, gamma );
+    	*this = *this ^ ( 1.0f / 2.2f );
     }
 } __attribute__ ( ( aligned( 16 ) ) );;
 
@@ -0,0 +1,161 @@
+#include "Denoiser.hpp"
+
+#include <algorithm>
+#include <thread>
+
+//ядро B3-сплайна 5x5, соседи центра нумеруются 0..23 построчно и обходятся группами по 4 для SSE
+static const float g_b3[ 5 ] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+static const float g_center_weight = g_b3[ 2 ] * g_b3[ 2 ];
+
+static float color_distance2( const Color & a, const Color & b )
+{
+#if SSE
+	__m128 d = _mm_sub_ps( *( const __m128* )&a, *( const __m128* )&b );
+	d = _mm_mul_ps( d, d );
+	//альфа-канал - число выборок, в расстояние не входит
+	d = _mm_and_ps( d, _mm_castsi128_ps( _mm_set_epi32( 0, -1, -1, -1 ) ) );
+	d = _mm_hadd_ps( d, d );
+	d = _mm_hadd_ps( d, d );
+	return _mm_cvtss_f32( d );
+#else
+	Color d = a - b;
+	return d.r * d.r + d.g * d.g + d.b * d.b;
+#endif
+}
+
+Denoiser::Denoiser( uint32_t iterations, float sigma_color, float sigma_normal, float sigma_depth )
+	: m_iterations( iterations ), m_sigma_color( sigma_color ), m_sigma_normal( sigma_normal ), m_sigma_depth( sigma_depth ),
+	  m_width( 0 ), m_height( 0 ), m_aux( NULL )
+{
+}
+
+void Denoiser::filter_rows( const Color * src, Color * dst, uint32_t step, float sigma_color, size_t y0, size_t y1 ) const
+{
+	const float kc = 1.0f / ( sigma_color * sigma_color );
+	const float kn = 1.0f / ( m_sigma_normal * m_sigma_normal );
+	const float kz = 1.0f / ( m_sigma_depth * m_sigma_depth );
+
+	for( size_t y = y0; y < y1; y++ )
+		for( size_t x = 0; x < m_width; x++ )
+		{
+			size_t i = y * m_width + x;
+			const aux_pixel_t & ap = m_aux[ i ];
+			const Color & cp = src[ i ];
+			if ( ap.object == ~0u )
+			{
+				dst[ i ] = cp;
+				continue;
+			}
+
+#if SSE
+			__m128 sum = _mm_mul_ps( *( const __m128* )&cp, _mm_set1_ps( g_center_weight ) );
+#else
+			Color sum = cp * g_center_weight;
+#endif
+			float weight_sum = g_center_weight;
+			for( size_t g = 0; g < 24; g += 4 )
+			{
+				float e[ 4 ] __attribute__ ( ( aligned( 16 ) ) );
+				float w[ 4 ] __attribute__ ( ( aligned( 16 ) ) );
+				size_t index[ 4 ];
+				for( size_t lane = 0; lane < 4; lane++ )
+				{
+					size_t tap = g + lane < 12 ? g + lane : g + lane + 1;
+					long dx = ( long )( tap % 5 ) - 2;
+					long dy = ( long )( tap / 5 ) - 2;
+					long qx = ( long )x + dx * ( long )step;
+					long qy = ( long )y + dy * ( long )step;
+					index[ lane ] = i;
+					e[ lane ] = 0.0f;
+					w[ lane ] = 0.0f;
+					if ( qx < 0 || qy < 0 || qx >= ( long )m_width || qy >= ( long )m_height )
+						continue;
+					size_t q = qy * m_width + qx;
+					const aux_pixel_t & aq = m_aux[ q ];
+					if ( aq.object != ap.object )
+						continue;
+
+					float dnx = aq.nx - ap.nx;
+					float dny = aq.ny - ap.ny;
+					float dnz = aq.nz - ap.nz;
+					float dz = ( aq.depth - ap.depth ) / ap.depth;
+					e[ lane ] = -( color_distance2( src[ q ], cp ) * kc + ( dnx * dnx + dny * dny + dnz * dnz ) * kn + dz * dz * kz );
+					w[ lane ] = g_b3[ dx + 2 ] * g_b3[ dy + 2 ];
+					index[ lane ] = q;
+				}
+#if SSE
+				__m128 w4 = _mm_mul_ps( fast_exp_ps( _mm_load_ps( e ) ), _mm_load_ps( w ) );
+				_mm_store_ps( w, w4 );
+				for( size_t lane = 0; lane < 4; lane++ )
+					sum = _mm_add_ps( sum, _mm_mul_ps( *( const __m128* )&src[ index[ lane ] ], _mm_set1_ps( w[ lane ] ) ) );
+#else
+				for( size_t lane = 0; lane < 4; lane++ )
+				{
+					w[ lane ] *= fexp( e[ lane ] );
+					sum = sum + src[ index[ lane ] ] * w[ lane ];
+				}
+#endif
+				weight_sum += w[ 0 ] + w[ 1 ] + w[ 2 ] + w[ 3 ];
+			}
+
+#if SSE
+			Color c;
+			*( __m128* )&c = _mm_div_ps( sum, _mm_set1_ps( weight_sum ) );
+#else
+			Color c = sum / weight_sum;
+#endif
+			c.a = cp.a;
+			dst[ i ] = c;
+		}
+}
+
+void Denoiser::run( image_t & image, const aux_pixel_t * aux, uint32_t threads )
+{
+	m_width = image.width;
+	m_height = image.height;
+	m_aux = aux;
+	size_t count = m_width * m_height;
+	m_buffers[ 0 ].resize( count );
+	m_buffers[ 1 ].resize( count );
+
+	//фильтруется освещенность, текстуры и цвета материалов не размываются
+	for( size_t i = 0; i < count; i++ )
+	{
+		const Color & a = aux[ i ].albedo;
+		const Color & c = image.image[ i ];
+		Color & l = m_buffers[ 0 ][ i ];
+		l = Color( c.r / std::max( a.r, 0.001f ), c.g / std::max( a.g, 0.001f ), c.b / std::max( a.b, 0.001f ) );
+		l.a = c.a;
+	}
+
+	threads = std::max< uint32_t >( threads, 1 );
+	size_t band = ( m_height + threads - 1 ) / threads;
+	size_t current = 0;
+	for( uint32_t iteration = 0; iteration < m_iterations; iteration++ )
+	{
+		//на каждой итерации расстояние между отсчетами ядра удваивается, а допуск по цвету уменьшается
+		uint32_t step = 1u << iteration;
+		float sigma_color = m_sigma_color / ( float )step;
+		const Color * src = &m_buffers[ current ][ 0 ];
+		Color * dst = &m_buffers[ current ^ 1 ][ 0 ];
+
+		std::vector< std::thread > workers;
+		for( uint32_t t = 0; t < threads; t++ )
+		{
+			size_t y0 = std::min( m_height, t * band );
+			size_t y1 = std::min( m_height, y0 + band );
+			workers.push_back( std::thread( &Denoiser::filter_rows, this, src, dst, step, sigma_color, y0, y1 ) );
+		}
+		for( size_t t = 0; t < workers.size(); t++ )
+			workers[ t ].join();
+		current ^= 1;
+	}
+
+	for( size_t i = 0; i < count; i++ )
+	{
+		Color & c = image.image[ i ];
+		float samples = c.a;
+		c = m_buffers[ current ][ i ] * aux[ i ].albedo;
+		c.a = samples;
+	}
+}
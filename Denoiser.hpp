@@ -0,0 +1,52 @@
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "Color.hpp"
+#include "Texture.hpp"
+
+//признаки первичного попадания в пиксель
+struct aux_pixel_t
+{
+    Color       albedo;
+    float       nx;
+    float       ny;
+    float       nz;
+    //расстояние от камеры, INFINITY при промахе
+    float       depth;
+    //object_id() из Scene.hpp, ~0u при промахе
+    uint32_t    object;
+
+    aux_pixel_t()
+        : albedo( 1.0f ), nx( 0.0f ), ny( 0.0f ), nz( 0.0f ), depth( INFINITY ), object( ~0u )
+    {}
+};
+
+//Вейвлетный фильтр à-trous с остановкой на границах ( Dammertz et al., Edge-Avoiding À-Trous Wavelet
+//Transform ). Фильтруется освещенность - цвет, деленный на альбедо, веса соседей падают с разницей
+//освещенности, нормалей и относительной глубины, пиксели разных объектов не смешиваются
+class Denoiser
+{
+private:
+    uint32_t    m_iterations;
+    float       m_sigma_color;
+    float       m_sigma_normal;
+    float       m_sigma_depth;
+
+    size_t      m_width;
+    size_t      m_height;
+    const aux_pixel_t *     m_aux;
+    std::vector< Color >    m_buffers[ 2 ];
+
+    void filter_rows( const Color * src, Color * dst, uint32_t step, float sigma_color, size_t y0, size_t y1 ) const;
+public:
+    Denoiser( uint32_t iterations, float sigma_color, float sigma_normal, float sigma_depth );
+
+    //aux - image.width * image.height признаков построчно
+    void run( image_t & image, const aux_pixel_t * aux, uint32_t threads );
+};
+
+#endif // DENOISER_HPP
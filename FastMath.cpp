@@ -0,0 +1,8 @@
+#include "FastMath.hpp"
+
+math_quality_t g_math_quality = MATH_PRECISE;
+
+void InitMathSystem( math_quality_t quality )
+{
+	g_math_quality = quality;
+}
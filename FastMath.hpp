@@ -0,0 +1,141 @@
+#ifndef FASTMATH_HPP
+#define FASTMATH_HPP
+
+#include <math.h>
+#include <stdint.h>
+
+#if SSE
+#include <x86intrin.h>
+#endif
+
+//MATH_PRECISE - функции libm, MATH_FAST - полиномиальные приближения:
+//относительная ошибка fast_exp2 < 4e-6, абсолютная ошибка fast_log2 < 5e-7,
+//относительная ошибка fast_pow < 1e-5 при | y * log2( x ) | < 16
+enum math_quality_t
+{
+    MATH_PRECISE,
+    MATH_FAST
+};
+
+extern math_quality_t g_math_quality;
+
+void InitMathSystem( math_quality_t quality );
+
+//x^n для целого n через возведение в квадрат
+inline float pow_int( float x, int n )
+{
+    if ( n < 0 )
+        return 1.0f / pow_int( x, -n );
+    float ret = 1.0f;
+    while( n )
+    {
+        if ( n & 1 )
+            ret *= x;
+        x *= x;
+        n >>= 1;
+    }
+    return ret;
+}
+
+inline float fast_exp2( float x )
+{
+    x = x < -126.0f ? -126.0f : x > 126.0f ? 126.0f : x;
+    int i = ( int )x;
+    i -= x < i;
+    float f = x - i;
+    float p = 1.0f + f * ( 0.693043986f + f * ( 0.241282866f + f * ( 0.0522405159f + f * 0.0134267884f ) ) );
+    union { uint32_t i; float f; } e;
+    e.i = ( uint32_t )( i + 127 ) << 23;
+    return p * e.f;
+}
+
+inline float fast_log2( float x )
+{
+    union { float f; uint32_t i; } v;
+    v.f = x;
+    int e = ( int )( ( v.i >> 23 ) & 0xff ) - 127;
+    //мантисса в [ sqrt( 1/2 ), sqrt( 2 ) )
+    v.i = ( v.i & 0x007fffff ) | 0x3f800000;
+    if ( v.f > 1.41421356f )
+    {
+        v.f *= 0.5f;
+        e++;
+    }
+    float t = ( v.f - 1.0f ) / ( v.f + 1.0f );
+    float t2 = t * t;
+    return e + t * ( 2.88539008f + t2 * ( 0.961796694f + t2 * ( 0.577078017f + t2 * 0.412198583f ) ) );
+}
+
+inline float fast_exp( float x )
+{
+    return fast_exp2( x * 1.44269504f );
+}
+
+inline float fast_pow( float x, float y )
+{
+    if ( x <= 0.0f )
+        return 0.0f;
+    return fast_exp2( y * fast_log2( x ) );
+}
+
+inline float fpow( float x, float y )
+{
+    return g_math_quality == MATH_FAST ? fast_pow( x, y ) : powf( x, y );
+}
+
+inline float fexp( float x )
+{
+    return g_math_quality == MATH_FAST ? fast_exp( x ) : expf( x );
+}
+
+#if SSE
+inline __m128 fast_exp2_ps( __m128 x )
+{
+    x = _mm_min_ps( _mm_max_ps( x, _mm_set1_ps( -126.0f ) ), _mm_set1_ps( 126.0f ) );
+    __m128i i = _mm_cvttps_epi32( x );
+    __m128 fi = _mm_cvtepi32_ps( i );
+    //cvtt округляет к нулю, для отрицательных нужен floor
+    __m128 fix = _mm_and_ps( _mm_cmplt_ps( x, fi ), _mm_set1_ps( 1.0f ) );
+    fi = _mm_sub_ps( fi, fix );
+    i = _mm_cvtps_epi32( fi );
+    __m128 f = _mm_sub_ps( x, fi );
+    __m128 p = _mm_set1_ps( 0.0134267884f );
+    p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 0.0522405159f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 0.241282866f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 0.693043986f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, f ), _mm_set1_ps( 1.0f ) );
+    __m128i e = _mm_slli_epi32( _mm_add_epi32( i, _mm_set1_epi32( 127 ) ), 23 );
+    return _mm_mul_ps( p, _mm_castsi128_ps( e ) );
+}
+
+inline __m128 fast_log2_ps( __m128 x )
+{
+    __m128i bits = _mm_castps_si128( x );
+    __m128i e = _mm_sub_epi32( _mm_and_si128( _mm_srli_epi32( bits, 23 ), _mm_set1_epi32( 0xff ) ), _mm_set1_epi32( 127 ) );
+    __m128 m = _mm_castsi128_ps( _mm_or_si128( _mm_and_si128( bits, _mm_set1_epi32( 0x007fffff ) ), _mm_set1_epi32( 0x3f800000 ) ) );
+    __m128 big = _mm_cmpgt_ps( m, _mm_set1_ps( 1.41421356f ) );
+    m = _mm_or_ps( _mm_and_ps( big, _mm_mul_ps( m, _mm_set1_ps( 0.5f ) ) ), _mm_andnot_ps( big, m ) );
+    __m128 fe = _mm_add_ps( _mm_cvtepi32_ps( e ), _mm_and_ps( big, _mm_set1_ps( 1.0f ) ) );
+    __m128 t = _mm_div_ps( _mm_sub_ps( m, _mm_set1_ps( 1.0f ) ), _mm_add_ps( m, _mm_set1_ps( 1.0f ) ) );
+    __m128 t2 = _mm_mul_ps( t, t );
+    __m128 p = _mm_set1_ps( 0.412198583f );
+    p = _mm_add_ps( _mm_mul_ps( p, t2 ), _mm_set1_ps( 0.577078017f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, t2 ), _mm_set1_ps( 0.961796694f ) );
+    p = _mm_add_ps( _mm_mul_ps( p, t2 ), _mm_set1_ps( 2.88539008f ) );
+    return _mm_add_ps( fe, _mm_mul_ps( p, t ) );
+}
+
+//x^y для 4 значений x, x <= 0 дает 0
+inline __m128 fast_pow_ps( const __m128 & x, const __m128 & y )
+{
+    __m128 r = fast_exp2_ps( _mm_mul_ps( y, fast_log2_ps( x ) ) );
+    return _mm_and_ps( _mm_cmpgt_ps( x, _mm_setzero_ps() ), r );
+}
+
+inline __m128 fast_exp_ps( const __m128 & x )
+{
+    return fast_exp2_ps( _mm_mul_ps( x, _mm_set1_ps( 1.44269504f ) ) );
+}
+#endif
+
+#endif // FASTMATH_HPP
@@ -0,0 +1,211 @@
+#include "Framebuffer.hpp"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+uint16_t float_to_half( float f )
+{
+	union { float f; uint32_t u; } v;
+	v.f = f;
+	uint32_t sign = ( v.u >> 16 ) & 0x8000;
+	uint32_t fexp = ( v.u >> 23 ) & 0xff;
+	uint32_t mant = v.u & 0x7fffff;
+	if ( fexp == 0xff )
+		return sign | 0x7c00 | ( mant ? 0x200 : 0 );
+	int32_t exp = ( int32_t )fexp - 127 + 15;
+	if ( exp >= 31 )
+		return sign | 0x7c00;
+	if ( exp <= 0 )
+	{
+		//денормализованные half
+		if ( exp < -10 )
+			return sign;
+		mant |= 0x800000;
+		uint32_t shift = 14 - exp;
+		uint32_t h = mant >> shift;
+		if ( ( mant >> ( shift - 1 ) ) & 1 )
+			h++;
+		return sign | h;
+	}
+	uint32_t h = sign | ( exp << 10 ) | ( mant >> 13 );
+	//округление, перенос в порядок корректен
+	if ( mant & 0x1000 )
+		h++;
+	return h;
+}
+
+float half_to_float( uint16_t h )
+{
+	uint32_t sign = ( uint32_t )( h & 0x8000 ) << 16;
+	int32_t exp = ( h >> 10 ) & 0x1f;
+	uint32_t mant = h & 0x3ff;
+	union { uint32_t u; float f; } v;
+	if ( exp == 0 )
+	{
+		if ( mant == 0 )
+		{
+			v.u = sign;
+			return v.f;
+		}
+		while( !( mant & 0x400 ) )
+		{
+			mant <<= 1;
+			exp--;
+		}
+		exp++;
+		mant &= 0x3ff;
+	}
+	else if ( exp == 31 )
+	{
+		v.u = sign | 0x7f800000 | ( mant << 13 );
+		return v.f;
+	}
+	v.u = sign | ( ( exp + 112 ) << 23 ) | ( mant << 13 );
+	return v.f;
+}
+
+static uint32_t part1by1( uint32_t x )
+{
+	x &= 0x0000ffff;
+	x = ( x | ( x << 8 ) ) & 0x00ff00ff;
+	x = ( x | ( x << 4 ) ) & 0x0f0f0f0f;
+	x = ( x | ( x << 2 ) ) & 0x33333333;
+	x = ( x | ( x << 1 ) ) & 0x55555555;
+	return x;
+}
+
+Framebuffer::Framebuffer()
+	: m_width( 0 ), m_height( 0 ), m_tile_size( 1 ), m_tiles_x( 0 ), m_pixels( 0 ),
+	  m_layout( FRAMEBUFFER_LINEAR ), m_format( FRAMEBUFFER_FLOAT32 ), m_data( NULL )
+{
+}
+
+Framebuffer::~Framebuffer()
+{
+	free( m_data );
+}
+
+void Framebuffer::init( size_t width, size_t height, size_t tile_size, framebuffer_layout_t layout, framebuffer_format_t format,
+						bool first_touch )
+{
+	free( m_data );
+
+	m_width = width;
+	m_height = height;
+	m_tile_size = tile_size;
+	m_layout = layout;
+	m_format = format;
+	m_tiles_x = ( width + tile_size - 1 ) / tile_size;
+
+	if ( layout == FRAMEBUFFER_LINEAR )
+		m_pixels = width * height;
+	else
+	{
+		//крайние тайлы хранятся целиком, чтобы каждый тайл занимал непрерывный кусок памяти
+		size_t tiles_y = ( height + tile_size - 1 ) / tile_size;
+		m_pixels = m_tiles_x * tiles_y * tile_size * tile_size;
+	}
+
+	size_t bytes = m_pixels * ( format == FRAMEBUFFER_FLOAT16 ? 4 * sizeof( uint16_t ) : sizeof( Color ) );
+	if ( posix_memalign( &m_data, CACHE_LINE, bytes ) )
+		m_data = NULL;
+	if ( !first_touch )
+		clear();
+}
+
+void Framebuffer::clear()
+{
+	if ( m_data )
+		memset( m_data, 0, m_pixels * ( m_format == FRAMEBUFFER_FLOAT16 ? 4 * sizeof( uint16_t ) : sizeof( Color ) ) );
+}
+
+void Framebuffer::clear_tile( const tile_t & tile )
+{
+	for( size_t y = 0; y < tile.height; y++ )
+		for( size_t x = 0; x < tile.width; x++ )
+			store( index( tile.x + x, tile.y + y ), Color() );
+}
+
+size_t Framebuffer::index( size_t x, size_t y ) const
+{
+	if ( m_layout == FRAMEBUFFER_LINEAR )
+		return y * m_width + x;
+
+	size_t tile = ( y / m_tile_size ) * m_tiles_x + x / m_tile_size;
+	size_t lx = x % m_tile_size;
+	size_t ly = y % m_tile_size;
+	size_t local = m_layout == FRAMEBUFFER_MORTON ? ( part1by1( lx ) | ( part1by1( ly ) << 1 ) ) : ly * m_tile_size + lx;
+	return tile * m_tile_size * m_tile_size + local;
+}
+
+void Framebuffer::store( size_t i, const Color & c )
+{
+	if ( m_format == FRAMEBUFFER_FLOAT32 )
+	{
+		( ( Color* )m_data )[ i ] = c;
+		return;
+	}
+	uint16_t * h = ( uint16_t* )m_data + i * 4;
+	h[ 0 ] = float_to_half( c.r );
+	h[ 1 ] = float_to_half( c.g );
+	h[ 2 ] = float_to_half( c.b );
+	h[ 3 ] = float_to_half( c.a );
+}
+
+Color Framebuffer::load( size_t i ) const
+{
+	if ( m_format == FRAMEBUFFER_FLOAT32 )
+		return ( ( const Color* )m_data )[ i ];
+	const uint16_t * h = ( const uint16_t* )m_data + i * 4;
+	Color c( half_to_float( h[ 0 ] ), half_to_float( h[ 1 ] ), half_to_float( h[ 2 ] ) );
+	c.a = half_to_float( h[ 3 ] );
+	return c;
+}
+
+void Framebuffer::fetch_tile( const tile_t & tile, Color * pixels, size_t stride ) const
+{
+	if ( m_format == FRAMEBUFFER_FLOAT32 && m_layout == FRAMEBUFFER_LINEAR )
+	{
+		for( size_t y = 0; y < tile.height; y++ )
+		{
+			const Color * row = ( const Color* )m_data + index( tile.x, tile.y + y );
+			std::copy( row, row + tile.width, pixels + y * stride );
+		}
+		return;
+	}
+	for( size_t y = 0; y < tile.height; y++ )
+		for( size_t x = 0; x < tile.width; x++ )
+			pixels[ y * stride + x ] = load( index( tile.x + x, tile.y + y ) );
+}
+
+void Framebuffer::commit_tile( const tile_t & tile, const Color * pixels, size_t stride )
+{
+	if ( m_format == FRAMEBUFFER_FLOAT32 && m_layout == FRAMEBUFFER_LINEAR )
+	{
+		for( size_t y = 0; y < tile.height; y++ )
+			std::copy( pixels + y * stride, pixels + y * stride + tile.width, ( Color* )m_data + index( tile.x, tile.y + y ) );
+		return;
+	}
+	for( size_t y = 0; y < tile.height; y++ )
+		for( size_t x = 0; x < tile.width; x++ )
+			store( index( tile.x + x, tile.y + y ), pixels[ y * stride + x ] );
+}
+
+Color Framebuffer::pixel( size_t x, size_t y ) const
+{
+	return load( index( x, y ) );
+}
+
+void Framebuffer::resolve( image_t & image ) const
+{
+	if ( image.image )
+		delete[] image.image;
+	image.width = m_width;
+	image.height = m_height;
+	image.image = new Color[ m_width * m_height ];
+	for( size_t y = 0; y < m_height; y++ )
+		for( size_t x = 0; x < m_width; x++ )
+			image.image[ y * m_width + x ] = load( index( x, y ) );
+}
@@ -0,0 +1,95 @@
+#ifndef FRAMEBUFFER_HPP
+#define FRAMEBUFFER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "Color.hpp"
+#include "Texture.hpp"
+
+#define CACHE_LINE 64
+
+//порядок пикселей в памяти:
+//LINEAR - построчно на всё изображение,
+//TILED - тайлы tile_size x tile_size ( см. init ) подряд, внутри тайла построчно,
+//MORTON - тайлы подряд, внутри тайла по кривой Мортона ( Z-order )
+enum framebuffer_layout_t
+{
+    FRAMEBUFFER_LINEAR,
+    FRAMEBUFFER_TILED,
+    FRAMEBUFFER_MORTON
+};
+
+//FLOAT16 хранит каналы в half float, 8 байт на пиксель вместо 16
+enum framebuffer_format_t
+{
+    FRAMEBUFFER_FLOAT32,
+    FRAMEBUFFER_FLOAT16
+};
+
+struct tile_t
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+
+    tile_t()
+        : x( 0 ), y( 0 ), width( 0 ), height( 0 )
+    {}
+    tile_t( uint32_t x_, uint32_t y_, uint32_t width_, uint32_t height_ )
+        : x( x_ ), y( y_ ), width( width_ ), height( height_ )
+    {}
+};
+
+uint16_t float_to_half( float f );
+float half_to_float( uint16_t h );
+
+class Framebuffer
+{
+private:
+    size_t                  m_width;
+    size_t                  m_height;
+    size_t                  m_tile_size;
+    size_t                  m_tiles_x;
+    size_t                  m_pixels;
+    framebuffer_layout_t    m_layout;
+    framebuffer_format_t    m_format;
+    void*                   m_data;
+
+    size_t index( size_t x, size_t y ) const;
+    void store( size_t i, const Color & c );
+    Color load( size_t i ) const;
+
+    Framebuffer( const Framebuffer & );
+    Framebuffer & operator=( const Framebuffer & );
+public:
+    Framebuffer();
+    ~Framebuffer();
+
+    //tile_size должен быть степенью двойки для FRAMEBUFFER_MORTON. При first_touch память
+    //не заполняется, страницы тайлов размещает clear_tile() в потоке, который их рендерит
+    void init( size_t width, size_t height, size_t tile_size, framebuffer_layout_t layout, framebuffer_format_t format,
+               bool first_touch = false );
+    void clear();
+    void clear_tile( const tile_t & tile );
+
+    size_t width() const
+    {
+        return m_width;
+    }
+    size_t height() const
+    {
+        return m_height;
+    }
+
+    //читает тайл в локальный буфер потока
+    void fetch_tile( const tile_t & tile, Color * pixels, size_t stride ) const;
+    //копирует готовый тайл из локального буфера потока, stride - длина строки буфера в пикселях
+    void commit_tile( const tile_t & tile, const Color * pixels, size_t stride );
+    Color pixel( size_t x, size_t y ) const;
+    //построчная копия в image для сохранения
+    void resolve( image_t & image ) const;
+};
+
+#endif // FRAMEBUFFER_HPP
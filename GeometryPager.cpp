@@ -0,0 +1,666 @@
+#include "GeometryPager.hpp"
+#include "Trace.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+
+static const char g_magic[ 8 ] = { 'R', 'T', 'G', 'E', 'O', 'M', 0, 0 };
+
+struct GeometryPager::primitive_ref_t
+{
+	uint32_t    type;
+	uint32_t    index;
+	float       min[ 3 ];
+	float       max[ 3 ];
+
+	float center( int axis ) const
+	{
+		return ( min[ axis ] + max[ axis ] ) * 0.5f;
+	}
+};
+
+static size_t padded( size_t count )
+{
+	return ( count + 3 ) & ~( size_t )3;
+}
+
+static size_t align( size_t offset, size_t alignment )
+{
+	return ( offset + alignment - 1 ) & ~( alignment - 1 );
+}
+
+namespace
+{
+
+//собирает столбцы примитивов indices в буфер чанка
+struct column_gather_t
+{
+	std::vector< uint8_t > &        chunk;
+	const std::vector< uint32_t > & indices;
+
+	column_gather_t( std::vector< uint8_t > & chunk_, const std::vector< uint32_t > & indices_ )
+		: chunk( chunk_ ), indices( indices_ )
+	{}
+
+	template< class T >
+	void operator()( const SoaColumn< T > & column )
+	{
+		size_t offset = align( chunk.size(), GEOMETRY_COLUMN_ALIGN );
+		chunk.resize( offset + padded( indices.size() ) * sizeof( T ), 0 );
+		T * values = ( T* )&chunk[ offset ];
+		for( size_t i = 0; i < indices.size(); i++ )
+			values[ i ] = column[ indices[ i ] ];
+	}
+};
+
+//подключает столбцы к буферу загруженного чанка, раскладка та же, что у column_gather_t
+struct column_attach_t
+{
+	const uint8_t * data;
+	size_t          offset;
+	size_t          count;
+
+	column_attach_t( const uint8_t * data_ )
+		: data( data_ ), offset( 0 ), count( 0 )
+	{}
+
+	template< class T >
+	void operator()( SoaColumn< T > & column )
+	{
+		offset = align( offset, GEOMETRY_COLUMN_ALIGN );
+		column.attach( ( const T* )( data + offset ), padded( count ) );
+		offset += padded( count ) * sizeof( T );
+	}
+};
+
+//размер чанка в байтах по числу примитивов, без выравнивания конца
+struct column_size_t
+{
+	size_t  offset;
+	size_t  count;
+
+	column_size_t()
+		: offset( 0 ), count( 0 )
+	{}
+
+	template< class T >
+	void operator()( const SoaColumn< T > & )
+	{
+		offset = align( offset, GEOMETRY_COLUMN_ALIGN ) + padded( count ) * sizeof( T );
+	}
+};
+
+}
+
+GeometryPager::GeometryPager()
+	: m_chunks( NULL ), m_chunks_count( 0 ), m_fd( -1 ), m_budget( 0 ), m_resident_bytes( 0 ), m_clock( 0 ),
+	  m_loads( 0 ), m_evictions( 0 ), m_bytes_read( 0 )
+{
+	pthread_rwlock_init( &m_lock, NULL );
+}
+
+GeometryPager::~GeometryPager()
+{
+	close();
+	pthread_rwlock_destroy( &m_lock );
+}
+
+void GeometryPager::collect( const Scene & scene, std::vector< primitive_ref_t > & refs )
+{
+	const SphereArray & s = scene.m_spheres;
+	for( size_t i = 0; i < s.count; i++ )
+	{
+		primitive_ref_t r;
+		r.type = PRIMITIVE_SPHERE;
+		r.index = i;
+		float radius = sqrt( s.r2[ i ] );
+		float c[ 3 ] = { s.cx[ i ], s.cy[ i ], s.cz[ i ] };
+		for( int k = 0; k < 3; k++ )
+		{
+			r.min[ k ] = c[ k ] - radius;
+			r.max[ k ] = c[ k ] + radius;
+		}
+		refs.push_back( r );
+	}
+
+	const QuadArray & q = scene.m_quads;
+	for( size_t i = 0; i < q.count; i++ )
+	{
+		primitive_ref_t r;
+		r.type = PRIMITIVE_QUAD;
+		r.index = i;
+		float c[ 3 ] = { q.cx[ i ], q.cy[ i ], q.cz[ i ] };
+		float e[ 3 ] = { fabsf( q.ux[ i ] ) * q.hw[ i ] + fabsf( q.vx[ i ] ) * q.hh[ i ],
+						 fabsf( q.uy[ i ] ) * q.hw[ i ] + fabsf( q.vy[ i ] ) * q.hh[ i ],
+						 fabsf( q.uz[ i ] ) * q.hw[ i ] + fabsf( q.vz[ i ] ) * q.hh[ i ] };
+		for( int k = 0; k < 3; k++ )
+		{
+			r.min[ k ] = c[ k ] - e[ k ] - EPSILON;
+			r.max[ k ] = c[ k ] + e[ k ] + EPSILON;
+		}
+		refs.push_back( r );
+	}
+
+	const BoxArray & b = scene.m_boxes;
+	for( size_t i = 0; i < b.count; i++ )
+	{
+		primitive_ref_t r;
+		r.type = PRIMITIVE_BOX;
+		r.index = i;
+		float c[ 3 ] = { b.cx[ i ], b.cy[ i ], b.cz[ i ] };
+		float e[ 3 ] = { fabsf( b.a0x[ i ] ) * b.h0[ i ] + fabsf( b.a1x[ i ] ) * b.h1[ i ] + fabsf( b.a2x[ i ] ) * b.h2[ i ],
+						 fabsf( b.a0y[ i ] ) * b.h0[ i ] + fabsf( b.a1y[ i ] ) * b.h1[ i ] + fabsf( b.a2y[ i ] ) * b.h2[ i ],
+						 fabsf( b.a0z[ i ] ) * b.h0[ i ] + fabsf( b.a1z[ i ] ) * b.h1[ i ] + fabsf( b.a2z[ i ] ) * b.h2[ i ] };
+		for( int k = 0; k < 3; k++ )
+		{
+			r.min[ k ] = c[ k ] - e[ k ];
+			r.max[ k ] = c[ k ] + e[ k ];
+		}
+		refs.push_back( r );
+	}
+}
+
+struct ref_center_less_t
+{
+	int axis;
+
+	template< class R >
+	bool operator()( const R & a, const R & b ) const
+	{
+		return a.center( axis ) < b.center( axis );
+	}
+};
+
+//делит примитивы пополам по медиане центров вдоль самой длинной оси, пока в части больше
+//chunk_primitives; leaves получает концы листьев, листья идут в порядке обхода в глубину,
+//поэтому близкие в пространстве чанки оказываются рядом и в файле
+void GeometryPager::split( std::vector< primitive_ref_t > & refs, size_t begin, size_t end, size_t chunk_primitives,
+						   std::vector< size_t > & leaves )
+{
+	if ( end - begin <= chunk_primitives )
+	{
+		leaves.push_back( end );
+		return;
+	}
+	float lo[ 3 ] = { INFINITY, INFINITY, INFINITY };
+	float hi[ 3 ] = { -INFINITY, -INFINITY, -INFINITY };
+	for( size_t i = begin; i < end; i++ )
+		for( int k = 0; k < 3; k++ )
+		{
+			lo[ k ] = std::min( lo[ k ], refs[ i ].center( k ) );
+			hi[ k ] = std::max( hi[ k ], refs[ i ].center( k ) );
+		}
+	ref_center_less_t less;
+	less.axis = 0;
+	for( int k = 1; k < 3; k++ )
+		if ( hi[ k ] - lo[ k ] > hi[ less.axis ] - lo[ less.axis ] )
+			less.axis = k;
+	size_t middle = begin + ( end - begin ) / 2;
+	std::nth_element( refs.begin() + begin, refs.begin() + middle, refs.begin() + end, less );
+	split( refs, begin, middle, chunk_primitives, leaves );
+	split( refs, middle, end, chunk_primitives, leaves );
+}
+
+bool GeometryPager::write( const std::string & file_name, const Scene & scene, size_t chunk_primitives )
+{
+	std::vector< primitive_ref_t > refs;
+	collect( scene, refs );
+	std::vector< size_t > leaves;
+	if ( !refs.empty() )
+		split( refs, 0, refs.size(), std::max< size_t >( chunk_primitives, 1 ), leaves );
+
+	FILE * f = fopen( file_name.c_str(), "wb" );
+	if ( !f )
+		return false;
+
+	geometry_file_header_t header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, g_magic, sizeof( g_magic ) );
+	header.version = GEOMETRY_FILE_VERSION;
+	header.header_size = sizeof( header );
+	header.chunks = leaves.size();
+	header.directory_offset = align( sizeof( header ), GEOMETRY_COLUMN_ALIGN );
+
+	std::vector< geometry_chunk_record_t > directory( leaves.size() );
+	uint64_t offset = align( header.directory_offset + directory.size() * sizeof( geometry_chunk_record_t ), GEOMETRY_CHUNK_ALIGN );
+	bool ok = fseek( f, offset, SEEK_SET ) == 0;
+
+	size_t begin = 0;
+	std::vector< uint8_t > chunk;
+	for( size_t l = 0; ok && l < leaves.size(); l++ )
+	{
+		geometry_chunk_record_t & record = directory[ l ];
+		memset( &record, 0, sizeof( record ) );
+		std::vector< uint32_t > indices[ PRIMITIVE_TYPES ];
+		for( int k = 0; k < 3; k++ )
+		{
+			record.min[ k ] = INFINITY;
+			record.max[ k ] = -INFINITY;
+		}
+		for( size_t i = begin; i < leaves[ l ]; i++ )
+		{
+			indices[ refs[ i ].type ].push_back( refs[ i ].index );
+			for( int k = 0; k < 3; k++ )
+			{
+				record.min[ k ] = std::min( record.min[ k ], refs[ i ].min[ k ] );
+				record.max[ k ] = std::max( record.max[ k ], refs[ i ].max[ k ] );
+			}
+		}
+		begin = leaves[ l ];
+		for( int t = 0; t < PRIMITIVE_TYPES; t++ )
+		{
+			std::sort( indices[ t ].begin(), indices[ t ].end() );
+			record.counts[ t ] = indices[ t ].size();
+			header.counts[ t ] += indices[ t ].size();
+		}
+
+		chunk.clear();
+		column_gather_t spheres( chunk, indices[ PRIMITIVE_SPHERE ] );
+		SphereArray::columns( scene.m_spheres, spheres );
+		column_gather_t quads( chunk, indices[ PRIMITIVE_QUAD ] );
+		QuadArray::columns( scene.m_quads, quads );
+		column_gather_t boxes( chunk, indices[ PRIMITIVE_BOX ] );
+		BoxArray::columns( scene.m_boxes, boxes );
+		for( int t = 0; t < PRIMITIVE_TYPES; t++ )
+		{
+			size_t offset = align( chunk.size(), GEOMETRY_COLUMN_ALIGN );
+			chunk.resize( offset + padded( indices[ t ].size() ) * sizeof( uint32_t ), 0 );
+			if ( !indices[ t ].empty() )
+				memcpy( &chunk[ offset ], indices[ t ].data(), indices[ t ].size() * sizeof( uint32_t ) );
+		}
+		chunk.resize( align( chunk.size(), GEOMETRY_CHUNK_ALIGN ), 0 );
+
+		record.offset = offset;
+		record.bytes = chunk.size();
+		offset += chunk.size();
+		ok = fwrite( chunk.data(), 1, chunk.size(), f ) == chunk.size();
+	}
+
+	header.file_size = offset;
+	ok = ok && fseek( f, 0, SEEK_SET ) == 0 && fwrite( &header, sizeof( header ), 1, f ) == 1;
+	ok = ok && fseek( f, header.directory_offset, SEEK_SET ) == 0 &&
+		 fwrite( directory.data(), sizeof( geometry_chunk_record_t ), directory.size(), f ) == directory.size();
+	ok = fclose( f ) == 0 && ok;
+	printf( "Geometry: %zu primitives in %zu chunks, %llu bytes\n", refs.size(), leaves.size(), ( unsigned long long )offset );
+	return ok;
+}
+
+bool GeometryPager::open( const std::string & file_name, size_t budget )
+{
+	close();
+
+	m_fd = ::open( file_name.c_str(), O_RDONLY );
+	if ( m_fd < 0 )
+		return false;
+
+	geometry_file_header_t header;
+	off_t file_size = lseek( m_fd, 0, SEEK_END );
+	bool valid = pread( m_fd, &header, sizeof( header ), 0 ) == sizeof( header ) &&
+				 memcmp( header.magic, g_magic, sizeof( g_magic ) ) == 0 && header.version == GEOMETRY_FILE_VERSION &&
+				 header.header_size == sizeof( header ) && header.file_size == ( uint64_t )file_size;
+
+	std::vector< geometry_chunk_record_t > directory;
+	if ( valid )
+	{
+		directory.resize( header.chunks );
+		size_t bytes = directory.size() * sizeof( geometry_chunk_record_t );
+		valid = pread( m_fd, directory.data(), bytes, header.directory_offset ) == ( ssize_t )bytes;
+	}
+	const SphereArray spheres;
+	const QuadArray quads;
+	const BoxArray boxes;
+	for( size_t c = 0; valid && c < directory.size(); c++ )
+	{
+		const geometry_chunk_record_t & r = directory[ c ];
+		column_size_t size;
+		size.count = r.counts[ PRIMITIVE_SPHERE ];
+		SphereArray::columns( spheres, size );
+		size.count = r.counts[ PRIMITIVE_QUAD ];
+		QuadArray::columns( quads, size );
+		size.count = r.counts[ PRIMITIVE_BOX ];
+		BoxArray::columns( boxes, size );
+		for( int t = 0; t < PRIMITIVE_TYPES; t++ )
+			size.offset = align( size.offset, GEOMETRY_COLUMN_ALIGN ) + padded( r.counts[ t ] ) * sizeof( uint32_t );
+		valid = r.offset % GEOMETRY_CHUNK_ALIGN == 0 && size.offset <= r.bytes && r.offset <= header.file_size &&
+				r.bytes <= header.file_size - r.offset;
+	}
+	if ( !valid )
+	{
+		fprintf( stderr, "%s: not a valid geometry file\n", file_name.c_str() );
+		close();
+		return false;
+	}
+
+	m_chunks_count = directory.size();
+	m_chunks = new chunk_t[ m_chunks_count ];
+	for( uint32_t c = 0; c < m_chunks_count; c++ )
+	{
+		m_chunks[ c ].record = directory[ c ];
+		m_chunks[ c ].geometry = NULL;
+		m_chunks[ c ].data = NULL;
+		m_chunks[ c ].last_used = 0;
+		m_chunks[ c ].pins = 0;
+	}
+	m_budget = budget;
+	return true;
+}
+
+void GeometryPager::close()
+{
+	for( uint32_t c = 0; c < m_chunks_count; c++ )
+	{
+		delete m_chunks[ c ].geometry;
+		free( m_chunks[ c ].data );
+	}
+	delete[] m_chunks;
+	m_chunks = NULL;
+	m_chunks_count = 0;
+	m_resident_bytes = 0;
+	if ( m_fd >= 0 )
+		::close( m_fd );
+	m_fd = -1;
+}
+
+void GeometryPager::begin_trace() const
+{
+	pthread_rwlock_rdlock( &m_lock );
+}
+
+void GeometryPager::end_trace() const
+{
+	pthread_rwlock_unlock( &m_lock );
+}
+
+bool GeometryPager::hit_bounds( const chunk_t & chunk, const Ray & ray, float max_t, float & t, float margin ) const
+{
+	const float o[ 3 ] = { ray.start_point.x, ray.start_point.y, ray.start_point.z };
+	const float d[ 3 ] = { ray.vector.x, ray.vector.y, ray.vector.z };
+	float t0 = 0.0f;
+	float t1 = max_t;
+	for( int k = 0; k < 3; k++ )
+	{
+		float inv = 1.0f / d[ k ];
+		float a = ( chunk.record.min[ k ] - margin - o[ k ] ) * inv;
+		float b = ( chunk.record.max[ k ] + margin - o[ k ] ) * inv;
+		if ( a > b )
+			std::swap( a, b );
+		//NaN при нулевой компоненте направления и начале на грани не отбрасывает чанк
+		t0 = a > t0 ? a : t0;
+		t1 = b < t1 ? b : t1;
+		if ( t0 > t1 )
+			return false;
+	}
+	t = t0;
+	return true;
+}
+
+bool GeometryPager::intersect( const Ray & ray, Intersection & intersection, std::vector< uint32_t > & missing ) const
+{
+	uint64_t now = m_clock.load( std::memory_order_relaxed );
+	float best = INFINITY;
+	bool found = false;
+	//незагруженные чанки на пути луча и расстояние до них
+	uint32_t skipped[ 16 ];
+	float skipped_t[ 16 ];
+	size_t skipped_count = 0;
+	for( uint32_t c = 0; c < m_chunks_count; c++ )
+	{
+		const chunk_t & chunk = m_chunks[ c ];
+		float t;
+		if ( !hit_bounds( chunk, ray, best, t ) )
+			continue;
+		if ( !chunk.geometry )
+		{
+			if ( skipped_count < 16 )
+			{
+				skipped[ skipped_count ] = c;
+				skipped_t[ skipped_count++ ] = t;
+			}
+			else
+				missing.push_back( c );
+			continue;
+		}
+		const_cast< std::atomic< uint64_t >& >( chunk.last_used ).store( now, std::memory_order_relaxed );
+		Intersection local;
+		if ( !chunk.geometry->intersect( ray, local ) || local.distance > best )
+			continue;
+		local.index = chunk.ids[ local.type ][ local.index ];
+		//при равных расстояниях выбор как у Scene::intersect: меньший тип, затем меньший индекс
+		if ( local.distance == best && ( local.type > intersection.type ||
+			 ( local.type == intersection.type && local.index > intersection.index ) ) )
+			continue;
+		best = local.distance;
+		intersection = local;
+		found = true;
+	}
+	for( size_t i = 0; i < skipped_count; i++ )
+		if ( skipped_t[ i ] < best )
+			missing.push_back( skipped[ i ] );
+	return found;
+}
+
+bool GeometryPager::occluded( const Ray & ray, const float & max_distance, std::vector< uint32_t > & missing ) const
+{
+	uint64_t now = m_clock.load( std::memory_order_relaxed );
+	size_t first_missing = missing.size();
+	for( uint32_t c = 0; c < m_chunks_count; c++ )
+	{
+		const chunk_t & chunk = m_chunks[ c ];
+		float t;
+		if ( !hit_bounds( chunk, ray, max_distance, t ) )
+			continue;
+		if ( !chunk.geometry )
+		{
+			missing.push_back( c );
+			continue;
+		}
+		const_cast< std::atomic< uint64_t >& >( chunk.last_used ).store( now, std::memory_order_relaxed );
+		if ( chunk.geometry->occluded( ray, max_distance ) )
+		{
+			//ответ окончательный, незагруженные чанки не нужны
+			missing.resize( first_missing );
+			return true;
+		}
+	}
+	return false;
+}
+
+//капсула радиуса radius вокруг отрезка не задевает чанк, если отрезок проходит мимо чанка,
+//расширенного на radius
+shadow_bound_t GeometryPager::shadow_bound( const Vector & point, const Vector & center, float radius ) const
+{
+	uint64_t now = m_clock.load( std::memory_order_relaxed );
+	Ray ray( center, point );
+	float length = point.distance( center );
+	bool unknown = false;
+	for( uint32_t c = 0; c < m_chunks_count; c++ )
+	{
+		const chunk_t & chunk = m_chunks[ c ];
+		float t;
+		if ( !hit_bounds( chunk, ray, length, t, radius + EPSILON ) )
+			continue;
+		if ( !chunk.geometry )
+		{
+			unknown = true;
+			continue;
+		}
+		const_cast< std::atomic< uint64_t >& >( chunk.last_used ).store( now, std::memory_order_relaxed );
+		shadow_bound_t bound = chunk.geometry->shadow_bound( point, center, radius );
+		if ( bound == SHADOW_FULL )
+			return SHADOW_FULL;
+		if ( bound == SHADOW_UNKNOWN )
+			unknown = true;
+	}
+	return unknown ? SHADOW_UNKNOWN : SHADOW_NONE;
+}
+
+//освобождает место под incoming байт, вытесняя давно не использованные незакрепленные чанки;
+//вызывается под write lock
+void GeometryPager::evict( size_t incoming )
+{
+	while( m_resident_bytes + incoming > m_budget )
+	{
+		chunk_t * victim = NULL;
+		for( uint32_t c = 0; c < m_chunks_count; c++ )
+		{
+			chunk_t & chunk = m_chunks[ c ];
+			if ( chunk.geometry && !chunk.pins && ( !victim || chunk.last_used < victim->last_used ) )
+				victim = &chunk;
+		}
+		if ( !victim )
+			return;
+		delete victim->geometry;
+		free( victim->data );
+		victim->geometry = NULL;
+		victim->data = NULL;
+		m_resident_bytes -= victim->record.bytes;
+		m_evictions++;
+	}
+}
+
+bool GeometryPager::load( const std::vector< uint32_t > & chunks, std::vector< uint32_t > & pinned )
+{
+	std::lock_guard< std::mutex > guard( m_load_mutex );
+	uint64_t now = ++m_clock;
+
+	std::vector< uint32_t > sorted( chunks );
+	std::sort( sorted.begin(), sorted.end() );
+	sorted.erase( std::unique( sorted.begin(), sorted.end() ), sorted.end() );
+
+	//номера чанков растут вместе со смещениями в файле
+	std::vector< uint32_t > needed;
+	for( size_t i = 0; i < sorted.size(); i++ )
+	{
+		chunk_t & chunk = m_chunks[ sorted[ i ] ];
+		chunk.pins++;
+		chunk.last_used = now;
+		pinned.push_back( sorted[ i ] );
+		if ( !chunk.geometry )
+			needed.push_back( sorted[ i ] );
+	}
+	if ( needed.empty() )
+		return true;
+	TRACE_SCOPE( "geometry chunk read" );
+
+	//чтение вне write lock, остальные потоки продолжают трассировку; соседние в файле чанки
+	//читаются одним preadv
+	std::vector< void* > buffers( needed.size(), NULL );
+	size_t incoming = 0;
+	for( size_t i = 0; i < needed.size(); )
+	{
+		size_t run = 1;
+		while( i + run < needed.size() && run < IOV_MAX &&
+			   m_chunks[ needed[ i + run - 1 ] ].record.offset + m_chunks[ needed[ i + run - 1 ] ].record.bytes ==
+			   m_chunks[ needed[ i + run ] ].record.offset )
+			run++;
+
+		std::vector< iovec > iov( run );
+		size_t total = 0;
+		for( size_t k = 0; k < run; k++ )
+		{
+			const geometry_chunk_record_t & r = m_chunks[ needed[ i + k ] ].record;
+			if ( posix_memalign( &buffers[ i + k ], GEOMETRY_CHUNK_ALIGN, r.bytes ) )
+				buffers[ i + k ] = NULL;
+			iov[ k ].iov_base = buffers[ i + k ];
+			iov[ k ].iov_len = r.bytes;
+			total += r.bytes;
+		}
+		ssize_t read_bytes = preadv( m_fd, iov.data(), run, m_chunks[ needed[ i ] ].record.offset );
+		if ( read_bytes != ( ssize_t )total )
+		{
+			//короткое чтение - дочитываем по одному чанку
+			for( size_t k = 0; k < run; k++ )
+			{
+				const geometry_chunk_record_t & r = m_chunks[ needed[ i + k ] ].record;
+				size_t done = 0;
+				while( buffers[ i + k ] && done < r.bytes )
+				{
+					ssize_t n = pread( m_fd, ( uint8_t* )buffers[ i + k ] + done, r.bytes - done, r.offset + done );
+					if ( n <= 0 )
+					{
+						free( buffers[ i + k ] );
+						buffers[ i + k ] = NULL;
+						break;
+					}
+					done += n;
+				}
+			}
+		}
+		for( size_t k = 0; k < run; k++ )
+			if ( buffers[ i + k ] )
+				incoming += m_chunks[ needed[ i + k ] ].record.bytes;
+		m_bytes_read += total;
+		i += run;
+	}
+
+	bool ok = true;
+	std::vector< Scene* > geometry( needed.size(), NULL );
+	std::vector< std::vector< const uint32_t* > > ids( needed.size(), std::vector< const uint32_t* >( PRIMITIVE_TYPES, NULL ) );
+	for( size_t i = 0; i < needed.size(); i++ )
+	{
+		if ( !buffers[ i ] )
+		{
+			fprintf( stderr, "can't read geometry chunk %u\n", needed[ i ] );
+			ok = false;
+			continue;
+		}
+		const geometry_chunk_record_t & r = m_chunks[ needed[ i ] ].record;
+		Scene * scene = new Scene();
+		column_attach_t attach( ( const uint8_t* )buffers[ i ] );
+		attach.count = r.counts[ PRIMITIVE_SPHERE ];
+		SphereArray::columns( scene->m_spheres, attach );
+		attach.count = r.counts[ PRIMITIVE_QUAD ];
+		QuadArray::columns( scene->m_quads, attach );
+		attach.count = r.counts[ PRIMITIVE_BOX ];
+		BoxArray::columns( scene->m_boxes, attach );
+		scene->m_spheres.count = r.counts[ PRIMITIVE_SPHERE ];
+		scene->m_quads.count = r.counts[ PRIMITIVE_QUAD ];
+		scene->m_boxes.count = r.counts[ PRIMITIVE_BOX ];
+		for( int t = 0; t < PRIMITIVE_TYPES; t++ )
+		{
+			attach.offset = align( attach.offset, GEOMETRY_COLUMN_ALIGN );
+			ids[ i ][ t ] = ( const uint32_t* )( ( const uint8_t* )buffers[ i ] + attach.offset );
+			attach.offset += padded( r.counts[ t ] ) * sizeof( uint32_t );
+		}
+		geometry[ i ] = scene;
+	}
+
+	pthread_rwlock_wrlock( &m_lock );
+	evict( incoming );
+	for( size_t i = 0; i < needed.size(); i++ )
+	{
+		if ( !geometry[ i ] )
+			continue;
+		chunk_t & chunk = m_chunks[ needed[ i ] ];
+		chunk.geometry = geometry[ i ];
+		chunk.data = buffers[ i ];
+		for( int t = 0; t < PRIMITIVE_TYPES; t++ )
+			chunk.ids[ t ] = ids[ i ][ t ];
+		m_resident_bytes += chunk.record.bytes;
+		m_loads++;
+	}
+	pthread_rwlock_unlock( &m_lock );
+	return ok;
+}
+
+void GeometryPager::release( std::vector< uint32_t > & pinned )
+{
+	std::lock_guard< std::mutex > guard( m_load_mutex );
+	for( size_t i = 0; i < pinned.size(); i++ )
+		m_chunks[ pinned[ i ] ].pins--;
+	pinned.clear();
+}
+
+void GeometryPager::print_stats() const
+{
+	printf( "Geometry chunks %u, loads %llu, evictions %llu, read %.1f MB, resident %.1f MB of %.1f MB\n",
+			m_chunks_count, ( unsigned long long )m_loads, ( unsigned long long )m_evictions, m_bytes_read / 1048576.0,
+			m_resident_bytes / 1048576.0, m_budget / 1048576.0 );
+}
@@ -0,0 +1,125 @@
+#ifndef GEOMETRYPAGER_HPP
+#define GEOMETRYPAGER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Scene.hpp"
+
+#define GEOMETRY_FILE_VERSION 1
+//чанки в файле выровнены по странице, соседние чанки читаются одним вызовом
+#define GEOMETRY_CHUNK_ALIGN 4096
+#define GEOMETRY_COLUMN_ALIGN 64
+
+//Файл геометрии: заголовок, каталог чанков ( границы, смещение, число примитивов каждого
+//типа ), затем сами чанки. Чанк - группа соседних в пространстве примитивов, хранится как
+//столбцы SphereArray, QuadArray, BoxArray ( порядок columns() ), за ними номера примитивов в
+//исходной сцене по типам; каждый массив выровнен на GEOMETRY_COLUMN_ALIGN от начала чанка
+struct geometry_file_header_t
+{
+    char        magic[ 8 ];
+    uint32_t    version;
+    uint32_t    header_size;
+    uint64_t    file_size;
+    uint32_t    chunks;
+    uint32_t    counts[ PRIMITIVE_TYPES ];
+    uint64_t    directory_offset;
+};
+
+struct geometry_chunk_record_t
+{
+    float       min[ 3 ];
+    float       max[ 3 ];
+    uint64_t    offset;
+    //с выравниванием до GEOMETRY_CHUNK_ALIGN
+    uint64_t    bytes;
+    uint32_t    counts[ PRIMITIVE_TYPES ];
+    uint32_t    reserved;
+};
+
+//Подкачка геометрии с диска. В памяти всегда только каталог, чанки загружаются по запросу в
+//кэш ограниченного размера и вытесняются по давности использования. Трассировка не ждет
+//диск: луч, который мог попасть в незагруженный чанк ближе найденного пересечения, отмечает
+//чанк в missing и считается недействительным, вызывающий откладывает выборку и позже
+//загружает недостающие чанки пачкой, в порядке расположения в файле
+class GeometryPager
+{
+private:
+    struct chunk_t
+    {
+        geometry_chunk_record_t record;
+        Scene*                  geometry;
+        void*                   data;
+        //номера примитивов чанка в исходной сцене, по ним Intersection::index
+        const uint32_t*         ids[ PRIMITIVE_TYPES ];
+        std::atomic< uint64_t > last_used;
+        //закреплен load() до release(), не вытесняется
+        uint32_t                pins;
+    };
+    struct primitive_ref_t;
+
+    chunk_t*                m_chunks;
+    uint32_t                m_chunks_count;
+    int                     m_fd;
+    size_t                  m_budget;
+    size_t                  m_resident_bytes;
+    mutable std::atomic< uint64_t > m_clock;
+    //чтение каталога и чанков - под read lock, установка и вытеснение - под write lock
+    mutable pthread_rwlock_t m_lock;
+    //load() и release() выполняются по одному, ввод-вывод идет одним потоком
+    std::mutex              m_load_mutex;
+
+    uint64_t                m_loads;
+    uint64_t                m_evictions;
+    uint64_t                m_bytes_read;
+
+    static void collect( const Scene & scene, std::vector< primitive_ref_t > & refs );
+    static void split( std::vector< primitive_ref_t > & refs, size_t begin, size_t end, size_t chunk_primitives,
+                       std::vector< size_t > & leaves );
+    //границы чанка расширяются на margin
+    bool hit_bounds( const chunk_t & chunk, const Ray & ray, float max_t, float & t, float margin = 0.0f ) const;
+    void evict( size_t incoming );
+
+    GeometryPager( const GeometryPager & );
+    GeometryPager & operator=( const GeometryPager & );
+public:
+    GeometryPager();
+    ~GeometryPager();
+
+    //делит геометрию сцены на чанки не больше chunk_primitives примитивов
+    static bool write( const std::string & file_name, const Scene & scene, size_t chunk_primitives );
+
+    //budget - предел памяти под чанки в байтах; закрепленные чанки могут его временно превысить
+    bool open( const std::string & file_name, size_t budget );
+    void close();
+    bool is_open() const
+    {
+        return m_fd >= 0;
+    }
+
+    //трассировка между begin_trace() и end_trace(), load() вызывается только вне этого интервала
+    void begin_trace() const;
+    void end_trace() const;
+
+    //результат недействителен, если missing пополнился
+    bool intersect( const Ray & ray, Intersection & intersection, std::vector< uint32_t > & missing ) const;
+    bool occluded( const Ray & ray, const float & max_distance, std::vector< uint32_t > & missing ) const;
+    //Scene::shadow_bound по загруженным чанкам, которые задевает капсула вокруг отрезка point - center;
+    //задетый незагруженный чанк дает SHADOW_UNKNOWN, загрузку тогда запросят теневые лучи
+    shadow_bound_t shadow_bound( const Vector & point, const Vector & center, float radius ) const;
+
+    //загружает и закрепляет чанки, повторы в chunks допустимы; pinned пополняется для release().
+    //false, если какой-то чанк не прочитался
+    bool load( const std::vector< uint32_t > & chunks, std::vector< uint32_t > & pinned );
+    void release( std::vector< uint32_t > & pinned );
+
+    void print_stats() const;
+};
+
+#endif // GEOMETRYPAGER_HPP
@@ -0,0 +1,388 @@
+#include "Lightmap.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "Sampler.hpp"
+#include "Trace.hpp"
+
+static const char g_magic[ 8 ] = { 'R', 'T', 'L', 'I', 'G', 'H', 'T', 0 };
+
+//FNV-1a
+static uint64_t hash_bytes( uint64_t h, const void * data, size_t bytes )
+{
+	const uint8_t * p = ( const uint8_t* )data;
+	for( size_t i = 0; i < bytes; i++ )
+		h = ( h ^ p[ i ] ) * 1099511628211ull;
+	return h;
+}
+
+struct column_hash_t
+{
+	uint64_t    hash;
+	size_t      count;
+
+	column_hash_t()
+		: hash( 14695981039346656037ull ), count( 0 )
+	{}
+
+	template< class T >
+	void operator()( const SoaColumn< T > & column )
+	{
+		if ( count )
+			hash = hash_bytes( hash, column.data(), count * sizeof( T ) );
+	}
+};
+
+Lightmap::Lightmap()
+	: m_lights( 0 ), m_density( 0.0f ), m_fingerprint( 0 ), m_scene( NULL ), m_light_list( NULL ), m_next_row( 0 )
+{
+	memset( m_first_chart, 0, sizeof( m_first_chart ) );
+}
+
+uint64_t Lightmap::fingerprint( const Scene & scene, const std::vector< ObjectLight > & lights )
+{
+	column_hash_t h;
+	h.count = scene.m_spheres.count;
+	SphereArray::columns( scene.m_spheres, h );
+	h.count = scene.m_quads.count;
+	QuadArray::columns( scene.m_quads, h );
+	h.count = scene.m_boxes.count;
+	BoxArray::columns( scene.m_boxes, h );
+	for( size_t i = 0; i < lights.size(); i++ )
+	{
+		const ObjectLight & l = lights[ i ];
+		float values[ 16 ] = { ( float )l.m_type, l.m_color.r, l.m_color.g, l.m_color.b,
+							   ( float )l.m_center.x, ( float )l.m_center.y, ( float )l.m_center.z, l.m_radius, l.m_sphere_radius,
+							   ( float )l.m_u.x, ( float )l.m_u.y, ( float )l.m_u.z, ( float )l.m_v.x, ( float )l.m_v.y, ( float )l.m_v.z, 0.0f };
+		h.hash = hash_bytes( h.hash, values, sizeof( values ) );
+	}
+	return h.hash;
+}
+
+static uint32_t chart_size( float length, float density )
+{
+	return std::min< uint32_t >( std::max< uint32_t >( ( uint32_t )ceilf( length * density ), 1 ), LIGHTMAP_MAX_SIZE );
+}
+
+//карты по типам: сферы, прямоугольники, по шесть граней на параллелепипед
+void Lightmap::layout( const Scene & scene )
+{
+	m_first_chart[ PRIMITIVE_SPHERE ] = 0;
+	m_first_chart[ PRIMITIVE_QUAD ] = scene.m_spheres.count;
+	m_first_chart[ PRIMITIVE_BOX ] = scene.m_spheres.count + scene.m_quads.count;
+	m_charts.assign( m_first_chart[ PRIMITIVE_BOX ] + scene.m_boxes.count * 6, lightmap_chart_t() );
+
+	uint64_t texels = 0;
+	for( uint32_t c = 0; c < m_charts.size(); c++ )
+	{
+		lightmap_chart_t & chart = m_charts[ c ];
+		uint32_t material;
+		float width, height;
+		if ( c < m_first_chart[ PRIMITIVE_QUAD ] )
+		{
+			const SphereArray & s = scene.m_spheres;
+			float r = sqrt( s.r2[ c ] );
+			material = s.material[ c ];
+			width = 2.0f * PI * r;
+			height = PI * r;
+		}
+		else if ( c < m_first_chart[ PRIMITIVE_BOX ] )
+		{
+			const QuadArray & q = scene.m_quads;
+			uint32_t i = c - m_first_chart[ PRIMITIVE_QUAD ];
+			material = q.material[ i ];
+			width = 2.0f * q.hw[ i ];
+			height = 2.0f * q.hh[ i ];
+		}
+		else
+		{
+			const BoxArray & b = scene.m_boxes;
+			uint32_t i = ( c - m_first_chart[ PRIMITIVE_BOX ] ) / 6;
+			uint32_t axis = ( ( c - m_first_chart[ PRIMITIVE_BOX ] ) % 6 ) / 2;
+			float h[ 3 ] = { b.h0[ i ], b.h1[ i ], b.h2[ i ] };
+			material = b.material[ i ];
+			width = 2.0f * h[ ( axis + 1 ) % 3 ];
+			height = 2.0f * h[ ( axis + 2 ) % 3 ];
+		}
+		chart.first_texel = texels;
+		if ( !( scene.material( material ).m_features & ( MATERIAL_DIFFUSE | MATERIAL_SPECULAR ) ) )
+			continue;
+		chart.width = chart_size( width, m_density );
+		chart.height = chart_size( height, m_density );
+		texels += ( uint64_t )chart.width * chart.height;
+	}
+	m_irradiance.assign( texels * 3, 0.0f );
+	m_visibility.assign( texels * m_lights, 0.0f );
+}
+
+uint32_t Lightmap::chart_of( uint32_t type, uint32_t index, uint32_t face ) const
+{
+	if ( type == PRIMITIVE_BOX )
+		return m_first_chart[ PRIMITIVE_BOX ] + index * 6 + face;
+	return m_first_chart[ type ] + index;
+}
+
+//точка и нормаль поверхности по координатам карты, обратное к fill_intersection
+void Lightmap::surface( uint32_t c, float u, float v, Vector & point, Vector & normal ) const
+{
+	const Scene & scene = *m_scene;
+	if ( c < m_first_chart[ PRIMITIVE_QUAD ] )
+	{
+		const SphereArray & s = scene.m_spheres;
+		float phi = ( u - 0.5f ) * 2.0f * PI;
+		float theta = v * PI;
+		normal = Vector( sin( theta ) * cos( phi ), sin( theta ) * sin( phi ), cos( theta ) );
+		point = Vector( s.cx[ c ], s.cy[ c ], s.cz[ c ] ) + normal.scalar( sqrt( s.r2[ c ] ) );
+	}
+	else if ( c < m_first_chart[ PRIMITIVE_BOX ] )
+	{
+		const QuadArray & q = scene.m_quads;
+		uint32_t i = c - m_first_chart[ PRIMITIVE_QUAD ];
+		normal = Vector( q.nx[ i ], q.ny[ i ], q.nz[ i ] );
+		point = Vector( q.cx[ i ], q.cy[ i ], q.cz[ i ] ) +
+				Vector( q.ux[ i ], q.uy[ i ], q.uz[ i ] ).scalar( ( 2.0f * u - 1.0f ) * q.hw[ i ] ) +
+				Vector( q.vx[ i ], q.vy[ i ], q.vz[ i ] ).scalar( ( 2.0f * v - 1.0f ) * q.hh[ i ] );
+	}
+	else
+	{
+		const BoxArray & b = scene.m_boxes;
+		uint32_t i = ( c - m_first_chart[ PRIMITIVE_BOX ] ) / 6;
+		uint32_t face = ( c - m_first_chart[ PRIMITIVE_BOX ] ) % 6;
+		uint32_t axis = face / 2;
+		uint32_t k1 = ( axis + 1 ) % 3;
+		uint32_t k2 = ( axis + 2 ) % 3;
+		Vector axes[ 3 ] = { Vector( b.a0x[ i ], b.a0y[ i ], b.a0z[ i ] ),
+							 Vector( b.a1x[ i ], b.a1y[ i ], b.a1z[ i ] ),
+							 Vector( b.a2x[ i ], b.a2y[ i ], b.a2z[ i ] ) };
+		float h[ 3 ] = { b.h0[ i ], b.h1[ i ], b.h2[ i ] };
+		normal = axes[ axis ].scalar( face & 1 ? 1.0f : -1.0f );
+		point = Vector( b.cx[ i ], b.cy[ i ], b.cz[ i ] ) + normal.scalar( h[ axis ] ) +
+				axes[ k1 ].scalar( ( 2.0f * u - 1.0f ) * h[ k1 ] ) + axes[ k2 ].scalar( ( 2.0f * v - 1.0f ) * h[ k2 ] );
+	}
+}
+
+//как RayTracer::light_visibility, но с большим числом выборок и без сэмплера пикселя
+float Lightmap::visibility( const ObjectLight & light, const Vector & point, uint32_t seed ) const
+{
+	if ( !light.is_area() )
+		return m_scene->occluded( Ray( light.m_center, point ), point.distance( light.m_center ) ) ? 0.0f : 1.0f;
+
+	SampleSequence sequence( 0, seed, 0.0f, 0.0f );
+	uint32_t visible = 0;
+	uint32_t count = 0;
+	for( ; count < LIGHTMAP_LIGHT_SAMPLES; count++ )
+	{
+		if ( count == LIGHTMAP_FIRST_SAMPLES && ( visible == 0 || visible == count ) )
+			break;
+		float s, t;
+		sequence.point( count, s, t );
+		Vector target = light.sample( point, s, t );
+		if ( !m_scene->occluded( Ray( target, point ), point.distance( target ) ) )
+			visible++;
+	}
+	return ( float )visible / ( float )count;
+}
+
+//освещенность суммируется так же, как в RayTracer::shade
+void Lightmap::bake_rows()
+{
+	const std::vector< ObjectLight > & lights = *m_light_list;
+	for( size_t r = m_next_row++; r < m_rows.size(); r = m_next_row++ )
+	{
+		const lightmap_chart_t & chart = m_charts[ m_rows[ r ].chart ];
+		uint32_t y = m_rows[ r ].y;
+		for( uint32_t x = 0; x < chart.width; x++ )
+		{
+			uint64_t texel = chart.first_texel + ( uint64_t )y * chart.width + x;
+			Vector point, normal;
+			surface( m_rows[ r ].chart, ( x + 0.5f ) / chart.width, ( y + 0.5f ) / chart.height, point, normal );
+			Color irradiance;
+			for( uint32_t l = 0; l < m_lights; l++ )
+			{
+				float visible = visibility( lights[ l ], point, hash_combine( hash32( texel ), l ) );
+				m_visibility[ texel * m_lights + l ] = visible;
+				if ( visible == 0.0f )
+					continue;
+				Vector from_light = point - lights[ l ].m_center;
+				float attenuation = 1.0f - saturated( from_light.dot( from_light ) / lights[ l ].m_radius / lights[ l ].m_radius );
+				if ( attenuation < EPSILON )
+					continue;
+				Ray to_light( lights[ l ].m_center, point );
+				float angle_cos = to_light.vector.dot( normal );
+				if ( angle_cos > 0.0f )
+					irradiance = irradiance + lights[ l ].m_color * angle_cos * attenuation * visible;
+			}
+			m_irradiance[ texel * 3 ] = irradiance.r;
+			m_irradiance[ texel * 3 + 1 ] = irradiance.g;
+			m_irradiance[ texel * 3 + 2 ] = irradiance.b;
+		}
+	}
+}
+
+bool Lightmap::bake( const Scene & scene, const std::vector< ObjectLight > & lights, float density, uint32_t threads )
+{
+	TRACE_SCOPE( "lightmap bake" );
+	if ( lights.size() > LIGHTMAP_MAX_LIGHTS )
+	{
+		fprintf( stderr, "lightmap: at most %d lights\n", LIGHTMAP_MAX_LIGHTS );
+		return false;
+	}
+	m_lights = lights.size();
+	m_density = density;
+	m_fingerprint = fingerprint( scene, lights );
+	layout( scene );
+
+	m_scene = &scene;
+	m_light_list = &lights;
+	m_rows.clear();
+	for( uint32_t c = 0; c < m_charts.size(); c++ )
+		for( uint32_t y = 0; y < m_charts[ c ].height; y++ )
+		{
+			bake_row_t row = { c, y };
+			m_rows.push_back( row );
+		}
+	m_next_row = 0;
+	std::vector< std::thread > workers;
+	for( uint32_t t = 0; t < std::max< uint32_t >( threads, 1 ); t++ )
+		workers.push_back( std::thread( &Lightmap::bake_rows, this ) );
+	for( size_t t = 0; t < workers.size(); t++ )
+		workers[ t ].join();
+	m_rows.clear();
+	m_scene = NULL;
+	m_light_list = NULL;
+
+	printf( "Lightmap: %zu charts, %zu texels\n", m_charts.size(), m_irradiance.size() / 3 );
+	return true;
+}
+
+bool Lightmap::write( const std::string & file_name ) const
+{
+	lightmap_header_t header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, g_magic, sizeof( g_magic ) );
+	header.version = LIGHTMAP_FILE_VERSION;
+	header.header_size = sizeof( header );
+	header.fingerprint = m_fingerprint;
+	header.counts[ PRIMITIVE_SPHERE ] = m_first_chart[ PRIMITIVE_QUAD ];
+	header.counts[ PRIMITIVE_QUAD ] = m_first_chart[ PRIMITIVE_BOX ] - m_first_chart[ PRIMITIVE_QUAD ];
+	header.counts[ PRIMITIVE_BOX ] = ( m_charts.size() - m_first_chart[ PRIMITIVE_BOX ] ) / 6;
+	header.lights = m_lights;
+	header.charts = m_charts.size();
+	header.density = m_density;
+	header.texels = m_irradiance.size() / 3;
+	header.charts_offset = sizeof( header );
+	header.irradiance_offset = header.charts_offset + m_charts.size() * sizeof( lightmap_chart_t );
+	header.visibility_offset = header.irradiance_offset + m_irradiance.size() * sizeof( float );
+	header.file_size = header.visibility_offset + m_visibility.size() * sizeof( float );
+
+	FILE * f = fopen( file_name.c_str(), "wb" );
+	if ( !f )
+		return false;
+	bool ok = fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+			  fwrite( m_charts.data(), sizeof( lightmap_chart_t ), m_charts.size(), f ) == m_charts.size() &&
+			  fwrite( m_irradiance.data(), sizeof( float ), m_irradiance.size(), f ) == m_irradiance.size() &&
+			  fwrite( m_visibility.data(), sizeof( float ), m_visibility.size(), f ) == m_visibility.size();
+	ok = fclose( f ) == 0 && ok;
+	return ok;
+}
+
+bool Lightmap::load( const std::string & file_name, const Scene & scene, const std::vector< ObjectLight > & lights )
+{
+	FILE * f = fopen( file_name.c_str(), "rb" );
+	if ( !f )
+		return false;
+	lightmap_header_t header;
+	bool ok = fread( &header, sizeof( header ), 1, f ) == 1 &&
+			  memcmp( header.magic, g_magic, sizeof( g_magic ) ) == 0 && header.version == LIGHTMAP_FILE_VERSION &&
+			  header.header_size == sizeof( header ) && header.lights == lights.size() && header.lights <= LIGHTMAP_MAX_LIGHTS &&
+			  header.counts[ PRIMITIVE_SPHERE ] == scene.m_spheres.count && header.counts[ PRIMITIVE_QUAD ] == scene.m_quads.count &&
+			  header.counts[ PRIMITIVE_BOX ] == scene.m_boxes.count && header.fingerprint == fingerprint( scene, lights );
+	if ( ok )
+	{
+		m_lights = header.lights;
+		m_density = header.density;
+		m_fingerprint = header.fingerprint;
+		layout( scene );
+		ok = header.charts == m_charts.size() && header.texels * 3 == m_irradiance.size() &&
+			 fseek( f, header.charts_offset, SEEK_SET ) == 0 &&
+			 fread( m_charts.data(), sizeof( lightmap_chart_t ), m_charts.size(), f ) == m_charts.size() &&
+			 fseek( f, header.irradiance_offset, SEEK_SET ) == 0 &&
+			 fread( m_irradiance.data(), sizeof( float ), m_irradiance.size(), f ) == m_irradiance.size() &&
+			 fseek( f, header.visibility_offset, SEEK_SET ) == 0 &&
+			 fread( m_visibility.data(), sizeof( float ), m_visibility.size(), f ) == m_visibility.size();
+		for( size_t c = 0; ok && c < m_charts.size(); c++ )
+			ok = m_charts[ c ].first_texel + ( uint64_t )m_charts[ c ].width * m_charts[ c ].height <= header.texels;
+	}
+	fclose( f );
+	if ( !ok )
+	{
+		fprintf( stderr, "%s: lightmap does not match the scene\n", file_name.c_str() );
+		m_charts.clear();
+		m_irradiance.clear();
+		m_visibility.clear();
+	}
+	return ok;
+}
+
+bool Lightmap::lookup( const Intersection & intersection, Color & irradiance, float * visibility ) const
+{
+	if ( m_charts.empty() || intersection.type >= PRIMITIVE_TYPES )
+		return false;
+	const lightmap_chart_t & chart = m_charts[ chart_of( intersection.type, intersection.index, intersection.face ) ];
+	if ( !chart.width )
+		return false;
+
+	float u = intersection.u;
+	float v = intersection.v;
+	bool wrap = intersection.type == PRIMITIVE_SPHERE;
+	if ( wrap )
+	{
+		const Vector & n = intersection.normal;
+		u = atan2( n.y, n.x ) / ( 2.0f * PI ) + 0.5f;
+		v = acos( std::min( std::max( ( float )n.z, -1.0f ), 1.0f ) ) / PI;
+	}
+
+	float fx = u * chart.width - 0.5f;
+	float fy = v * chart.height - 0.5f;
+	int32_t x0 = floorf( fx );
+	int32_t y0 = floorf( fy );
+	float tx = fx - x0;
+	float ty = fy - y0;
+	int32_t x1 = x0 + 1;
+	int32_t y1 = y0 + 1;
+	int32_t w = chart.width;
+	int32_t h = chart.height;
+	if ( wrap )
+	{
+		x0 = ( x0 + w ) % w;
+		x1 = x1 % w;
+	}
+	else
+	{
+		x0 = std::min( std::max( x0, 0 ), w - 1 );
+		x1 = std::min( std::max( x1, 0 ), w - 1 );
+	}
+	y0 = std::min( std::max( y0, 0 ), h - 1 );
+	y1 = std::min( std::max( y1, 0 ), h - 1 );
+
+	uint64_t texels[ 4 ] = { chart.first_texel + ( uint64_t )y0 * w + x0, chart.first_texel + ( uint64_t )y0 * w + x1,
+							 chart.first_texel + ( uint64_t )y1 * w + x0, chart.first_texel + ( uint64_t )y1 * w + x1 };
+	float weights[ 4 ] = { ( 1.0f - tx ) * ( 1.0f - ty ), tx * ( 1.0f - ty ), ( 1.0f - tx ) * ty, tx * ty };
+	irradiance = Color();
+	for( uint32_t l = 0; l < m_lights; l++ )
+		visibility[ l ] = 0.0f;
+	for( int k = 0; k < 4; k++ )
+	{
+		const float * e = &m_irradiance[ texels[ k ] * 3 ];
+		irradiance = irradiance + Color( e[ 0 ], e[ 1 ], e[ 2 ] ) * weights[ k ];
+		const float * vis = &m_visibility[ texels[ k ] * m_lights ];
+		for( uint32_t l = 0; l < m_lights; l++ )
+			visibility[ l ] += vis[ l ] * weights[ k ];
+	}
+	return true;
+}
@@ -0,0 +1,114 @@
+#ifndef LIGHTMAP_HPP
+#define LIGHTMAP_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Scene.hpp"
+#include "Object.hpp"
+
+#define LIGHTMAP_FILE_VERSION 1
+#define LIGHTMAP_MAX_LIGHTS 8
+//наибольшая сторона карты в текселях
+#define LIGHTMAP_MAX_SIZE 1024
+//выборок на протяженном источнике и сколько из них трассируется до проверки на полутень
+#define LIGHTMAP_LIGHT_SAMPLES 64
+#define LIGHTMAP_FIRST_SAMPLES 4
+
+//Файл: заголовок, описания карт, освещенность ( три float на тексель ), видимость источников
+//( lights float на тексель ). Отпечаток - хэш геометрии и источников, по нему отвергается
+//файл, запеченный для другой сцены
+struct lightmap_header_t
+{
+    char        magic[ 8 ];
+    uint32_t    version;
+    uint32_t    header_size;
+    uint64_t    file_size;
+    uint64_t    fingerprint;
+    uint32_t    counts[ PRIMITIVE_TYPES ];
+    uint32_t    lights;
+    uint32_t    charts;
+    float       density;
+    uint64_t    texels;
+    uint64_t    charts_offset;
+    uint64_t    irradiance_offset;
+    uint64_t    visibility_offset;
+};
+
+//width == 0 - карты нет, материал без диффузной и бликовой составляющих
+struct lightmap_chart_t
+{
+    uint32_t    width;
+    uint32_t    height;
+    uint64_t    first_texel;
+};
+
+//Запеченное прямое освещение статической сцены. Карта есть у каждого прямоугольника, у каждой
+//грани параллелепипеда ( в координатах u, v пересечения ) и у каждой сферы ( широта и долгота
+//нормали ). В текселе - диффузная освещенность без цвета материала, как ее суммирует шейдер,
+//и видимость каждого источника для бликов. Значения в точке пересечения интерполируются
+//билинейно между центрами текселей, теневые лучи при рендеринге не нужны
+class Lightmap
+{
+private:
+    struct bake_row_t
+    {
+        uint32_t    chart;
+        uint32_t    y;
+    };
+
+    std::vector< lightmap_chart_t > m_charts;
+    std::vector< float >            m_irradiance;
+    std::vector< float >            m_visibility;
+    uint32_t                        m_lights;
+    uint32_t                        m_first_chart[ PRIMITIVE_TYPES ];
+    float                           m_density;
+    uint64_t                        m_fingerprint;
+
+    //состояние запекания
+    const Scene*                        m_scene;
+    const std::vector< ObjectLight >*   m_light_list;
+    std::vector< bake_row_t >           m_rows;
+    std::atomic< size_t >               m_next_row;
+
+    void layout( const Scene & scene );
+    //карта примитива, face - грань параллелепипеда
+    uint32_t chart_of( uint32_t type, uint32_t index, uint32_t face ) const;
+    void surface( uint32_t chart, float u, float v, Vector & point, Vector & normal ) const;
+    float visibility( const ObjectLight & light, const Vector & point, uint32_t seed ) const;
+    void bake_rows();
+
+    Lightmap( const Lightmap & );
+    Lightmap & operator=( const Lightmap & );
+public:
+    Lightmap();
+
+    //хэш геометрии и источников сцены
+    static uint64_t fingerprint( const Scene & scene, const std::vector< ObjectLight > & lights );
+
+    //density - текселей на единицу длины поверхности
+    bool bake( const Scene & scene, const std::vector< ObjectLight > & lights, float density, uint32_t threads );
+    bool write( const std::string & file_name ) const;
+    //false, если файла нет или он запечен для другой сцены
+    bool load( const std::string & file_name, const Scene & scene, const std::vector< ObjectLight > & lights );
+
+    bool empty() const
+    {
+        return m_charts.empty();
+    }
+    //освещение больше не соответствует источникам, например после их изменения
+    void clear()
+    {
+        m_charts.clear();
+        m_irradiance.clear();
+        m_visibility.clear();
+    }
+
+    //освещенность и видимость источников в точке пересечения, false - у примитива нет карты
+    bool lookup( const Intersection & intersection, Color & irradiance, float * visibility ) const;
+};
+
+#endif // LIGHTMAP_HPP
@@ -2,6 +2,22 @@
 #define MATERIAL_HPP
 #include "Color.hpp"
 #include "Texture.hpp"
+#include "FastMath.hpp"
+
+//коэффициент отражения exp( -beta ), ниже которого отраженный луч не трассируется: вклад
+//отражения с яркостью до 1 меньше четверти уровня 8-битного цвета
+#define MATERIAL_MIN_REFLECTION ( 1.0f / 1024.0f )
+
+//наборы возможностей материала, по ним выбирается специализированное ядро шейдинга
+enum material_feature_t
+{
+    MATERIAL_DIFFUSE    = 1,
+    MATERIAL_TEXTURED   = 2,
+    MATERIAL_SPECULAR   = 4,
+    MATERIAL_REFLECTIVE = 8,
+    MATERIAL_REFRACTIVE = 16,
+    MATERIAL_FEATURES   = 32
+};
 
 class Material
 {
@@ -16,6 +32,11 @@ public:
     double 		m_refract_amount;
     double 		m_refract_coef;
     Texture* 	m_texture;
+    //константы, вычисляемые при построении сцены; после изменения полей нужно вызвать prepare()
+    float 		m_reflect_factor;
+    float 		m_phong_f;
+    int 		m_phong_int;
+    uint32_t 	m_features;
     Material() = default;
     Material( const Color & ambient, const Color & diffuse, const Color & specular, const double & beta, const double & phong,
              const double & refract_amount, const double & refract_coef, const std::string & texture_filename = "" )
@@ -24,8 +45,34 @@ public:
     {
         if ( texture_filename.length() > 0 )
             m_texture = new Texture( texture_filename );
+        prepare();
+    }
+    void prepare()
+    {
+        m_reflect_factor = exp( -m_beta );
+        m_phong_f = m_phong;
+        //целые показатели считаются цепочкой умножений
+        m_phong_int = m_phong == floor( m_phong ) && fabs( m_phong ) <= 128.0 ? ( int )m_phong : -1;
+
+        m_features = 0;
+        if ( !m_diffuse.is_black() )
+            m_features |= MATERIAL_DIFFUSE;
+        if ( m_texture && !m_diffuse.is_black() )
+            m_features |= MATERIAL_TEXTURED;
+        if ( !m_specular.is_black() )
+            m_features |= MATERIAL_SPECULAR;
+        if ( m_reflect_factor >= MATERIAL_MIN_REFLECTION )
+            m_features |= MATERIAL_REFLECTIVE;
+        if ( m_refract_amount > 0 )
+            m_features |= MATERIAL_REFRACTIVE;
+    }
+    float phong( const float & angle_cos ) const
+    {
+        if ( m_phong_int >= 0 )
+            return pow_int( angle_cos, m_phong_int );
+        return fpow( angle_cos, m_phong_f );
     }
-    Color get_color( const double & x, const double & y )
+    Color get_color( const double & x, const double & y ) const
     {
         if ( !m_texture )
             return Color( 1, 1, 1 );
@@ -0,0 +1,114 @@
+#include "Numa.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+
+static std::vector< numa_node_t > g_numa_nodes;
+
+//список процессоров в формате ядра: "0-3,8-11"
+static void parse_cpulist( const char * text, std::vector< uint32_t > & cpus )
+{
+	const char * p = text;
+	while( *p )
+	{
+		char * end;
+		unsigned long first = strtoul( p, &end, 10 );
+		if ( end == p )
+			break;
+		unsigned long last = first;
+		p = end;
+		if ( *p == '-' )
+		{
+			last = strtoul( p + 1, &end, 10 );
+			p = end;
+		}
+		for( unsigned long cpu = first; cpu <= last; cpu++ )
+			cpus.push_back( cpu );
+		if ( *p == ',' )
+			p++;
+		else
+			break;
+	}
+}
+
+void InitNumaSystem()
+{
+	g_numa_nodes.clear();
+
+	DIR * dir = opendir( "/sys/devices/system/node" );
+	if ( dir )
+	{
+		dirent * entry;
+		while( ( entry = readdir( dir ) ) != NULL )
+		{
+			unsigned id;
+			char tail;
+			if ( sscanf( entry->d_name, "node%u%c", &id, &tail ) != 1 )
+				continue;
+
+			std::string path = std::string( "/sys/devices/system/node/" ) + entry->d_name + "/cpulist";
+			FILE * f = fopen( path.c_str(), "r" );
+			if ( !f )
+				continue;
+			char text[ 4096 ];
+			numa_node_t node;
+			node.id = id;
+			if ( fgets( text, sizeof( text ), f ) )
+				parse_cpulist( text, node.cpus );
+			fclose( f );
+			//узлы только с памятью не нужны
+			if ( !node.cpus.empty() )
+				g_numa_nodes.push_back( node );
+		}
+		closedir( dir );
+	}
+
+	if ( g_numa_nodes.empty() )
+	{
+		numa_node_t node;
+		node.id = 0;
+		for( uint32_t cpu = 0; cpu < std::max( 1u, std::thread::hardware_concurrency() ); cpu++ )
+			node.cpus.push_back( cpu );
+		g_numa_nodes.push_back( node );
+	}
+
+	struct by_id
+	{
+		bool operator()( const numa_node_t & a, const numa_node_t & b ) const
+		{
+			return a.id < b.id;
+		}
+	};
+	std::sort( g_numa_nodes.begin(), g_numa_nodes.end(), by_id() );
+}
+
+const std::vector< numa_node_t > & numa_nodes()
+{
+	return g_numa_nodes;
+}
+
+uint32_t numa_node_of_thread( uint32_t thread_index )
+{
+	return thread_index % g_numa_nodes.size();
+}
+
+uint32_t numa_cpu_of_thread( uint32_t thread_index )
+{
+	const numa_node_t & node = g_numa_nodes[ numa_node_of_thread( thread_index ) ];
+	return node.cpus[ ( thread_index / g_numa_nodes.size() ) % node.cpus.size() ];
+}
+
+bool pin_current_thread( uint32_t cpu )
+{
+	cpu_set_t set;
+	CPU_ZERO( &set );
+	CPU_SET( cpu, &set );
+	return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+}
@@ -0,0 +1,26 @@
+#ifndef NUMA_HPP
+#define NUMA_HPP
+
+#include <stdint.h>
+#include <vector>
+
+struct numa_node_t
+{
+    uint32_t                id;
+    std::vector< uint32_t > cpus;
+};
+
+//Читает топологию из /sys/devices/system/node, без libnuma. Если каталога нет, считается,
+//что все процессоры в одном узле
+void InitNumaSystem();
+
+const std::vector< numa_node_t > & numa_nodes();
+
+//потоки раскладываются по узлам по кругу: поток i - на узел i % N
+uint32_t numa_node_of_thread( uint32_t thread_index );
+uint32_t numa_cpu_of_thread( uint32_t thread_index );
+
+//привязывает вызывающий поток к процессору, false при ошибке
+bool pin_current_thread( uint32_t cpu );
+
+#endif // NUMA_HPP
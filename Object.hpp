@@ -1,297 +1,110 @@
 #ifndef OBJECT_HPP
 #define OBJECT_HPP
 
+#include <stdint.h>
+
 #include "Ray.hpp"
 #include "Vector.hpp"
-#include "Material.hpp"
+#include "Color.hpp"
 
 #define EPSILON 0.0001f
 #define PI 3.1415926
 
 struct Intersection
 {
-    Vector  point;
-    Vector  normal;
-    Color   pixel;
+    Vector      point;
+    Vector      normal;
+    float       distance;
+    //текстурные координаты точки на поверхности
+    float       u;
+    float       v;
+    uint32_t    material;
+    //тип и индекс примитива в Scene
+    uint32_t    type;
+    uint32_t    index;
+    //грань параллелепипеда: 2 * номер оси + 1 для грани в направлении оси, у остальных 0
+    uint32_t    face;
 };
 
-class Object
+enum light_type_t
 {
-private:
-
-public:
-    Material m_material;
-    Object()
-    {
-
-    }
-
-    Object( const Material & material )
-        : m_material( material )
-    {
-
-    }
-
-    virtual ~Object()
-    {
-
-    }
-
-    virtual void GetReflectRefractVectors( const Ray & ray, const Intersection& intersection, Vector& reflect, Vector& refract, float& reflectAmount )
-    {
-        Vector i = ray.vector;
-        Vector n = intersection.normal;
-        reflect = i.reflect( n );
-        reflect.normalize();
-        reflectAmount = 1.0f;
-        if ( m_material.m_refract_amount > 0 )
-        {
-            float refract_coef = m_material.m_refract_coef;
-            float cos_i = -i.dot( n );
-            if(  cos_i < 0.0f  )
-            {
-                n = n.scalar( -1 );
-                cos_i = -i.dot( n );
-                refract_coef = 1.0f / refract_coef;
-            }
-            float sin2_t = refract_coef * refract_coef * ( 1.0f - cos_i * cos_i );
-
-            if( sin2_t <= 1.0f  )
-            {
-                float cos_t = sqrt( 1.0f - sin2_t );
-                refract = i.scalar( refract_coef ) + n.scalar( refract_coef * cos_i - cos_t );
-                refract.normalize();
-                float Rorto  = ( cos_i - refract_coef * cos_t ) / ( cos_i + refract_coef * cos_t );
-                float Rparal = ( refract_coef * cos_i - cos_t ) / ( refract_coef * cos_i + cos_t );
-                reflectAmount = ( Rorto * Rorto + Rparal * Rparal ) / 2.0f;
-            }
-            else
-            {
-                refract = reflect;
-            }
-        }
-    }
-
-    bool is_in_border( const float & v, const float & b1, const float & b2, float & t )
-    {
-        t = ( v - b1 ) / ( b2 - b1 );
-        t = t > 1.0f ? 1.0f : t;
-        if ( ( v >= b1 && v <= b2 ) )// || ( v >= b2 && v <= b1 ) )
-                return true;
-        if ( fabs( v - b1 ) < EPSILON || fabs( v - b2 ) < EPSILON )
-            return true;
-        return false;
-    }
-    virtual bool CheckIntersection( const Ray & ray, Intersection & intersection ) = 0;
+    LIGHT_POINT,
+    LIGHT_SPHERE,
+    LIGHT_RECT
 };
 
-class ObjectPlane : public Object
+class ObjectLight
 {
 private:
-    Vector4 abcd;
-    Vector normal;
-    Vector b1;
-    Vector b4;
-    Matrix m_inverse;
+    ObjectLight() = default;
 public:
-    ObjectPlane() = default;
-    ObjectPlane( const Matrix & m, const float & width, const float & height,
-                const Material & material, bool inverse_normal = false )
-        : Object( material )
-    {
-        m_inverse = m.inverse();
-        b1 = Vector(  -width / 2.0f, height / 2.0f, 0.0f  );
-        Vector b2 = Vector(  width / 2.0f, height / 2.0f, 0.0f  );
-        b4 = Vector(  width / 2.0f, -height / 2.0f, 0.0f );
-        Vector c = m.mul(  Vector(  0.0f, 0.0f, 0.0f  )  );
-        Vector u = m.mul( b1 ) - c;
-        Vector v = m.mul( b2 ) - c;
-        normal = ( u * v );
-        if ( !inverse_normal )
-            normal = normal.scalar( -1 );
-        normal.normalize();
-        abcd = Vector4( normal.x, normal.y, normal.z, -normal.dot( c ) );
-    }
-    virtual bool CheckIntersection( const Ray &ray, Intersection & intersection )
-    {
-        intersection.normal = normal;
-        float & A = abcd.x;
-        float & B = abcd.y;
-        float & C = abcd.z;
-        float & D = abcd.w;
-        const float & x0 = ray.start_point.x;
-        const float & y0 = ray.start_point.y;
-        const float & z0 = ray.start_point.z;
-        const float & alfa =  ray.vector.x;
-        const float & beta = ray.vector.y;
-        const float & gamma = ray.vector.z;
-
-        //( A,B,C ) -normal
-        //( a,b,g ) - ray direction
-        float scalar = A * alfa + B * beta + C * gamma;
-        //прамая || плоскости
-        if ( fabs( scalar ) < EPSILON )
-            return false;
-
-        float t = ( -D - A * x0 - B * y0 - C * z0 ) / scalar;
-        //точка должна быть по направлению луча
-        if ( t < 0 || fabs( t ) < EPSILON )
-            return false;
-
-        intersection.point = ray.point( t );
-
-        Vector intr = m_inverse.mul( intersection.point );
-        float tx, ty;
-        if ( !is_in_border( intr.x, b1.x, b4.x, tx ) ||
-            !is_in_border( intr.y, b4.y, b1.y, ty ) )
-            return false;
+    light_type_t m_type;
+    Color m_color;
+    Vector m_center;
+    //радиус затухания
+    float m_radius;
+    //радиус светящейся сферы для LIGHT_SPHERE
+    float m_sphere_radius;
+    //половины сторон прямоугольника для LIGHT_RECT
+    Vector m_u;
+    Vector m_v;
 
-        intersection.pixel = m_material.get_color( tx, ty );
+    ObjectLight( const Vector & center, const Color & color, float radius )
+        : m_type( LIGHT_POINT ), m_color( color ), m_center( center ), m_radius( radius ), m_sphere_radius( 0.0f )
+    {
 
-        return true;
     }
-};
 
-class ObjectBox : public Object
-{
-private:
-    std::vector<ObjectPlane> 	planes;
-    size_t 						indexOfIntersectPlane;
-
-    void init_plane( const Vector & pos, const Vector & rotate, const float & size,
-                    const Material & material, Matrix & m )
+    static ObjectLight Sphere( const Vector & center, const float & sphere_radius, const Color & color, float radius )
     {
-        m = m * Matrix::RotateX( rotate.x ) * Matrix::RotateY( rotate.y ) * Matrix::RotateZ( rotate.z ) * Matrix::TranslateMatrix( pos );
-        planes.push_back( ObjectPlane( m, size, size, material ) );
+        ObjectLight ret( center, color, radius );
+        ret.m_type = LIGHT_SPHERE;
+        ret.m_sphere_radius = sphere_radius;
+        return ret;
     }
 
-public:
-
-    ObjectBox( const Vector & pos, const Vector & rotate, const float & size,// const float & height,const float & depth,
-              const Material & material )
-        : Object( material )
+    static ObjectLight Rect( const Vector & center, const Vector & u, const Vector & v, const Color & color, float radius )
     {
-        Matrix m;
-        //XY bottom
-        m = Matrix::TranslateMatrix(  0.0f, 0.0f, -size / 2.0f  );
-        init_plane( pos, rotate, size, material, m );
-        //XY top
-        m = Matrix::TranslateMatrix(  0.0f, 0.0f, size / 2.0f );
-        init_plane( pos, rotate, size, material, m );
-        //YZ far
-        m = Matrix::TranslateMatrix(  -size / 2.0f, 0.0f, 0.0f );
-        m = Matrix::RotateY( -PI / 2.0f ) * m;
-        init_plane( pos, rotate, size, material, m );
-        //YZ nead
-        m = Matrix::TranslateMatrix( size / 2.0f, 0.0f, 0.0f );
-        m = Matrix::RotateY( PI / 2.0f ) * m;
-        init_plane( pos, rotate, size, material, m );;
-        //XZ right
-        m = Matrix::TranslateMatrix( 0.0f, size / 2.0f, 0 );
-        m = Matrix::RotateX( -PI / 2.0f ) * m;
-        init_plane( pos, rotate, size, material, m );
-        //XZ left
-        m = Matrix::TranslateMatrix( 0.0f, -size / 2.0f, 0 );
-        m = Matrix::RotateX( PI / 2.0f ) * m;
-        init_plane( pos, rotate, size, material, m );;
+        ObjectLight ret( center, color, radius );
+        ret.m_type = LIGHT_RECT;
+        ret.m_u = u;
+        ret.m_v = v;
+        return ret;
     }
-    virtual bool CheckIntersection( const Ray &ray, Intersection &intersection )
-    {
-    	indexOfIntersectPlane = 0;
-        Intersection intr;
-        size_t i_plane = ~0;
-        float distance2obj = INFINITY;
-        for( size_t i = 0; i < planes.size(); i++ )
-        {
-            Intersection in;
-            if ( planes[i].CheckIntersection( ray, in ) )
-            {
-                float dist = in.point.distance( ray.start_point );
-                if ( dist < distance2obj ){
-                    distance2obj = dist;
-                    intr = in;
-                    i_plane = i;
-                }
-            }
-        }
-        if ( i_plane == ~0 )
-            return false;
-
-        intersection = intr;
-        indexOfIntersectPlane = i_plane;
 
-        return true;
-    }
-    void GetReflectRefractVectors( const Ray & ray, const Intersection& intersection, Vector& reflect, Vector& refract, float& reflectAmount )
+    bool is_area() const
     {
-    	planes[ indexOfIntersectPlane ].GetReflectRefractVectors( ray, intersection, reflect, refract, reflectAmount );
+        return m_type != LIGHT_POINT;
     }
-};
-
-class ObjectSphere : public Object
-{
-private:
-    ObjectSphere() = default;
-public:
-    Vector m_center;
-    float m_radius;
-
-    ObjectSphere( const Vector & center, const float & radius, const Material & material )
-        : Object( material ), m_center( center ), m_radius( radius )
+    //наибольшее расстояние от центра до точек sample()
+    float extent() const
     {
-
+        if ( m_type == LIGHT_RECT )
+            return m_u.length() + m_v.length();
+        if ( m_type == LIGHT_SPHERE )
+            return m_sphere_radius;
+        return 0.0f;
     }
 
-    bool intersect( const Ray &ray, const float & t, Intersection & intersection )
-    {
-        intersection.point = ray.point( t );
-        intersection.normal = intersection.point - m_center;
-        if ( fabs( intersection.normal.length() - m_radius ) > EPSILON )
-        	return false;
-        intersection.normal.normalize( m_radius );
-        intersection.pixel = Color( 1.0f, 1.0f, 1.0f );
-        return true;
-    }
-    virtual bool CheckIntersection( const Ray &ray, Intersection & intersection )
+    //точка на поверхности источника, видимая из point; s, t в [0,1)
+    Vector sample( const Vector & point, const float & s, const float & t ) const
     {
-        float & R = m_radius;
-        Vector v = ray.start_point - m_center;
-        float B = v.dot( ray.vector );
-        float C = v.dot( v ) - R * R;
-        float D = sqrt( B * B - C );
-        if ( isnan( D ) )
-            return false;
-        float t1 = ( -B - D );
-        float t2 = ( -B + D );
-        if ( t1 < 0.0f && t2 < 0.0f )
-            return false;
-        float min_t = fmin( t1, t2 );
-        float max_t = fmax( t1, t2 );
-        float t = ( min_t >= 0 ) ? min_t : max_t;
-        if ( fabs( t ) < EPSILON )
+        if ( m_type == LIGHT_RECT )
+            return m_center + m_u.scalar( 2.0f * s - 1.0f ) + m_v.scalar( 2.0f * t - 1.0f );
+        if ( m_type == LIGHT_SPHERE )
         {
-            if ( t < EPSILON )
-                t = max_t;
-            if ( t < EPSILON )
-                return false;
+            //диск силуэта сферы, повернутый к point
+            Vector w = point - m_center;
+            w.normalize();
+            Vector a = fabs( w.x ) > 0.9f ? Vector( 0.0f, 1.0f, 0.0f ) : Vector( 1.0f, 0.0f, 0.0f );
+            Vector u = a * w;
+            u.normalize();
+            Vector v = w * u;
+            float r = m_sphere_radius * sqrt( s );
+            float phi = 2.0f * PI * t;
+            return m_center + u.scalar( r * cos( phi ) ) + v.scalar( r * sin( phi ) );
         }
-        return intersect( ray, t, intersection );
-    }
-};
-
-class ObjectLight
-{
-private:
-    ObjectLight() = default;
-public:
-    Color m_color;
-    Vector m_center;
-    float m_radius;
-
-    ObjectLight( const Vector & center, const Color & color, float radius )
-        : m_color( color ), m_center( center ), m_radius( radius )
-    {
-
+        return m_center;
     }
 
     bool RayIntersectLight( const Ray &ray )
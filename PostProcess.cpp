@@ -0,0 +1,171 @@
+#include "PostProcess.hpp"
+
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "Trace.hpp"
+
+//таблица кодирования покрывает [2^-24, 1], младшие 13 бит мантиссы отбрасываются
+#define ENCODE_SHIFT 13
+#define ENCODE_MIN 0x33800000u
+#define ENCODE_MAX 0x3F800000u
+
+static const uint8_t g_bayer[ 8 ][ 8 ] =
+{
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+static float as_float( uint32_t bits )
+{
+	float f;
+	memcpy( &f, &bits, sizeof( f ) );
+	return f;
+}
+
+#if !SSE
+static uint32_t as_bits( float f )
+{
+	uint32_t bits;
+	memcpy( &bits, &f, sizeof( bits ) );
+	return bits;
+}
+#endif
+
+PostProcess::PostProcess( const post_settings_t & settings )
+	: m_settings( settings ), m_scale( exp2f( settings.exposure ) ), m_image( NULL ), m_rgb( NULL )
+{
+	//значение в середине каждого интервала таблицы, уже умноженное на 255
+	size_t size = ( ( ENCODE_MAX - ENCODE_MIN ) >> ENCODE_SHIFT ) + 1;
+	m_encode.resize( size );
+	for( size_t i = 0; i < size; i++ )
+	{
+		float x = std::min( as_float( ENCODE_MIN + ( i << ENCODE_SHIFT ) + ( 1u << ( ENCODE_SHIFT - 1 ) ) ), 1.0f );
+		float y;
+		if ( settings.gamma > 0.0f )
+			y = powf( x, 1.0f / settings.gamma );
+		else
+			y = x <= 0.0031308f ? 12.92f * x : 1.055f * powf( x, 1.0f / 2.4f ) - 0.055f;
+		m_encode[ i ] = y * 255.0f;
+	}
+}
+
+void PostProcess::process_rows( size_t y0, size_t y1 ) const
+{
+	const image_t & image = *m_image;
+	const uint32_t min_index = ENCODE_MIN >> ENCODE_SHIFT;
+	const uint32_t max_index = ( ENCODE_MAX >> ENCODE_SHIFT ) - min_index;
+	for( size_t y = y0; y < y1; y++ )
+		for( size_t x = 0; x < image.width; x++ )
+		{
+			size_t i = y * image.width + x;
+			uint32_t index[ 4 ];
+#if SSE
+			__m128 c = _mm_mul_ps( _mm_loadu_ps( &image.image[ i ].r ), _mm_set1_ps( m_scale ) );
+			c = _mm_max_ps( c, _mm_setzero_ps() );
+			const __m128 one = _mm_set1_ps( 1.0f );
+			switch( m_settings.tonemap )
+			{
+			case TONEMAP_CLAMP:
+				break;
+			case TONEMAP_REINHARD_LUMINANCE:
+			{
+				__m128 w = _mm_mul_ps( c, _mm_setr_ps( 0.299f, 0.587f, 0.114f, 0.0f ) );
+				w = _mm_hadd_ps( w, w );
+				w = _mm_hadd_ps( w, w );
+				c = _mm_div_ps( c, _mm_add_ps( w, one ) );
+				break;
+			}
+			case TONEMAP_REINHARD:
+				c = _mm_div_ps( c, _mm_add_ps( c, one ) );
+				break;
+			case TONEMAP_ACES:
+			{
+				__m128 n = _mm_mul_ps( c, _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( 2.51f ) ), _mm_set1_ps( 0.03f ) ) );
+				__m128 d = _mm_add_ps( _mm_mul_ps( c, _mm_add_ps( _mm_mul_ps( c, _mm_set1_ps( 2.43f ) ), _mm_set1_ps( 0.59f ) ) ),
+									   _mm_set1_ps( 0.14f ) );
+				c = _mm_div_ps( n, d );
+				break;
+			}
+			}
+			c = _mm_min_ps( c, one );
+			//ниже 2^-24 индекс обнуляется сравнением, после вычитания он был бы "отрицательным"
+			__m128i bits = _mm_castps_si128( c );
+			__m128i idx = _mm_sub_epi32( _mm_srli_epi32( bits, ENCODE_SHIFT ), _mm_set1_epi32( min_index ) );
+			idx = _mm_and_si128( idx, _mm_castps_si128( _mm_cmpge_ps( c, _mm_set1_ps( as_float( ENCODE_MIN ) ) ) ) );
+			_mm_storeu_si128( ( __m128i* )index, idx );
+			float valid[ 4 ];
+			_mm_storeu_ps( valid, _mm_and_ps( one, _mm_cmpge_ps( c, _mm_set1_ps( as_float( ENCODE_MIN ) ) ) ) );
+#else
+			Color c = image.image[ i ] * m_scale;
+			float v[ 3 ] = { std::max( c.r, 0.0f ), std::max( c.g, 0.0f ), std::max( c.b, 0.0f ) };
+			float lum = 0.299f * v[ 0 ] + 0.587f * v[ 1 ] + 0.114f * v[ 2 ];
+			float valid[ 4 ];
+			for( int k = 0; k < 3; k++ )
+			{
+				switch( m_settings.tonemap )
+				{
+				case TONEMAP_CLAMP:
+					break;
+				case TONEMAP_REINHARD_LUMINANCE:
+					v[ k ] /= lum + 1.0f;
+					break;
+				case TONEMAP_REINHARD:
+					v[ k ] /= v[ k ] + 1.0f;
+					break;
+				case TONEMAP_ACES:
+					v[ k ] = v[ k ] * ( 2.51f * v[ k ] + 0.03f ) / ( v[ k ] * ( 2.43f * v[ k ] + 0.59f ) + 0.14f );
+					break;
+				}
+				v[ k ] = std::min( v[ k ], 1.0f );
+				valid[ k ] = v[ k ] >= as_float( ENCODE_MIN ) ? 1.0f : 0.0f;
+				index[ k ] = valid[ k ] > 0.0f ? ( as_bits( v[ k ] ) >> ENCODE_SHIFT ) - min_index : 0;
+			}
+#endif
+			float threshold = m_settings.dither ? ( g_bayer[ y & 7 ][ x & 7 ] + 0.5f ) / 64.0f : 0.5f;
+			uint8_t * out = m_rgb + i * 3;
+			for( int k = 0; k < 3; k++ )
+			{
+				float value = m_encode[ std::min( index[ k ], max_index ) ] * valid[ k ] + threshold;
+				out[ k ] = value >= 255.0f ? 255 : ( uint8_t )value;
+			}
+		}
+}
+
+void PostProcess::run( const image_t & image, uint8_t * rgb, uint32_t threads )
+{
+	TRACE_SCOPE( "post process" );
+	m_image = &image;
+	m_rgb = rgb;
+	threads = std::max< uint32_t >( threads, 1 );
+	size_t band = ( image.height + threads - 1 ) / threads;
+	std::vector< std::thread > workers;
+	for( uint32_t t = 0; t < threads; t++ )
+	{
+		size_t y0 = std::min< size_t >( image.height, t * band );
+		size_t y1 = std::min< size_t >( image.height, y0 + band );
+		workers.push_back( std::thread( &PostProcess::process_rows, this, y0, y1 ) );
+	}
+	for( size_t t = 0; t < workers.size(); t++ )
+		workers[ t ].join();
+	m_image = NULL;
+	m_rgb = NULL;
+}
+
+int save_graded_png( const std::string & file_name, const image_t & image, const post_settings_t & settings,
+					 uint32_t threads )
+{
+	std::vector< uint8_t > rgb( ( size_t )image.width * image.height * 3 );
+	PostProcess post( settings );
+	post.run( image, &rgb[ 0 ], threads );
+	return save_png_rgb( file_name, &rgb[ 0 ], image.width, image.height );
+}
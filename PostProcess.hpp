@@ -0,0 +1,65 @@
+#ifndef POSTPROCESS_HPP
+#define POSTPROCESS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "Color.hpp"
+#include "Texture.hpp"
+
+enum tonemap_t
+{
+    //только ограничение сверху
+    TONEMAP_CLAMP,
+    //c / ( 1 + L ), L - яркость пикселя, сохраняет оттенок
+    TONEMAP_REINHARD_LUMINANCE,
+    //c / ( 1 + c ) по каналам
+    TONEMAP_REINHARD,
+    //приближение кривой ACES ( Narkowicz )
+    TONEMAP_ACES
+};
+
+struct post_settings_t
+{
+    //экспозиция в ступенях, множитель 2^exposure
+    float       exposure;
+    tonemap_t   tonemap;
+    //показатель гаммы, 0 - кривая sRGB
+    float       gamma;
+    //упорядоченный дизеринг матрицей Байера 8x8 вместо округления
+    bool        dither;
+
+    post_settings_t()
+        : exposure( 0.0f ), tonemap( TONEMAP_REINHARD_LUMINANCE ), gamma( 2.2f ), dither( false )
+    {}
+};
+
+//Перевод линейного изображения в 8 бит: экспозиция, тональная компрессия, гамма и квантование.
+//Кодирование гаммы - таблица, индексированная старшими битами float: шаг таблицы
+//пропорционален значению, поэтому точность одинакова и у темных, и у светлых тонов.
+//Входное изображение не меняется, его можно переобработать с другими настройками
+class PostProcess
+{
+private:
+    post_settings_t         m_settings;
+    float                   m_scale;
+    std::vector< float >    m_encode;
+
+    const image_t*          m_image;
+    uint8_t*                m_rgb;
+
+    void process_rows( size_t y0, size_t y1 ) const;
+public:
+    PostProcess( const post_settings_t & settings );
+
+    //rgb - image.width * image.height * 3 байт
+    void run( const image_t & image, uint8_t * rgb, uint32_t threads );
+};
+
+//постобработка линейного изображения и запись в PNG
+int save_graded_png( const std::string & file_name, const image_t & image, const post_settings_t & settings,
+                     uint32_t threads );
+
+#endif // POSTPROCESS_HPP
@@ -0,0 +1,222 @@
+#include "Sampler.hpp"
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+static sampler_type_t g_sampler_type = SAMPLER_SOBOL;
+static uint32_t g_sampler_seed = 0;
+static float g_blue_noise[ BLUE_NOISE_SIZE * BLUE_NOISE_SIZE ];
+//второе измерение Соболя по байтам индекса, индекс после перемешивания занимает все 32 бита
+static uint32_t g_sobol_table[ 4 ][ 256 ];
+
+uint32_t hash32( uint32_t x )
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+uint32_t hash_combine( uint32_t seed, uint32_t v )
+{
+	return seed ^ ( v + ( seed << 6 ) + ( seed >> 2 ) + 0x9e3779b9 );
+}
+
+static uint32_t reverse_bits( uint32_t x )
+{
+	x = ( ( x >> 1 ) & 0x55555555 ) | ( ( x & 0x55555555 ) << 1 );
+	x = ( ( x >> 2 ) & 0x33333333 ) | ( ( x & 0x33333333 ) << 2 );
+	x = ( ( x >> 4 ) & 0x0f0f0f0f ) | ( ( x & 0x0f0f0f0f ) << 4 );
+	x = ( ( x >> 8 ) & 0x00ff00ff ) | ( ( x & 0x00ff00ff ) << 8 );
+	return ( x >> 16 ) | ( x << 16 );
+}
+
+//Скремблирование Оуэна через хеш Лейна-Карраса ( B. Burley, Practical Hash-based Owen Scrambling )
+static uint32_t owen_scramble( uint32_t x, uint32_t seed )
+{
+	x = reverse_bits( x );
+	x ^= x * 0x3d20adea;
+	x += seed;
+	x *= ( seed >> 16 ) | 1;
+	x ^= x * 0x05526c56;
+	x ^= x * 0x53a22864;
+	return reverse_bits( x );
+}
+
+static void build_sobol_table()
+{
+	uint32_t v[ 32 ];
+	v[ 0 ] = 1u << 31;
+	for( int i = 1; i < 32; i++ )
+		v[ i ] = v[ i - 1 ] ^ ( v[ i - 1 ] >> 1 );
+	for( int byte = 0; byte < 4; byte++ )
+		for( uint32_t x = 0; x < 256; x++ )
+		{
+			uint32_t r = 0;
+			for( int bit = 0; bit < 8; bit++ )
+				if ( x & ( 1u << bit ) )
+					r ^= v[ byte * 8 + bit ];
+			g_sobol_table[ byte ][ x ] = r;
+		}
+}
+
+//первые два измерения последовательности Соболя, первое - обращение битов индекса
+static uint32_t sobol( uint32_t index, uint32_t dimension )
+{
+	if ( dimension == 0 )
+		return reverse_bits( index );
+	return g_sobol_table[ 0 ][ index & 0xff ] ^ g_sobol_table[ 1 ][ ( index >> 8 ) & 0xff ] ^
+		   g_sobol_table[ 2 ][ ( index >> 16 ) & 0xff ] ^ g_sobol_table[ 3 ][ index >> 24 ];
+}
+
+static float to_unit( uint32_t x )
+{
+	return ( x >> 8 ) * ( 1.0f / 16777216.0f );
+}
+
+//Маска синего шума методом void-and-cluster ( R. Ulichney ), тороидальная
+static void build_blue_noise( uint32_t seed )
+{
+	const int n = BLUE_NOISE_SIZE;
+	const int count = n * n;
+	const float sigma = 1.5f;
+
+	std::vector< float > gauss( count );
+	for( int y = 0; y < n; y++ )
+		for( int x = 0; x < n; x++ )
+		{
+			int dx = std::min( x, n - x );
+			int dy = std::min( y, n - y );
+			gauss[ y * n + x ] = exp( -( dx * dx + dy * dy ) / ( 2.0f * sigma * sigma ) );
+		}
+
+	std::vector< uint8_t > pattern( count, 0 );
+	std::vector< float > energy( count, 0.0f );
+	std::vector< uint32_t > rank( count, 0 );
+
+	struct helper
+	{
+		static void toggle( int i, int n, std::vector< uint8_t > & pattern, std::vector< float > & energy,
+							const std::vector< float > & gauss )
+		{
+			pattern[ i ] ^= 1;
+			float sign = pattern[ i ] ? 1.0f : -1.0f;
+			int px = i % n;
+			int py = i / n;
+			for( int y = 0; y < n; y++ )
+				for( int x = 0; x < n; x++ )
+					energy[ y * n + x ] += sign * gauss[ ( ( y - py + n ) % n ) * n + ( x - px + n ) % n ];
+		}
+		//самое плотное скопление среди единиц или самая большая пустота среди нулей
+		static int find( int value, int count, const std::vector< uint8_t > & pattern, const std::vector< float > & energy )
+		{
+			int best = -1;
+			for( int i = 0; i < count; i++ )
+				if ( pattern[ i ] == value &&
+					 ( best < 0 || ( value ? energy[ i ] > energy[ best ] : energy[ i ] < energy[ best ] ) ) )
+					best = i;
+			return best;
+		}
+	};
+
+	//начальный случайный узор, 10% единиц
+	int ones = 0;
+	for( int i = 0; i < count / 10; i++ )
+	{
+		int p = hash32( hash_combine( seed, i ) ) % count;
+		if ( !pattern[ p ] )
+		{
+			helper::toggle( p, n, pattern, energy, gauss );
+			ones++;
+		}
+	}
+	//переносим единицы из скоплений в пустоты, пока узор не станет равномерным
+	for( int iteration = 0; iteration < count; iteration++ )
+	{
+		int cluster = helper::find( 1, count, pattern, energy );
+		helper::toggle( cluster, n, pattern, energy, gauss );
+		int void_ = helper::find( 0, count, pattern, energy );
+		helper::toggle( void_, n, pattern, energy, gauss );
+		if ( void_ == cluster )
+			break;
+	}
+
+	std::vector< uint8_t > initial = pattern;
+	std::vector< float > initial_energy = energy;
+	for( int r = ones - 1; r >= 0; r-- )
+	{
+		int cluster = helper::find( 1, count, pattern, energy );
+		helper::toggle( cluster, n, pattern, energy, gauss );
+		rank[ cluster ] = r;
+	}
+	pattern = initial;
+	energy = initial_energy;
+	for( int r = ones; r < count; r++ )
+	{
+		int void_ = helper::find( 0, count, pattern, energy );
+		helper::toggle( void_, n, pattern, energy, gauss );
+		rank[ void_ ] = r;
+	}
+
+	for( int i = 0; i < count; i++ )
+		g_blue_noise[ i ] = ( rank[ i ] + 0.5f ) / count;
+}
+
+void InitSamplerSystem( sampler_type_t type, uint32_t seed )
+{
+	g_sampler_type = type;
+	g_sampler_seed = seed;
+	build_sobol_table();
+	if ( type == SAMPLER_BLUE_NOISE )
+		build_blue_noise( seed );
+}
+
+SampleSequence::SampleSequence( uint32_t base, uint32_t seed, float offset_u, float offset_v )
+	: m_base( base ), m_seed_index( hash32( seed ) ), m_seed_u( hash32( seed ^ 0x68bc21eb ) ), m_seed_v( hash32( seed ^ 0x02e5be93 ) ),
+	  m_offset_u( offset_u ), m_offset_v( offset_v )
+{
+}
+
+void SampleSequence::point( uint32_t i, float & u, float & v ) const
+{
+	//перемешивание индекса сохраняет стратификацию выровненных блоков по 2^k точек
+	uint32_t index = owen_scramble( m_base + i, m_seed_index );
+	u = to_unit( owen_scramble( sobol( index, 0 ), m_seed_u ) ) + m_offset_u;
+	v = to_unit( owen_scramble( sobol( index, 1 ), m_seed_v ) ) + m_offset_v;
+	u = u >= 1.0f ? u - 1.0f : u;
+	v = v >= 1.0f ? v - 1.0f : v;
+}
+
+Sampler::Sampler( uint32_t x, uint32_t y, uint32_t sample )
+	: m_x( x ), m_y( y ), m_sample( sample ), m_dimension( 0 )
+{
+	if ( g_sampler_type == SAMPLER_BLUE_NOISE )
+		m_pixel_seed = hash32( g_sampler_seed );
+	else
+		m_pixel_seed = hash32( hash_combine( hash_combine( g_sampler_seed, x ), y ) );
+}
+
+SampleSequence Sampler::get_sequence( uint32_t count )
+{
+	uint32_t dimension = m_dimension++;
+	float offset_u = 0.0f;
+	float offset_v = 0.0f;
+	if ( g_sampler_type == SAMPLER_BLUE_NOISE )
+	{
+		//у каждого измерения свой тороидальный сдвиг маски
+		uint32_t sx = m_x + dimension * 17;
+		uint32_t sy = m_y + dimension * 29;
+		const uint32_t mask = BLUE_NOISE_SIZE - 1;
+		offset_u = g_blue_noise[ ( sy & mask ) * BLUE_NOISE_SIZE + ( sx & mask ) ];
+		offset_v = g_blue_noise[ ( ( sy + BLUE_NOISE_SIZE / 2 ) & mask ) * BLUE_NOISE_SIZE + ( ( sx + BLUE_NOISE_SIZE / 2 ) & mask ) ];
+	}
+	return SampleSequence( m_sample * count, hash_combine( m_pixel_seed, dimension ), offset_u, offset_v );
+}
+
+void Sampler::get_2d( float & u, float & v )
+{
+	get_sequence( 1 ).point( 0, u, v );
+}
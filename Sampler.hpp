@@ -0,0 +1,58 @@
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include <stdint.h>
+
+//SOBOL - двумерная последовательность Соболя со скремблированием Оуэна, независимым для каждого
+//пикселя и каждой пары измерений,
+//BLUE_NOISE - одно скремблирование на всё изображение и сдвиг Кранли-Паттерсона на значение
+//маски синего шума пикселя, ошибка распределена по изображению как синий шум
+enum sampler_type_t
+{
+    SAMPLER_SOBOL,
+    SAMPLER_BLUE_NOISE
+};
+
+#define BLUE_NOISE_SIZE 64
+
+void InitSamplerSystem( sampler_type_t type, uint32_t seed );
+
+uint32_t hash32( uint32_t x );
+uint32_t hash_combine( uint32_t seed, uint32_t v );
+
+//Серия двумерных точек одного измерения одной выборки пикселя. Первые 2^k точек серии
+//стратифицированы: в каждой полосе сетки 2^k x 1, 2^( k-1 ) x 2, ..., 1 x 2^k ровно одна точка
+class SampleSequence
+{
+private:
+    uint32_t    m_base;
+    uint32_t    m_seed_index;
+    uint32_t    m_seed_u;
+    uint32_t    m_seed_v;
+    float       m_offset_u;
+    float       m_offset_v;
+public:
+    SampleSequence( uint32_t base, uint32_t seed, float offset_u, float offset_v );
+    void point( uint32_t i, float & u, float & v ) const;
+};
+
+//Выборки для пикселя ( x, y ) и номера выборки sample. Каждый вызов get_* берет следующее
+//измерение, значения зависят только от пикселя, номера выборки и измерения, поэтому результат
+//не зависит от числа потоков и порядка обхода
+class Sampler
+{
+private:
+    uint32_t    m_x;
+    uint32_t    m_y;
+    uint32_t    m_sample;
+    uint32_t    m_pixel_seed;
+    uint32_t    m_dimension;
+public:
+    Sampler( uint32_t x, uint32_t y, uint32_t sample );
+
+    void get_2d( float & u, float & v );
+    //count точек на одно измерение, у разных выборок пикселя серии не пересекаются
+    SampleSequence get_sequence( uint32_t count );
+};
+
+#endif // SAMPLER_HPP
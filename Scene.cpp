@@ -0,0 +1,911 @@
+#include "Scene.hpp"
+
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+
+#ifdef STATIC_SCENE
+#include STATIC_SCENE
+#endif
+
+#if SSE
+#include <x86intrin.h>
+#endif
+
+static size_t padded( size_t count )
+{
+	return ( count + 3 ) & ~( size_t )3;
+}
+
+template< class T >
+static void store( SoaColumn< T > & v, size_t index, const T & value )
+{
+	v.resize( padded( index + 1 ) );
+	v.set( index, value );
+}
+
+#if SSE
+static inline __m128 blend( const __m128 & mask, const __m128 & a, const __m128 & b )
+{
+	return _mm_or_ps( _mm_and_ps( mask, a ), _mm_andnot_ps( mask, b ) );
+}
+
+static inline __m128 dot4( const __m128 & ax, const __m128 & ay, const __m128 & az,
+						  const __m128 & bx, const __m128 & by, const __m128 & bz )
+{
+	return _mm_add_ps( _mm_add_ps( _mm_mul_ps( ax, bx ), _mm_mul_ps( ay, by ) ), _mm_mul_ps( az, bz ) );
+}
+
+static inline __m128 abs4( const __m128 & a )
+{
+	return _mm_andnot_ps( _mm_set1_ps( -0.0f ), a );
+}
+
+//луч, размноженный на 4 линии SSE регистра
+struct ray4_t
+{
+	__m128 ox, oy, oz;
+	__m128 dx, dy, dz;
+
+	ray4_t( const Ray & ray )
+		: ox( _mm_set1_ps( ray.start_point.x ) ), oy( _mm_set1_ps( ray.start_point.y ) ), oz( _mm_set1_ps( ray.start_point.z ) ),
+		  dx( _mm_set1_ps( ray.vector.x ) ), dy( _mm_set1_ps( ray.vector.y ) ), dz( _mm_set1_ps( ray.vector.z ) )
+	{}
+};
+#endif
+
+//Ядра пересечения: block() считает расстояния до 4 примитивов начиная с i ( INFINITY при промахе ),
+//one() - до одного примитива. A - массивы сцены или константные массивы статической сцены
+//( см. StaticScene.hpp ), у которых столбцы названы так же
+template< class A >
+struct SphereKernel
+{
+	const A & s;
+	const Ray & ray;
+#if SSE
+	ray4_t r;
+#endif
+
+	SphereKernel( const A & s_, const Ray & ray_ )
+		: s( s_ ), ray( ray_ )
+#if SSE
+		, r( ray_ )
+#endif
+	{}
+
+	float one( size_t i ) const
+	{
+		float vx = ray.start_point.x - s.cx[ i ];
+		float vy = ray.start_point.y - s.cy[ i ];
+		float vz = ray.start_point.z - s.cz[ i ];
+		float B = vx * ray.vector.x + vy * ray.vector.y + vz * ray.vector.z;
+		float C = vx * vx + vy * vy + vz * vz - s.r2[ i ];
+		float disc = B * B - C;
+		if ( disc < 0.0f )
+			return INFINITY;
+		float D = sqrt( disc );
+		float t = -B - D;
+		if ( t < EPSILON )
+			t = -B + D;
+		return t < EPSILON ? INFINITY : t;
+	}
+
+#if SSE
+	__m128 block( size_t i ) const
+	{
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 eps = _mm_set1_ps( EPSILON );
+		__m128 vx = _mm_sub_ps( r.ox, _mm_loadu_ps( &s.cx[ i ] ) );
+		__m128 vy = _mm_sub_ps( r.oy, _mm_loadu_ps( &s.cy[ i ] ) );
+		__m128 vz = _mm_sub_ps( r.oz, _mm_loadu_ps( &s.cz[ i ] ) );
+		__m128 B = dot4( vx, vy, vz, r.dx, r.dy, r.dz );
+		__m128 C = _mm_sub_ps( dot4( vx, vy, vz, vx, vy, vz ), _mm_loadu_ps( &s.r2[ i ] ) );
+		__m128 disc = _mm_sub_ps( _mm_mul_ps( B, B ), C );
+		__m128 D = _mm_sqrt_ps( _mm_max_ps( disc, zero ) );
+		__m128 t1 = _mm_sub_ps( _mm_sub_ps( zero, B ), D );
+		__m128 t2 = _mm_add_ps( _mm_sub_ps( zero, B ), D );
+		__m128 t = blend( _mm_cmpge_ps( t1, eps ), t1, t2 );
+		__m128 hit = _mm_and_ps( _mm_cmpge_ps( disc, zero ), _mm_cmpge_ps( t, eps ) );
+		return blend( hit, t, _mm_set1_ps( INFINITY ) );
+	}
+#endif
+};
+
+template< class A >
+struct QuadKernel
+{
+	const A & q;
+	const Ray & ray;
+#if SSE
+	ray4_t r;
+#endif
+
+	QuadKernel( const A & q_, const Ray & ray_ )
+		: q( q_ ), ray( ray_ )
+#if SSE
+		, r( ray_ )
+#endif
+	{}
+
+	float one( size_t i ) const
+	{
+		float dn = q.nx[ i ] * ray.vector.x + q.ny[ i ] * ray.vector.y + q.nz[ i ] * ray.vector.z;
+		//прамая || плоскости
+		if ( fabs( dn ) < EPSILON )
+			return INFINITY;
+		float on = q.nx[ i ] * ray.start_point.x + q.ny[ i ] * ray.start_point.y + q.nz[ i ] * ray.start_point.z;
+		float t = -( q.d[ i ] + on ) / dn;
+		//точка должна быть по направлению луча
+		if ( t < EPSILON )
+			return INFINITY;
+		float rx = ray.start_point.x + ray.vector.x * t - q.cx[ i ];
+		float ry = ray.start_point.y + ray.vector.y * t - q.cy[ i ];
+		float rz = ray.start_point.z + ray.vector.z * t - q.cz[ i ];
+		float lx = rx * q.ux[ i ] + ry * q.uy[ i ] + rz * q.uz[ i ];
+		float ly = rx * q.vx[ i ] + ry * q.vy[ i ] + rz * q.vz[ i ];
+		if ( fabs( lx ) > q.hw[ i ] + EPSILON || fabs( ly ) > q.hh[ i ] + EPSILON )
+			return INFINITY;
+		return t;
+	}
+
+#if SSE
+	__m128 block( size_t i ) const
+	{
+		const __m128 eps = _mm_set1_ps( EPSILON );
+		__m128 nx = _mm_loadu_ps( &q.nx[ i ] );
+		__m128 ny = _mm_loadu_ps( &q.ny[ i ] );
+		__m128 nz = _mm_loadu_ps( &q.nz[ i ] );
+		__m128 dn = dot4( nx, ny, nz, r.dx, r.dy, r.dz );
+		__m128 on = dot4( nx, ny, nz, r.ox, r.oy, r.oz );
+		__m128 t = _mm_div_ps( _mm_sub_ps( _mm_setzero_ps(), _mm_add_ps( _mm_loadu_ps( &q.d[ i ] ), on ) ), dn );
+		__m128 rx = _mm_sub_ps( _mm_add_ps( r.ox, _mm_mul_ps( r.dx, t ) ), _mm_loadu_ps( &q.cx[ i ] ) );
+		__m128 ry = _mm_sub_ps( _mm_add_ps( r.oy, _mm_mul_ps( r.dy, t ) ), _mm_loadu_ps( &q.cy[ i ] ) );
+		__m128 rz = _mm_sub_ps( _mm_add_ps( r.oz, _mm_mul_ps( r.dz, t ) ), _mm_loadu_ps( &q.cz[ i ] ) );
+		__m128 lx = dot4( rx, ry, rz, _mm_loadu_ps( &q.ux[ i ] ), _mm_loadu_ps( &q.uy[ i ] ), _mm_loadu_ps( &q.uz[ i ] ) );
+		__m128 ly = dot4( rx, ry, rz, _mm_loadu_ps( &q.vx[ i ] ), _mm_loadu_ps( &q.vy[ i ] ), _mm_loadu_ps( &q.vz[ i ] ) );
+		__m128 hit = _mm_and_ps( _mm_cmpge_ps( abs4( dn ), eps ), _mm_cmpge_ps( t, eps ) );
+		hit = _mm_and_ps( hit, _mm_cmple_ps( abs4( lx ), _mm_add_ps( _mm_loadu_ps( &q.hw[ i ] ), eps ) ) );
+		hit = _mm_and_ps( hit, _mm_cmple_ps( abs4( ly ), _mm_add_ps( _mm_loadu_ps( &q.hh[ i ] ), eps ) ) );
+		return blend( hit, t, _mm_set1_ps( INFINITY ) );
+	}
+#endif
+};
+
+template< class A >
+struct BoxKernel
+{
+	const A & b;
+	const Ray & ray;
+#if SSE
+	ray4_t r;
+#endif
+
+	BoxKernel( const A & b_, const Ray & ray_ )
+		: b( b_ ), ray( ray_ )
+#if SSE
+		, r( ray_ )
+#endif
+	{}
+
+	//axis - ось, через грань которой луч входит ( или выходит, если начало луча внутри )
+	float one( size_t i, uint32_t * axis = NULL ) const
+	{
+		Vector rel( ray.start_point.x - b.cx[ i ], ray.start_point.y - b.cy[ i ], ray.start_point.z - b.cz[ i ] );
+		Vector axes[ 3 ] = { Vector( b.a0x[ i ], b.a0y[ i ], b.a0z[ i ] ),
+							 Vector( b.a1x[ i ], b.a1y[ i ], b.a1z[ i ] ),
+							 Vector( b.a2x[ i ], b.a2y[ i ], b.a2z[ i ] ) };
+		float h[ 3 ] = { b.h0[ i ], b.h1[ i ], b.h2[ i ] };
+		float t_near = -INFINITY;
+		float t_far = INFINITY;
+		uint32_t near_axis = 0;
+		uint32_t far_axis = 0;
+		for( uint32_t k = 0; k < 3; k++ )
+		{
+			float o = rel.dot( axes[ k ] );
+			float inv = 1.0f / ray.vector.dot( axes[ k ] );
+			float t0 = ( -h[ k ] - o ) * inv;
+			float t1 = ( h[ k ] - o ) * inv;
+			if ( t0 > t1 )
+				std::swap( t0, t1 );
+			if ( t0 > t_near )
+			{
+				t_near = t0;
+				near_axis = k;
+			}
+			if ( t1 < t_far )
+			{
+				t_far = t1;
+				far_axis = k;
+			}
+		}
+		if ( t_near > t_far || t_far < EPSILON )
+			return INFINITY;
+		if ( axis )
+			*axis = t_near >= EPSILON ? near_axis : far_axis;
+		return t_near >= EPSILON ? t_near : t_far;
+	}
+
+#if SSE
+	void slab( const __m128 & rx, const __m128 & ry, const __m128 & rz, const float * ax, const float * ay, const float * az,
+			   const float * h, __m128 & t_near, __m128 & t_far ) const
+	{
+		__m128 axx = _mm_loadu_ps( ax );
+		__m128 axy = _mm_loadu_ps( ay );
+		__m128 axz = _mm_loadu_ps( az );
+		__m128 o = dot4( rx, ry, rz, axx, axy, axz );
+		__m128 inv = _mm_div_ps( _mm_set1_ps( 1.0f ), dot4( r.dx, r.dy, r.dz, axx, axy, axz ) );
+		__m128 hh = _mm_loadu_ps( h );
+		__m128 t0 = _mm_mul_ps( _mm_sub_ps( _mm_sub_ps( _mm_setzero_ps(), hh ), o ), inv );
+		__m128 t1 = _mm_mul_ps( _mm_sub_ps( hh, o ), inv );
+		t_near = _mm_max_ps( t_near, _mm_min_ps( t0, t1 ) );
+		t_far = _mm_min_ps( t_far, _mm_max_ps( t0, t1 ) );
+	}
+
+	__m128 block( size_t i ) const
+	{
+		const __m128 eps = _mm_set1_ps( EPSILON );
+		__m128 rx = _mm_sub_ps( r.ox, _mm_loadu_ps( &b.cx[ i ] ) );
+		__m128 ry = _mm_sub_ps( r.oy, _mm_loadu_ps( &b.cy[ i ] ) );
+		__m128 rz = _mm_sub_ps( r.oz, _mm_loadu_ps( &b.cz[ i ] ) );
+		__m128 t_near = _mm_set1_ps( -INFINITY );
+		__m128 t_far = _mm_set1_ps( INFINITY );
+		slab( rx, ry, rz, &b.a0x[ i ], &b.a0y[ i ], &b.a0z[ i ], &b.h0[ i ], t_near, t_far );
+		slab( rx, ry, rz, &b.a1x[ i ], &b.a1y[ i ], &b.a1z[ i ], &b.h1[ i ], t_near, t_far );
+		slab( rx, ry, rz, &b.a2x[ i ], &b.a2y[ i ], &b.a2z[ i ], &b.h2[ i ], t_near, t_far );
+		__m128 t = blend( _mm_cmpge_ps( t_near, eps ), t_near, t_far );
+		__m128 hit = _mm_and_ps( _mm_cmple_ps( t_near, t_far ), _mm_cmpge_ps( t_far, eps ) );
+		return blend( hit, t, _mm_set1_ps( INFINITY ) );
+	}
+#endif
+};
+
+//индекс ближайшего примитива с расстоянием меньше t, t обновляется
+template< class Kernel >
+static size_t nearest( const Kernel & kernel, size_t count, float & t )
+{
+	size_t best = ~( size_t )0;
+#if SSE
+	const __m128 lanes = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+	for( size_t i = 0; i < count; i += 4 )
+	{
+		__m128 tt = kernel.block( i );
+		__m128 hit = _mm_and_ps( _mm_cmplt_ps( tt, _mm_set1_ps( t ) ),
+								 _mm_cmplt_ps( lanes, _mm_set1_ps( ( float )( count - i ) ) ) );
+		int mask = _mm_movemask_ps( hit );
+		if ( !mask )
+			continue;
+		float ts[ 4 ] __attribute__ ( ( aligned( 16 ) ) );
+		_mm_store_ps( ts, tt );
+		for( size_t k = 0; k < 4; k++ )
+			if ( ( mask & ( 1 << k ) ) && ts[ k ] < t )
+			{
+				t = ts[ k ];
+				best = i + k;
+			}
+	}
+#else
+	for( size_t i = 0; i < count; i++ )
+	{
+		float tt = kernel.one( i );
+		if ( tt < t )
+		{
+			t = tt;
+			best = i;
+		}
+	}
+#endif
+	return best;
+}
+
+template< class Kernel >
+static bool any( const Kernel & kernel, size_t count, const float & max_t )
+{
+#if SSE
+	const __m128 lanes = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+	for( size_t i = 0; i < count; i += 4 )
+	{
+		__m128 hit = _mm_and_ps( _mm_cmplt_ps( kernel.block( i ), _mm_set1_ps( max_t ) ),
+								 _mm_cmplt_ps( lanes, _mm_set1_ps( ( float )( count - i ) ) ) );
+		if ( _mm_movemask_ps( hit ) )
+			return true;
+	}
+#else
+	for( size_t i = 0; i < count; i++ )
+		if ( kernel.one( i ) < max_t )
+			return true;
+#endif
+	return false;
+}
+
+uint32_t Scene::add_material( const Material & material )
+{
+	m_materials.push_back( material );
+	m_materials.back().prepare();
+	return m_materials.size() - 1;
+}
+
+void Scene::touch_geometry()
+{
+	static std::atomic< uint64_t > s_versions( 0 );
+	m_geometry = ++s_versions;
+}
+
+void Scene::add_sphere( const Vector & center, const float & radius, uint32_t material )
+{
+	touch_geometry();
+	SphereArray & s = m_spheres;
+	size_t i = s.count++;
+	store( s.cx, i, center.x );
+	store( s.cy, i, center.y );
+	store( s.cz, i, center.z );
+	store( s.r2, i, radius * radius );
+	store( s.material, i, material );
+}
+
+void Scene::add_plane( const Matrix & m, const float & width, const float & height,
+					   uint32_t material, bool inverse_normal )
+{
+	touch_geometry();
+	Vector c = m.mul( Vector( 0.0f, 0.0f, 0.0f ) );
+	Vector u = m.mul( Vector( -width / 2.0f, height / 2.0f, 0.0f ) ) - c;
+	Vector v = m.mul( Vector( width / 2.0f, height / 2.0f, 0.0f ) ) - c;
+	Vector normal = u * v;
+	if ( !inverse_normal )
+		normal = normal.scalar( -1 );
+	normal.normalize();
+	Vector axis_x = m.mul( Vector( 1.0f, 0.0f, 0.0f ) ) - c;
+	Vector axis_y = m.mul( Vector( 0.0f, 1.0f, 0.0f ) ) - c;
+	axis_x.normalize();
+	axis_y.normalize();
+
+	QuadArray & q = m_quads;
+	size_t i = q.count++;
+	store( q.nx, i, normal.x );
+	store( q.ny, i, normal.y );
+	store( q.nz, i, normal.z );
+	store( q.d, i, -normal.dot( c ) );
+	store( q.cx, i, c.x );
+	store( q.cy, i, c.y );
+	store( q.cz, i, c.z );
+	store( q.ux, i, axis_x.x );
+	store( q.uy, i, axis_x.y );
+	store( q.uz, i, axis_x.z );
+	store( q.vx, i, axis_y.x );
+	store( q.vy, i, axis_y.y );
+	store( q.vz, i, axis_y.z );
+	store( q.hw, i, width / 2.0f );
+	store( q.hh, i, height / 2.0f );
+	store( q.material, i, material );
+}
+
+void Scene::add_box( const Vector & pos, const Vector & rotate, const float & size, uint32_t material )
+{
+	touch_geometry();
+	Matrix r = Matrix::RotateX( rotate.x ) * Matrix::RotateY( rotate.y ) * Matrix::RotateZ( rotate.z );
+	Vector a0 = r.mul( Vector( 1.0f, 0.0f, 0.0f ) );
+	Vector a1 = r.mul( Vector( 0.0f, 1.0f, 0.0f ) );
+	Vector a2 = r.mul( Vector( 0.0f, 0.0f, 1.0f ) );
+
+	BoxArray & b = m_boxes;
+	size_t i = b.count++;
+	store( b.cx, i, pos.x );
+	store( b.cy, i, pos.y );
+	store( b.cz, i, pos.z );
+	store( b.a0x, i, a0.x );
+	store( b.a0y, i, a0.y );
+	store( b.a0z, i, a0.z );
+	store( b.a1x, i, a1.x );
+	store( b.a1y, i, a1.y );
+	store( b.a1z, i, a1.z );
+	store( b.a2x, i, a2.x );
+	store( b.a2y, i, a2.y );
+	store( b.a2z, i, a2.z );
+	store( b.h0, i, size / 2.0f );
+	store( b.h1, i, size / 2.0f );
+	store( b.h2, i, size / 2.0f );
+	store( b.material, i, material );
+}
+
+Scene * Scene::replicate() const
+{
+	//столбцы, подключенные к кэшу сцены, остаются общими страницами отображенного файла
+	Scene * scene = new Scene( *this );
+	for( size_t i = 0; i < scene->m_materials.size(); i++ )
+	{
+		Material & material = scene->m_materials[ i ];
+		if ( material.m_texture )
+			material.m_texture = new Texture( *material.m_texture );
+	}
+	return scene;
+}
+
+void Scene::clear_geometry()
+{
+	touch_geometry();
+	m_static = false;
+	m_spheres = SphereArray();
+	m_quads = QuadArray();
+	m_boxes = BoxArray();
+}
+
+void Scene::fill_intersection( const Ray & ray, const float & t, uint32_t type, size_t i, Intersection & intersection ) const
+{
+	intersection.point = ray.point( t );
+	intersection.distance = t;
+	intersection.type = type;
+	intersection.index = i;
+
+	if ( type == PRIMITIVE_SPHERE )
+	{
+		const SphereArray & s = m_spheres;
+		Vector center( s.cx[ i ], s.cy[ i ], s.cz[ i ] );
+		intersection.normal = intersection.point - center;
+		intersection.normal.normalize( sqrt( s.r2[ i ] ) );
+		intersection.u = 0.0f;
+		intersection.v = 0.0f;
+		intersection.face = 0;
+		intersection.material = s.material[ i ];
+		return;
+	}
+
+	if ( type == PRIMITIVE_QUAD )
+	{
+		const QuadArray & q = m_quads;
+		Vector rel = intersection.point - Vector( q.cx[ i ], q.cy[ i ], q.cz[ i ] );
+		intersection.normal = Vector( q.nx[ i ], q.ny[ i ], q.nz[ i ] );
+		intersection.u = saturated( ( rel.dot( Vector( q.ux[ i ], q.uy[ i ], q.uz[ i ] ) ) + q.hw[ i ] ) / ( 2.0f * q.hw[ i ] ) );
+		intersection.v = saturated( ( rel.dot( Vector( q.vx[ i ], q.vy[ i ], q.vz[ i ] ) ) + q.hh[ i ] ) / ( 2.0f * q.hh[ i ] ) );
+		intersection.face = 0;
+		intersection.material = q.material[ i ];
+	}
+	else
+	{
+		const BoxArray & b = m_boxes;
+		uint32_t axis = 0;
+		BoxKernel< BoxArray >( b, ray ).one( i, &axis );
+		Vector rel = intersection.point - Vector( b.cx[ i ], b.cy[ i ], b.cz[ i ] );
+		Vector axes[ 3 ] = { Vector( b.a0x[ i ], b.a0y[ i ], b.a0z[ i ] ),
+							 Vector( b.a1x[ i ], b.a1y[ i ], b.a1z[ i ] ),
+							 Vector( b.a2x[ i ], b.a2y[ i ], b.a2z[ i ] ) };
+		float h[ 3 ] = { b.h0[ i ], b.h1[ i ], b.h2[ i ] };
+		uint32_t k1 = ( axis + 1 ) % 3;
+		uint32_t k2 = ( axis + 2 ) % 3;
+		bool positive = rel.dot( axes[ axis ] ) > 0.0f;
+		intersection.normal = positive ? axes[ axis ] : axes[ axis ].scalar( -1.0f );
+		intersection.face = axis * 2 + ( positive ? 1 : 0 );
+		intersection.u = saturated( ( rel.dot( axes[ k1 ] ) + h[ k1 ] ) / ( 2.0f * h[ k1 ] ) );
+		intersection.v = saturated( ( rel.dot( axes[ k2 ] ) + h[ k2 ] ) / ( 2.0f * h[ k2 ] ) );
+		intersection.material = b.material[ i ];
+	}
+}
+
+template< class S, class Q, class B >
+bool Scene::nearest_primitive( const S & spheres, const Q & quads, const B & boxes, const Ray & ray, float & t,
+							   uint32_t & type, size_t & index ) const
+{
+	t = INFINITY;
+	type = PRIMITIVE_TYPES;
+	index = 0;
+
+	size_t i = nearest( SphereKernel< S >( spheres, ray ), spheres.count, t );
+	if ( i != ~( size_t )0 )
+	{
+		type = PRIMITIVE_SPHERE;
+		index = i;
+	}
+	i = nearest( QuadKernel< Q >( quads, ray ), quads.count, t );
+	if ( i != ~( size_t )0 )
+	{
+		type = PRIMITIVE_QUAD;
+		index = i;
+	}
+	i = nearest( BoxKernel< B >( boxes, ray ), boxes.count, t );
+	if ( i != ~( size_t )0 )
+	{
+		type = PRIMITIVE_BOX;
+		index = i;
+	}
+	return type != PRIMITIVE_TYPES;
+}
+
+template< class S, class Q, class B >
+bool Scene::intersect( const S & spheres, const Q & quads, const B & boxes, const Ray & ray, Intersection & intersection ) const
+{
+	float t;
+	uint32_t type;
+	size_t index;
+	if ( !nearest_primitive( spheres, quads, boxes, ray, t, type, index ) )
+		return false;
+
+	fill_intersection( ray, t, type, index, intersection );
+	return true;
+}
+
+template< class S, class Q, class B >
+bool Scene::occluded( const S & spheres, const Q & quads, const B & boxes, const Ray & ray, const float & max_distance ) const
+{
+	return any( QuadKernel< Q >( quads, ray ), quads.count, max_distance ) ||
+		   any( BoxKernel< B >( boxes, ray ), boxes.count, max_distance ) ||
+		   any( SphereKernel< S >( spheres, ray ), spheres.count, max_distance );
+}
+
+//в статической сцене массивы и их длины - константы времени компиляции, ядра
+//разворачиваются и читают данные по постоянным адресам
+bool Scene::intersect( const Ray & ray, Intersection & intersection ) const
+{
+#ifdef STATIC_SCENE
+	if ( m_static )
+		return intersect( static_scene_t::spheres, static_scene_t::quads, static_scene_t::boxes, ray, intersection );
+#endif
+	return intersect( m_spheres, m_quads, m_boxes, ray, intersection );
+}
+
+bool Scene::occluded( const Ray & ray, const float & max_distance ) const
+{
+#ifdef STATIC_SCENE
+	if ( m_static )
+		return occluded( static_scene_t::spheres, static_scene_t::quads, static_scene_t::boxes, ray, max_distance );
+#endif
+	return occluded( m_spheres, m_quads, m_boxes, ray, max_distance );
+}
+
+namespace
+{
+
+//Боковые грани пирамиды - плоскости через eye и соседние углы основания, нормали внутрь.
+//Примитив отбрасывается, если его ограничивающая сфера целиком снаружи одной из граней
+struct frustum_t
+{
+	Vector  eye;
+	Vector  normals[ 4 ];
+
+	frustum_t( const Vector & eye_, const Vector * corners )
+		: eye( eye_ )
+	{
+		Vector inside = ( corners[ 0 ] + corners[ 1 ] + corners[ 2 ] + corners[ 3 ] ).scalar( 0.25f ) - eye;
+		for( int k = 0; k < 4; k++ )
+		{
+			normals[ k ] = ( corners[ k ] - eye ) * ( corners[ ( k + 1 ) % 4 ] - eye );
+			normals[ k ].normalize();
+			if ( normals[ k ].dot( inside ) < 0.0f )
+				normals[ k ] = normals[ k ].scalar( -1.0f );
+		}
+	}
+
+	bool visible( float x, float y, float z, float radius ) const
+	{
+		Vector d( x - eye.x, y - eye.y, z - eye.z );
+		for( int k = 0; k < 4; k++ )
+			if ( normals[ k ].dot( d ) < -radius )
+				return false;
+		return true;
+	}
+};
+
+//копирует примитивы index из source в target, столбцы сопоставляются по порядку columns()
+struct column_list_t
+{
+	std::vector< const void* >  data;
+
+	template< class T >
+	void operator()( const SoaColumn< T > & column )
+	{
+		data.push_back( &column );
+	}
+};
+
+struct column_gather_t
+{
+	const column_list_t &           list;
+	const std::vector< uint32_t > & index;
+	size_t                          column;
+
+	column_gather_t( const column_list_t & list_, const std::vector< uint32_t > & index_ )
+		: list( list_ ), index( index_ ), column( 0 )
+	{}
+
+	template< class T >
+	void operator()( SoaColumn< T > & c )
+	{
+		const SoaColumn< T > & source = *( const SoaColumn< T >* )list.data[ column++ ];
+		c.resize( padded( index.size() ) );
+		for( size_t k = 0; k < c.size(); k++ )
+			c.set( k, k < index.size() ? source[ index[ k ] ] : T() );
+	}
+};
+
+template< class A >
+void gather( const A & source, const std::vector< uint32_t > & index, A & target )
+{
+	column_list_t list;
+	A::columns( source, list );
+	column_gather_t gather( list, index );
+	A::columns( target, gather );
+	target.count = index.size();
+}
+
+//отобранные индексы типа переходят в index, массивы копируются, только если набор изменился
+template< class A >
+void update( const A & source, std::vector< uint32_t > & culled, std::vector< uint32_t > & index, A & target, bool same )
+{
+	if ( same && culled == index )
+		return;
+	index.swap( culled );
+	gather( source, index, target );
+}
+
+}
+
+//радиусы ограничивающих сфер берутся с запасом на допуски ядер пересечения
+void Scene::cull( const Vector & eye, const Vector * corners, CandidateSet & set, float margin ) const
+{
+	frustum_t frustum( eye, corners );
+	for( size_t t = 0; t < PRIMITIVE_TYPES; t++ )
+		set.culled[ t ].clear();
+
+	const SphereArray & s = m_spheres;
+	for( size_t i = 0; i < s.count; i++ )
+		if ( frustum.visible( s.cx[ i ], s.cy[ i ], s.cz[ i ], sqrtf( s.r2[ i ] ) + EPSILON + margin ) )
+			set.culled[ PRIMITIVE_SPHERE ].push_back( i );
+	const QuadArray & q = m_quads;
+	for( size_t i = 0; i < q.count; i++ )
+		if ( frustum.visible( q.cx[ i ], q.cy[ i ], q.cz[ i ], sqrtf( q.hw[ i ] * q.hw[ i ] + q.hh[ i ] * q.hh[ i ] ) + 2.0f * EPSILON + margin ) )
+			set.culled[ PRIMITIVE_QUAD ].push_back( i );
+	const BoxArray & b = m_boxes;
+	for( size_t i = 0; i < b.count; i++ )
+		if ( frustum.visible( b.cx[ i ], b.cy[ i ], b.cz[ i ],
+							  sqrtf( b.h0[ i ] * b.h0[ i ] + b.h1[ i ] * b.h1[ i ] + b.h2[ i ] * b.h2[ i ] ) + EPSILON + margin ) )
+			set.culled[ PRIMITIVE_BOX ].push_back( i );
+
+	bool same = set.geometry == m_geometry;
+	update( m_spheres, set.culled[ PRIMITIVE_SPHERE ], set.index[ PRIMITIVE_SPHERE ], set.spheres, same );
+	update( m_quads, set.culled[ PRIMITIVE_QUAD ], set.index[ PRIMITIVE_QUAD ], set.quads, same );
+	update( m_boxes, set.culled[ PRIMITIVE_BOX ], set.index[ PRIMITIVE_BOX ], set.boxes, same );
+	set.geometry = m_geometry;
+}
+
+bool Scene::intersect( const CandidateSet & set, const Ray & ray, Intersection & intersection ) const
+{
+	float t;
+	uint32_t type;
+	size_t index;
+	if ( !nearest_primitive( set.spheres, set.quads, set.boxes, ray, t, type, index ) )
+		return false;
+
+	fill_intersection( ray, t, type, set.index[ type ][ index ], intersection );
+	return true;
+}
+
+bool Scene::occluded( const CandidateSet & set, const Ray & ray, const float & max_distance ) const
+{
+	return occluded( set.spheres, set.quads, set.boxes, ray, max_distance );
+}
+
+namespace
+{
+
+//Отрезки из point к шару источника лежат в выпуклой оболочке точки и шара. s_point, s_center -
+//расстояния со знаком до плоскости, примитив с одной ее стороны ( s <= 0 ): оболочка отделена,
+//если она целиком с другой стороны
+bool separated( float s_point, float s_center, float radius )
+{
+	return s_point >= -EPSILON && s_center - radius > 0.0f;
+}
+
+struct shadow_hull_t
+{
+	Vector  point;
+	Vector  center;
+	float   radius;
+	//ось point - center, ее длина и направление
+	Vector  axis;
+	float   length;
+
+	shadow_hull_t( const Vector & point_, const Vector & center_, float radius_ )
+		: point( point_ ), center( center_ ), radius( radius_ ), axis( center_ - point_ ), length( axis.length() )
+	{
+		if ( length > 0.0f )
+			axis = axis.scalar( 1.0f / length );
+	}
+
+	//оболочка лежит в капсуле радиуса radius вокруг оси, сфера ( o, r ) вне этой капсулы
+	bool apart( const Vector & o, float r ) const
+	{
+		Vector d = o - point;
+		float t = std::min( std::max( d.dot( axis ), 0.0f ), length );
+		return ( d - axis.scalar( t ) ).length() > r + radius;
+	}
+
+	//Сфера ( o, r ) закрывает все направления из point на шар и целиком ближе него. Запас в угле
+	//покрывает погрешность углов, посчитанных в float
+	bool covered( const Vector & o, float r ) const
+	{
+		Vector d = o - point;
+		float distance = d.length();
+		if ( distance <= r || distance + r >= length - radius )
+			return false;
+		float cos_between = std::min( std::max( d.dot( axis ) / distance, -1.0f ), 1.0f );
+		float between = acosf( cos_between );
+		return between + asinf( std::min( radius / length, 1.0f ) ) + 1e-3f < asinf( r / distance );
+	}
+};
+
+}
+
+template< class S, class Q, class B >
+shadow_bound_t Scene::shadow_bound( const S & s, const Q & q, const B & b, const Vector & point, const Vector & center,
+									float radius ) const
+{
+	shadow_hull_t hull( point, center, radius );
+	bool unknown = false;
+	for( size_t i = 0; i < s.count; i++ )
+	{
+		Vector o( s.cx[ i ], s.cy[ i ], s.cz[ i ] );
+		float r = sqrtf( s.r2[ i ] );
+		if ( hull.covered( o, r ) )
+			return SHADOW_FULL;
+		//касательная плоскость в ближайшей к point точке сферы
+		Vector n = point - o;
+		float distance = n.length();
+		if ( hull.apart( o, r ) ||
+			 ( distance > 0.0f && separated( distance - r, n.dot( center - o ) / distance - r, radius ) ) )
+			continue;
+		unknown = true;
+	}
+	for( size_t i = 0; i < q.count; i++ )
+	{
+		Vector n( q.nx[ i ], q.ny[ i ], q.nz[ i ] );
+		float s_point = n.dot( point ) + q.d[ i ];
+		float s_center = n.dot( center ) + q.d[ i ];
+		if ( separated( s_point, s_center, radius ) || separated( -s_point, -s_center, radius ) ||
+			 hull.apart( Vector( q.cx[ i ], q.cy[ i ], q.cz[ i ] ),
+						 sqrtf( q.hw[ i ] * q.hw[ i ] + q.hh[ i ] * q.hh[ i ] ) + EPSILON ) )
+			continue;
+		unknown = true;
+	}
+	for( size_t i = 0; i < b.count; i++ )
+	{
+		Vector o( b.cx[ i ], b.cy[ i ], b.cz[ i ] );
+		Vector axes[ 3 ] = { Vector( b.a0x[ i ], b.a0y[ i ], b.a0z[ i ] ), Vector( b.a1x[ i ], b.a1y[ i ], b.a1z[ i ] ),
+							 Vector( b.a2x[ i ], b.a2y[ i ], b.a2z[ i ] ) };
+		float h[ 3 ] = { b.h0[ i ], b.h1[ i ], b.h2[ i ] };
+		if ( hull.covered( o, std::min( std::min( h[ 0 ], h[ 1 ] ), h[ 2 ] ) ) )
+			return SHADOW_FULL;
+		bool apart = hull.apart( o, sqrtf( h[ 0 ] * h[ 0 ] + h[ 1 ] * h[ 1 ] + h[ 2 ] * h[ 2 ] ) + EPSILON );
+		for( int k = 0; k < 3 && !apart; k++ )
+		{
+			float s_point = axes[ k ].dot( point - o );
+			float s_center = axes[ k ].dot( center - o );
+			apart = separated( s_point - h[ k ], s_center - h[ k ], radius ) ||
+					separated( -s_point - h[ k ], -s_center - h[ k ], radius );
+		}
+		if ( !apart )
+			unknown = true;
+	}
+	return unknown ? SHADOW_UNKNOWN : SHADOW_NONE;
+}
+
+shadow_bound_t Scene::shadow_bound( const CandidateSet & set, const Vector & point, const Vector & center,
+									float radius ) const
+{
+	return shadow_bound( set.spheres, set.quads, set.boxes, point, center, radius );
+}
+
+shadow_bound_t Scene::shadow_bound( const Vector & point, const Vector & center, float radius ) const
+{
+#ifdef STATIC_SCENE
+	if ( m_static )
+		return shadow_bound( static_scene_t::spheres, static_scene_t::quads, static_scene_t::boxes, point, center, radius );
+#endif
+	return shadow_bound( m_spheres, m_quads, m_boxes, point, center, radius );
+}
+
+//столбцы статической сцены в порядке columns(), подключаются к массивам Scene без копирования
+struct static_column_list_t
+{
+	std::vector< const void* >  data;
+	size_t                      size;
+
+	template< class T, size_t N >
+	void operator()( const T ( &column )[ N ] )
+	{
+		data.push_back( column );
+		size = N;
+	}
+};
+
+struct static_column_loader_t
+{
+	const static_column_list_t &    list;
+	size_t                          column;
+
+	static_column_loader_t( const static_column_list_t & list_ )
+		: list( list_ ), column( 0 )
+	{}
+
+	template< class T >
+	void operator()( SoaColumn< T > & c )
+	{
+		c.attach( ( const T* )list.data[ column++ ], list.size );
+	}
+};
+
+template< class S, class A >
+static void attach_static_columns( const S & source, A & target )
+{
+	static_column_list_t list;
+	S::columns( source, list );
+	static_column_loader_t loader( list );
+	A::columns( target, loader );
+	target.count = source.count;
+}
+
+bool Scene::attach_static( std::vector< ObjectLight > & lights )
+{
+	touch_geometry();
+#ifdef STATIC_SCENE
+	typedef static_scene_t D;
+	attach_static_columns( D::spheres, m_spheres );
+	attach_static_columns( D::quads, m_quads );
+	attach_static_columns( D::boxes, m_boxes );
+	for( size_t i = 0; i < D::materials_count; i++ )
+	{
+		const static_material_t & r = D::materials[ i ];
+		add_material( Material( Color( r.ambient[ 0 ], r.ambient[ 1 ], r.ambient[ 2 ] ), Color( r.diffuse[ 0 ], r.diffuse[ 1 ], r.diffuse[ 2 ] ),
+								Color( r.specular[ 0 ], r.specular[ 1 ], r.specular[ 2 ] ), r.beta, r.phong, r.refract_amount,
+								r.refract_coef, r.texture ) );
+	}
+	for( size_t i = 0; i < D::lights_count; i++ )
+	{
+		const static_light_t & r = D::lights[ i ];
+		ObjectLight l( Vector( r.center[ 0 ], r.center[ 1 ], r.center[ 2 ] ), Color( r.color[ 0 ], r.color[ 1 ], r.color[ 2 ] ), r.radius );
+		l.m_type = ( light_type_t )r.type;
+		l.m_sphere_radius = r.sphere_radius;
+		l.m_u = Vector( r.u[ 0 ], r.u[ 1 ], r.u[ 2 ] );
+		l.m_v = Vector( r.v[ 0 ], r.v[ 1 ], r.v[ 2 ] );
+		lights.push_back( l );
+	}
+	m_static = true;
+	return true;
+#else
+	( void )lights;
+	return false;
+#endif
+}
+
+void Scene::GetReflectRefractVectors( const Ray & ray, const Intersection & intersection,
+									  Vector & reflect, Vector & refract, float & reflectAmount ) const
+{
+	const Material & material = m_materials[ intersection.material ];
+	Vector i = ray.vector;
+	Vector n = intersection.normal;
+	reflect = i.reflect( n );
+	reflect.normalize();
+	reflectAmount = 1.0f;
+	if ( material.m_refract_amount > 0 )
+	{
+		float refract_coef = material.m_refract_coef;
+		float cos_i = -i.dot( n );
+		if(  cos_i < 0.0f  )
+		{
+			n = n.scalar( -1 );
+			cos_i = -i.dot( n );
+			refract_coef = 1.0f / refract_coef;
+		}
+		float sin2_t = refract_coef * refract_coef * ( 1.0f - cos_i * cos_i );
+
+		if( sin2_t <= 1.0f  )
+		{
+			float cos_t = sqrt( 1.0f - sin2_t );
+			refract = i.scalar( refract_coef ) + n.scalar( refract_coef * cos_i - cos_t );
+			refract.normalize();
+			float Rorto  = ( cos_i - refract_coef * cos_t ) / ( cos_i + refract_coef * cos_t );
+			float Rparal = ( refract_coef * cos_i - cos_t ) / ( refract_coef * cos_i + cos_t );
+			reflectAmount = ( Rorto * Rorto + Rparal * Rparal ) / 2.0f;
+		}
+		else
+		{
+			refract = reflect;
+		}
+	}
+}
@@ -0,0 +1,310 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <vector>
+#include <stdint.h>
+
+#include "Object.hpp"
+#include "Material.hpp"
+
+enum primitive_type_t
+{
+    PRIMITIVE_SPHERE,
+    PRIMITIVE_QUAD,
+    PRIMITIVE_BOX,
+    PRIMITIVE_TYPES
+};
+
+//оценка тени точки от источника без теневых лучей, см. Scene::shadow_bound
+enum shadow_bound_t
+{
+    //ни один примитив не пересекает отрезки из точки к источнику
+    SHADOW_NONE,
+    //все отрезки пересекают один примитив
+    SHADOW_FULL,
+    //нужны лучи
+    SHADOW_UNKNOWN
+};
+
+//идентификатор объекта для пересечения, ~0 для промаха
+inline uint32_t object_id( const Intersection & intersection )
+{
+    if ( intersection.type >= PRIMITIVE_TYPES )
+        return ~0u;
+    return ( intersection.type << 24 ) | intersection.index;
+}
+
+//Столбец структуры массивов: данные либо свои, либо во внешней памяти ( отображенный в
+//память кэш сцены, см. SceneCache.hpp ), во втором случае столбец только для чтения
+template< class T >
+class SoaColumn
+{
+private:
+    std::vector< T >    m_storage;
+    const T*            m_data;
+    size_t              m_size;
+public:
+    SoaColumn()
+        : m_data( NULL ), m_size( 0 )
+    {}
+    SoaColumn( const SoaColumn & other )
+        : m_storage( other.m_storage ), m_data( other.owns() ? m_storage.data() : other.m_data ), m_size( other.m_size )
+    {}
+    SoaColumn & operator=( const SoaColumn & other )
+    {
+        m_storage = other.m_storage;
+        m_data = other.owns() ? m_storage.data() : other.m_data;
+        m_size = other.m_size;
+        return *this;
+    }
+
+    const T & operator[]( size_t i ) const
+    {
+        return m_data[ i ];
+    }
+    const T * data() const
+    {
+        return m_data;
+    }
+    size_t size() const
+    {
+        return m_size;
+    }
+    bool owns() const
+    {
+        return m_data == m_storage.data();
+    }
+
+    void resize( size_t size )
+    {
+        m_storage.resize( size );
+        m_data = m_storage.data();
+        m_size = size;
+    }
+    void set( size_t i, const T & value )
+    {
+        m_storage[ i ] = value;
+    }
+    void attach( const T * data, size_t size )
+    {
+        m_storage.clear();
+        m_data = data;
+        m_size = size;
+    }
+};
+
+//Примитивы хранятся по типам в виде структуры массивов. Длина массивов выровнена до
+//кратной 4 нулями, чтобы SSE ядра пересечения читали целые блоки без проверок.
+//columns() обходит столбцы в фиксированном порядке, на нем основан формат кэша сцены
+struct SphereArray
+{
+    SoaColumn< float >      cx, cy, cz;
+    SoaColumn< float >      r2;
+    SoaColumn< uint32_t >   material;
+    size_t                  count;
+
+    SphereArray()
+        : count( 0 )
+    {}
+
+    //a - SphereArray, QuadArray или BoxArray, в том числе const
+    template< class A, class F >
+    static void columns( A & a, F & f )
+    {
+        f( a.cx ); f( a.cy ); f( a.cz );
+        f( a.r2 );
+        f( a.material );
+    }
+};
+
+struct QuadArray
+{
+    //плоскость n * p + d = 0
+    SoaColumn< float >      nx, ny, nz, d;
+    //центр и единичные оси прямоугольника
+    SoaColumn< float >      cx, cy, cz;
+    SoaColumn< float >      ux, uy, uz;
+    SoaColumn< float >      vx, vy, vz;
+    //половины ширины и высоты
+    SoaColumn< float >      hw, hh;
+    SoaColumn< uint32_t >   material;
+    size_t                  count;
+
+    QuadArray()
+        : count( 0 )
+    {}
+
+    template< class A, class F >
+    static void columns( A & a, F & f )
+    {
+        f( a.nx ); f( a.ny ); f( a.nz ); f( a.d );
+        f( a.cx ); f( a.cy ); f( a.cz );
+        f( a.ux ); f( a.uy ); f( a.uz );
+        f( a.vx ); f( a.vy ); f( a.vz );
+        f( a.hw ); f( a.hh );
+        f( a.material );
+    }
+};
+
+struct BoxArray
+{
+    //центр, три единичные оси и половины сторон ориентированного параллелепипеда
+    SoaColumn< float >      cx, cy, cz;
+    SoaColumn< float >      a0x, a0y, a0z;
+    SoaColumn< float >      a1x, a1y, a1z;
+    SoaColumn< float >      a2x, a2y, a2z;
+    SoaColumn< float >      h0, h1, h2;
+    SoaColumn< uint32_t >   material;
+    size_t                  count;
+
+    BoxArray()
+        : count( 0 )
+    {}
+
+    template< class A, class F >
+    static void columns( A & a, F & f )
+    {
+        f( a.cx ); f( a.cy ); f( a.cz );
+        f( a.a0x ); f( a.a0y ); f( a.a0z );
+        f( a.a1x ); f( a.a1y ); f( a.a1z );
+        f( a.a2x ); f( a.a2y ); f( a.a2z );
+        f( a.h0 ); f( a.h1 ); f( a.h2 );
+        f( a.material );
+    }
+};
+
+//Примитивы, ограничивающие сферы которых пересекают пирамиду видимости части экрана ( см.
+//Scene::cull ): компактные копии массивов сцены и индексы этих примитивов в сцене, index[ type ].
+//Порядок примитивов сохраняется, поэтому для луча из пирамиды пересечение с набором дает тот же
+//результат, что со всей сценой
+struct CandidateSet
+{
+    SphereArray             spheres;
+    QuadArray               quads;
+    BoxArray                boxes;
+    std::vector< uint32_t > index[ PRIMITIVE_TYPES ];
+    //версия геометрии сцены, из которой скопированы массивы, 0 - не копировались. Соседние тайлы
+    //обычно видят те же примитивы, тогда массивы прошлого cull остаются без копирования
+    uint64_t                geometry;
+    //индексы, отобранные cull, до сравнения с index
+    std::vector< uint32_t > culled[ PRIMITIVE_TYPES ];
+
+    CandidateSet()
+        : geometry( 0 )
+    {}
+};
+
+class Scene
+{
+    friend class SceneCache;
+    friend class GeometryPager;
+    friend class Lightmap;
+    friend class StaticScene;
+private:
+    std::vector< Material > m_materials;
+    SphereArray             m_spheres;
+    QuadArray               m_quads;
+    BoxArray                m_boxes;
+    //столбцы подключены к сцене, вкомпилированной в программу ( см. StaticScene.hpp ),
+    //пересечение идет по ее константным массивам
+    bool                    m_static;
+    //версия геометрии, уникальная среди всех сцен процесса; копия сцены ( replicate ) ее сохраняет
+    uint64_t                m_geometry;
+
+    //новая версия геометрии после изменения примитивов
+    void touch_geometry();
+
+    void fill_intersection( const Ray & ray, const float & t, uint32_t type, size_t index, Intersection & intersection ) const;
+    //тип и индекс ближайшего примитива в массивах, t - расстояние до него
+    template< class S, class Q, class B >
+    bool nearest_primitive( const S & spheres, const Q & quads, const B & boxes, const Ray & ray, float & t,
+                            uint32_t & type, size_t & index ) const;
+    template< class S, class Q, class B >
+    bool intersect( const S & spheres, const Q & quads, const B & boxes, const Ray & ray, Intersection & intersection ) const;
+    template< class S, class Q, class B >
+    bool occluded( const S & spheres, const Q & quads, const B & boxes, const Ray & ray, const float & max_distance ) const;
+    template< class S, class Q, class B >
+    shadow_bound_t shadow_bound( const S & spheres, const Q & quads, const B & boxes, const Vector & point,
+                                 const Vector & center, float radius ) const;
+public:
+    Scene()
+        : m_static( false ), m_geometry( 0 )
+    {
+        touch_geometry();
+    }
+
+    uint32_t add_material( const Material & material );
+    void add_sphere( const Vector & center, const float & radius, uint32_t material );
+    void add_plane( const Matrix & m, const float & width, const float & height,
+                    uint32_t material, bool inverse_normal = false );
+    void add_box( const Vector & pos, const Vector & rotate, const float & size, uint32_t material );
+    //полная копия сцены вместе с текстурами; память выделяется и заполняется вызывающим потоком,
+    //поэтому копия, сделанная потоком на узле NUMA, лежит в памяти этого узла
+    Scene * replicate() const;
+    //удаляет примитивы, материалы остаются; геометрия тогда подкачивается GeometryPager
+    void clear_geometry();
+    //сцена из заголовка, заданного при сборке -DSTATIC_SCENE="file.hpp"; scene должна быть пустой,
+    //false, если программа собрана без статической сцены
+    bool attach_static( std::vector< ObjectLight > & lights );
+
+    const Material & material( uint32_t index ) const
+    {
+        return m_materials[ index ];
+    }
+    //замена коэффициентов материала, текстура остается прежней
+    void set_material( uint32_t index, const Material & material )
+    {
+        Texture * texture = m_materials[ index ].m_texture;
+        m_materials[ index ] = material;
+        m_materials[ index ].m_texture = texture;
+        m_materials[ index ].prepare();
+    }
+    size_t materials_count() const
+    {
+        return m_materials.size();
+    }
+
+    //цвет текстуры материала в точке пересечения
+    Color texel( const Intersection & intersection ) const
+    {
+        if ( intersection.type == PRIMITIVE_SPHERE )
+            return Color( 1.0f, 1.0f, 1.0f );
+        return m_materials[ intersection.material ].get_color( intersection.u, intersection.v );
+    }
+
+    //диффузный цвет поверхности для денойзера, у зеркал и прозрачных материалов - белый
+    Color albedo( const Intersection & intersection ) const
+    {
+        const Material & m = m_materials[ intersection.material ];
+        if ( !( m.m_features & MATERIAL_DIFFUSE ) )
+            return Color( 1.0f, 1.0f, 1.0f );
+        if ( m.m_features & MATERIAL_TEXTURED )
+            return m.m_diffuse * texel( intersection );
+        return m.m_diffuse;
+    }
+
+    //ближайшее пересечение луча со сценой
+    bool intersect( const Ray & ray, Intersection & intersection ) const;
+    //есть ли хоть одно пересечение на расстоянии меньше max_distance
+    bool occluded( const Ray & ray, const float & max_distance ) const;
+    //набор примитивов, которые могут пересечь лучи из eye внутри пирамиды с вершиной eye и
+    //основанием corners ( четыре точки в порядке обхода ), расширенной на margin
+    void cull( const Vector & eye, const Vector * corners, CandidateSet & set, float margin = 0.0f ) const;
+    //ближайшее пересечение луча из пирамиды набора только с примитивами набора
+    bool intersect( const CandidateSet & set, const Ray & ray, Intersection & intersection ) const;
+    bool occluded( const CandidateSet & set, const Ray & ray, const float & max_distance ) const;
+    //Консервативная проверка отрезков из point ко всем точкам шара ( center, radius ) с примитивами
+    //набора: примитив не затеняет, если его отделяет плоскость грани или касательная плоскость либо
+    //он дальше radius от оси point - center; затеняет целиком, если вписанная в него сфера лежит
+    //ближе шара и закрывает весь его угловой размер. Точка на самой поверхности примитива считается
+    //снаружи с допуском EPSILON
+    shadow_bound_t shadow_bound( const CandidateSet & set, const Vector & point, const Vector & center,
+                                 float radius ) const;
+    //то же со всеми примитивами сцены, когда набора кэша теней нет
+    shadow_bound_t shadow_bound( const Vector & point, const Vector & center, float radius ) const;
+
+    void GetReflectRefractVectors( const Ray & ray, const Intersection & intersection,
+                                   Vector & reflect, Vector & refract, float & reflectAmount ) const;
+};
+
+#endif // SCENE_HPP
@@ -0,0 +1,313 @@
+#include "SceneCache.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char g_magic[ 8 ] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+
+static size_t padded( size_t count )
+{
+	return ( count + 3 ) & ~( size_t )3;
+}
+
+//дописывает данные в конец blob с выравниванием, возвращает смещение
+static uint64_t append( std::vector< uint8_t > & blob, const void * data, size_t bytes )
+{
+	size_t offset = ( blob.size() + SCENE_CACHE_ALIGN - 1 ) & ~( size_t )( SCENE_CACHE_ALIGN - 1 );
+	blob.resize( offset + bytes, 0 );
+	if ( bytes )
+		memcpy( &blob[ offset ], data, bytes );
+	return offset;
+}
+
+struct column_writer_t
+{
+	std::vector< uint8_t > &    blob;
+	std::vector< uint64_t > &   offsets;
+	size_t                      count;
+
+	column_writer_t( std::vector< uint8_t > & blob_, std::vector< uint64_t > & offsets_ )
+		: blob( blob_ ), offsets( offsets_ ), count( 0 )
+	{}
+
+	template< class T >
+	void operator()( const SoaColumn< T > & column )
+	{
+		std::vector< T > values( padded( count ), T() );
+		for( size_t i = 0; i < count; i++ )
+			values[ i ] = column[ i ];
+		offsets.push_back( append( blob, values.data(), values.size() * sizeof( T ) ) );
+	}
+};
+
+struct column_loader_t
+{
+	const uint8_t *     base;
+	uint64_t            size;
+	const uint64_t *    offsets;
+	size_t              column;
+	size_t              count;
+	bool                ok;
+
+	column_loader_t( const uint8_t * base_, uint64_t size_, const uint64_t * offsets_ )
+		: base( base_ ), size( size_ ), offsets( offsets_ ), column( 0 ), count( 0 ), ok( true )
+	{}
+
+	template< class T >
+	void operator()( SoaColumn< T > & column_ )
+	{
+		uint64_t offset = offsets[ column++ ];
+		uint64_t bytes = padded( count ) * sizeof( T );
+		if ( offset % SCENE_CACHE_ALIGN || offset > size || bytes > size - offset )
+		{
+			ok = false;
+			return;
+		}
+		column_.attach( ( const T* )( base + offset ), padded( count ) );
+	}
+};
+
+struct column_counter_t
+{
+	size_t count;
+
+	column_counter_t()
+		: count( 0 )
+	{}
+
+	template< class T >
+	void operator()( const SoaColumn< T > & )
+	{
+		count++;
+	}
+};
+
+static void to_floats( const Color & c, float * f )
+{
+	f[ 0 ] = c.r;
+	f[ 1 ] = c.g;
+	f[ 2 ] = c.b;
+}
+
+static void to_floats( const Vector & v, float * f )
+{
+	f[ 0 ] = v.x;
+	f[ 1 ] = v.y;
+	f[ 2 ] = v.z;
+}
+
+bool SceneCache::write( const std::string & file_name, const Scene & scene, const std::vector< ObjectLight > & lights )
+{
+	std::vector< uint8_t > blob;
+	scene_cache_header_t header;
+	memset( &header, 0, sizeof( header ) );
+	append( blob, &header, sizeof( header ) );
+
+	//текстуры без пикселей ( файл не прочитался ) не сохраняются, материал получает белый цвет
+	std::vector< const Texture* > textures;
+	std::vector< scene_cache_material_t > materials( scene.m_materials.size() );
+	for( size_t i = 0; i < scene.m_materials.size(); i++ )
+	{
+		const Material & m = scene.m_materials[ i ];
+		scene_cache_material_t & r = materials[ i ];
+		memset( &r, 0, sizeof( r ) );
+		to_floats( m.m_ambient, r.ambient );
+		to_floats( m.m_diffuse, r.diffuse );
+		to_floats( m.m_specular, r.specular );
+		r.beta = m.m_beta;
+		r.phong = m.m_phong;
+		r.refract_amount = m.m_refract_amount;
+		r.refract_coef = m.m_refract_coef;
+		r.texture = -1;
+		if ( m.m_texture && m.m_texture->width() )
+		{
+			size_t t = 0;
+			while( t < textures.size() && textures[ t ] != m.m_texture )
+				t++;
+			if ( t == textures.size() )
+				textures.push_back( m.m_texture );
+			r.texture = t;
+		}
+	}
+
+	std::vector< scene_cache_texture_t > texture_records( textures.size() );
+	for( size_t t = 0; t < textures.size(); t++ )
+	{
+		scene_cache_texture_t & r = texture_records[ t ];
+		memset( &r, 0, sizeof( r ) );
+		r.width = textures[ t ]->width();
+		r.height = textures[ t ]->height();
+		//текстура из файла тайлов собирается целиком только здесь
+		std::vector< Color > pixels;
+		textures[ t ]->copy_pixels( pixels );
+		r.pixels_offset = append( blob, pixels.data(), pixels.size() * sizeof( Color ) );
+	}
+
+	std::vector< scene_cache_light_t > light_records( lights.size() );
+	for( size_t i = 0; i < lights.size(); i++ )
+	{
+		const ObjectLight & l = lights[ i ];
+		scene_cache_light_t & r = light_records[ i ];
+		memset( &r, 0, sizeof( r ) );
+		r.type = l.m_type;
+		to_floats( l.m_color, r.color );
+		to_floats( l.m_center, r.center );
+		r.radius = l.m_radius;
+		r.sphere_radius = l.m_sphere_radius;
+		to_floats( l.m_u, r.u );
+		to_floats( l.m_v, r.v );
+	}
+
+	std::vector< uint64_t > columns;
+	column_writer_t writer( blob, columns );
+	writer.count = scene.m_spheres.count;
+	SphereArray::columns( scene.m_spheres, writer );
+	writer.count = scene.m_quads.count;
+	QuadArray::columns( scene.m_quads, writer );
+	writer.count = scene.m_boxes.count;
+	BoxArray::columns( scene.m_boxes, writer );
+
+	memcpy( header.magic, g_magic, sizeof( g_magic ) );
+	header.version = SCENE_CACHE_VERSION;
+	header.header_size = sizeof( header );
+	header.counts[ PRIMITIVE_SPHERE ] = scene.m_spheres.count;
+	header.counts[ PRIMITIVE_QUAD ] = scene.m_quads.count;
+	header.counts[ PRIMITIVE_BOX ] = scene.m_boxes.count;
+	header.columns = columns.size();
+	header.materials = materials.size();
+	header.textures = texture_records.size();
+	header.lights = light_records.size();
+	header.columns_offset = append( blob, columns.data(), columns.size() * sizeof( uint64_t ) );
+	header.materials_offset = append( blob, materials.data(), materials.size() * sizeof( scene_cache_material_t ) );
+	header.textures_offset = append( blob, texture_records.data(), texture_records.size() * sizeof( scene_cache_texture_t ) );
+	header.lights_offset = append( blob, light_records.data(), light_records.size() * sizeof( scene_cache_light_t ) );
+	header.file_size = blob.size();
+	memcpy( &blob[ 0 ], &header, sizeof( header ) );
+
+	FILE * f = fopen( file_name.c_str(), "wb" );
+	if ( !f )
+		return false;
+	bool ok = fwrite( blob.data(), 1, blob.size(), f ) == blob.size();
+	ok = fclose( f ) == 0 && ok;
+	return ok;
+}
+
+SceneCache::SceneCache()
+	: m_data( NULL ), m_size( 0 )
+{
+}
+
+SceneCache::~SceneCache()
+{
+	unload();
+}
+
+void SceneCache::unload()
+{
+	if ( m_data )
+		munmap( m_data, m_size );
+	m_data = NULL;
+	m_size = 0;
+}
+
+static bool in_file( uint64_t offset, uint64_t count, uint64_t item, uint64_t size )
+{
+	return offset <= size && count * item <= size - offset;
+}
+
+bool SceneCache::load( const std::string & file_name, Scene & scene, std::vector< ObjectLight > & lights )
+{
+	unload();
+
+	int fd = open( file_name.c_str(), O_RDONLY );
+	if ( fd < 0 )
+		return false;
+	struct stat st;
+	if ( fstat( fd, &st ) || ( size_t )st.st_size < sizeof( scene_cache_header_t ) )
+	{
+		close( fd );
+		return false;
+	}
+	m_size = st.st_size;
+	m_data = mmap( NULL, m_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( m_data == MAP_FAILED )
+	{
+		m_data = NULL;
+		m_size = 0;
+		return false;
+	}
+
+	const uint8_t * base = ( const uint8_t* )m_data;
+	const scene_cache_header_t & h = *( const scene_cache_header_t* )base;
+	column_counter_t counter;
+	SphereArray::columns( scene.m_spheres, counter );
+	QuadArray::columns( scene.m_quads, counter );
+	BoxArray::columns( scene.m_boxes, counter );
+	size_t columns = counter.count;
+	bool valid = memcmp( h.magic, g_magic, sizeof( g_magic ) ) == 0 && h.version == SCENE_CACHE_VERSION &&
+				 h.header_size == sizeof( scene_cache_header_t ) && h.file_size == m_size && h.columns == columns &&
+				 in_file( h.columns_offset, h.columns, sizeof( uint64_t ), m_size ) &&
+				 in_file( h.materials_offset, h.materials, sizeof( scene_cache_material_t ), m_size ) &&
+				 in_file( h.textures_offset, h.textures, sizeof( scene_cache_texture_t ), m_size ) &&
+				 in_file( h.lights_offset, h.lights, sizeof( scene_cache_light_t ), m_size );
+
+	const scene_cache_texture_t * textures = ( const scene_cache_texture_t* )( base + h.textures_offset );
+	for( uint32_t t = 0; valid && t < h.textures; t++ )
+		valid = in_file( textures[ t ].pixels_offset, ( uint64_t )textures[ t ].width * textures[ t ].height, sizeof( Color ), m_size ) &&
+				textures[ t ].pixels_offset % SCENE_CACHE_ALIGN == 0;
+
+	column_loader_t loader( base, m_size, ( const uint64_t* )( base + h.columns_offset ) );
+	if ( valid )
+	{
+		loader.count = h.counts[ PRIMITIVE_SPHERE ];
+		SphereArray::columns( scene.m_spheres, loader );
+		loader.count = h.counts[ PRIMITIVE_QUAD ];
+		QuadArray::columns( scene.m_quads, loader );
+		loader.count = h.counts[ PRIMITIVE_BOX ];
+		BoxArray::columns( scene.m_boxes, loader );
+		valid = loader.ok;
+	}
+	if ( !valid )
+	{
+		fprintf( stderr, "%s: not a valid scene cache\n", file_name.c_str() );
+		scene = Scene();
+		unload();
+		return false;
+	}
+	scene.m_spheres.count = h.counts[ PRIMITIVE_SPHERE ];
+	scene.m_quads.count = h.counts[ PRIMITIVE_QUAD ];
+	scene.m_boxes.count = h.counts[ PRIMITIVE_BOX ];
+	scene.touch_geometry();
+
+	const scene_cache_material_t * materials = ( const scene_cache_material_t* )( base + h.materials_offset );
+	for( uint32_t i = 0; i < h.materials; i++ )
+	{
+		const scene_cache_material_t & r = materials[ i ];
+		Material m( Color( r.ambient[ 0 ], r.ambient[ 1 ], r.ambient[ 2 ] ), Color( r.diffuse[ 0 ], r.diffuse[ 1 ], r.diffuse[ 2 ] ),
+					Color( r.specular[ 0 ], r.specular[ 1 ], r.specular[ 2 ] ), r.beta, r.phong, r.refract_amount, r.refract_coef );
+		if ( r.texture >= 0 && ( uint32_t )r.texture < h.textures )
+		{
+			const scene_cache_texture_t & t = textures[ r.texture ];
+			m.m_texture = new Texture( ( const Color* )( base + t.pixels_offset ), t.width, t.height );
+		}
+		scene.add_material( m );
+	}
+
+	const scene_cache_light_t * light_records = ( const scene_cache_light_t* )( base + h.lights_offset );
+	for( uint32_t i = 0; i < h.lights; i++ )
+	{
+		const scene_cache_light_t & r = light_records[ i ];
+		ObjectLight l( Vector( r.center[ 0 ], r.center[ 1 ], r.center[ 2 ] ), Color( r.color[ 0 ], r.color[ 1 ], r.color[ 2 ] ), r.radius );
+		l.m_type = ( light_type_t )r.type;
+		l.m_sphere_radius = r.sphere_radius;
+		l.m_u = Vector( r.u[ 0 ], r.u[ 1 ], r.u[ 2 ] );
+		l.m_v = Vector( r.v[ 0 ], r.v[ 1 ], r.v[ 2 ] );
+		lights.push_back( l );
+	}
+	return true;
+}
@@ -0,0 +1,91 @@
+#ifndef SCENECACHE_HPP
+#define SCENECACHE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "Scene.hpp"
+#include "Object.hpp"
+
+#define SCENE_CACHE_VERSION 2
+//выравнивание разделов файла, столбцы примитивов начинаются с кэш-линии
+#define SCENE_CACHE_ALIGN 64
+
+//Формат файла: заголовок, затем разделы по смещениям от начала файла, поэтому файл не
+//зависит от адреса отображения. Столбцы примитивов идут в порядке SphereArray::columns(),
+//QuadArray::columns(), BoxArray::columns(), каждый длиной padded( count ) элементов.
+//Порядок байтов и размеры типов - как у машины, записавшей файл
+struct scene_cache_header_t
+{
+    char        magic[ 8 ];
+    uint32_t    version;
+    uint32_t    header_size;
+    uint64_t    file_size;
+    uint32_t    counts[ PRIMITIVE_TYPES ];
+    uint32_t    columns;
+    uint32_t    materials;
+    uint32_t    textures;
+    uint32_t    lights;
+    uint32_t    reserved;
+    uint64_t    columns_offset;
+    uint64_t    materials_offset;
+    uint64_t    textures_offset;
+    uint64_t    lights_offset;
+};
+
+struct scene_cache_material_t
+{
+    float       ambient[ 3 ];
+    float       diffuse[ 3 ];
+    float       specular[ 3 ];
+    //индекс текстуры, -1 без текстуры
+    int32_t     texture;
+    double      beta;
+    double      phong;
+    double      refract_amount;
+    double      refract_coef;
+};
+
+//пиксели текстуры - Color после гамма-декодирования, как в памяти рендерера
+struct scene_cache_texture_t
+{
+    uint64_t    pixels_offset;
+    uint32_t    width;
+    uint32_t    height;
+};
+
+struct scene_cache_light_t
+{
+    uint32_t    type;
+    float       color[ 3 ];
+    float       center[ 3 ];
+    float       radius;
+    float       sphere_radius;
+    float       u[ 3 ];
+    float       v[ 3 ];
+};
+
+//Скомпилированная сцена. write() сохраняет готовые массивы сцены, load() отображает файл
+//в память и подключает их к Scene без разбора и копирования: процессы рендеринга на одной
+//машине делят страницы файла в кэше ОС. Отображение живет, пока жив объект SceneCache
+class SceneCache
+{
+private:
+    void*       m_data;
+    size_t      m_size;
+
+    SceneCache( const SceneCache & );
+    SceneCache & operator=( const SceneCache & );
+public:
+    SceneCache();
+    ~SceneCache();
+
+    static bool write( const std::string & file_name, const Scene & scene, const std::vector< ObjectLight > & lights );
+    //scene должна быть пустой; текстуры материалов ссылаются на память отображения
+    bool load( const std::string & file_name, Scene & scene, std::vector< ObjectLight > & lights );
+    void unload();
+};
+
+#endif // SCENECACHE_HPP
@@ -0,0 +1,103 @@
+#include "Scheduler.hpp"
+
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+
+#include "Trace.hpp"
+
+static double now()
+{
+	timespec tp;
+	clock_gettime( CLOCK_MONOTONIC, &tp );
+	return tp.tv_sec + tp.tv_nsec / 1000000000.0;
+}
+
+Scheduler::Scheduler( size_t threads )
+	: m_stop( false )
+{
+	if ( !threads )
+		threads = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+	for( size_t i = 0; i < threads; i++ )
+		m_threads.push_back( std::thread( &Scheduler::worker, this, i ) );
+}
+
+Scheduler::~Scheduler()
+{
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for( size_t i = 0; i < m_threads.size(); i++ )
+		m_threads[ i ].join();
+}
+
+//новое задание начинает с наименьшего времени заданий своего приоритета: оно не получает
+//долг за время, когда его не было, и не отстает от уже работающих
+void Scheduler::run( SchedulerJob & job, uint32_t priority, float weight )
+{
+	std::unique_lock< std::mutex > lock( m_mutex );
+	job_t entry;
+	entry.job = &job;
+	entry.priority = priority;
+	entry.weight = std::max( weight, 1e-3f );
+	entry.virtual_time = 0.0;
+	entry.running = 0;
+	entry.exhausted = false;
+	bool first = true;
+	for( std::list< job_t >::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it )
+		if ( it->priority == priority && !it->exhausted )
+		{
+			entry.virtual_time = first ? it->virtual_time : std::min( entry.virtual_time, it->virtual_time );
+			first = false;
+		}
+	std::list< job_t >::iterator self = m_jobs.insert( m_jobs.end(), entry );
+	m_wake.notify_all();
+	while( !self->exhausted || self->running )
+		m_done.wait( lock );
+	m_jobs.erase( self );
+}
+
+Scheduler::job_t * Scheduler::pick()
+{
+	job_t * best = NULL;
+	for( std::list< job_t >::iterator it = m_jobs.begin(); it != m_jobs.end(); ++it )
+	{
+		if ( it->exhausted )
+			continue;
+		if ( !best || it->priority > best->priority ||
+			 ( it->priority == best->priority && it->virtual_time < best->virtual_time ) )
+			best = &*it;
+	}
+	return best;
+}
+
+void Scheduler::worker( size_t index )
+{
+	char name[ 32 ];
+	snprintf( name, sizeof( name ), "scheduler %zu", index );
+	trace_thread( 200 + index, name );
+	std::unique_lock< std::mutex > lock( m_mutex );
+	for( ;; )
+	{
+		job_t * job;
+		while( !( job = pick() ) && !m_stop )
+			m_wake.wait( lock );
+		if ( !job )
+			break;
+		job->running++;
+		lock.unlock();
+		double start = now();
+		bool more = job->job->run_next( index );
+		double time = now() - start;
+		lock.lock();
+		job->running--;
+		//время начисляется и за пустой вызов: выбор задания не должен его повторять даром
+		job->virtual_time += time / job->weight;
+		if ( !more )
+			job->exhausted = true;
+		if ( job->exhausted && !job->running )
+			m_done.notify_all();
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+//Задание планировщика: источник единиц работы ( тайлов ). run_next берет одну единицу и
+//выполняет ее на потоке планировщика worker, false - работы больше нет. Вызывается с
+//нескольких потоков одновременно
+class SchedulerJob
+{
+public:
+    virtual ~SchedulerJob() {}
+    virtual bool run_next( size_t worker ) = 0;
+};
+
+//Общий пул потоков для нескольких одновременных рендерингов. После каждой единицы работы
+//поток заново выбирает задание: сначала с наибольшим приоритетом, среди равных - с наименьшим
+//временем работы, деленным на вес ( взвешенное справедливое разделение ). Так задание с высшим
+//приоритетом вытесняет остальные на границе тайла и ждет не дольше одного тайла каждого потока.
+//Низкие приоритеты получают потоки, только когда у высоких нет работы
+class Scheduler
+{
+private:
+    struct job_t
+    {
+        SchedulerJob*   job;
+        uint32_t        priority;
+        double          weight;
+        //время работы потоков на задании, деленное на вес
+        double          virtual_time;
+        //потоков, выполняющих единицы задания
+        size_t          running;
+        //run_next вернул false, новых единиц не выдается
+        bool            exhausted;
+    };
+
+    std::vector< std::thread >  m_threads;
+    std::list< job_t >          m_jobs;
+    std::mutex                  m_mutex;
+    std::condition_variable     m_wake;
+    std::condition_variable     m_done;
+    bool                        m_stop;
+
+    void worker( size_t index );
+    //задание для свободного потока, NULL - все исчерпаны
+    job_t * pick();
+
+    Scheduler( const Scheduler & );
+    Scheduler & operator=( const Scheduler & );
+public:
+    //threads == 0 - по числу процессоров
+    Scheduler( size_t threads = 0 );
+    ~Scheduler();
+
+    //Выполняет задание на потоках пула и возвращает управление, когда оно исчерпано и все
+    //его единицы завершены. Вызывается из потоков владельцев заданий, одновременно
+    void run( SchedulerJob & job, uint32_t priority, float weight );
+
+    size_t size() const
+    {
+        return m_threads.size();
+    }
+};
+
+#endif // SCHEDULER_HPP
@@ -0,0 +1,125 @@
+#include "ShadowCache.hpp"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <algorithm>
+#include <map>
+
+#include "Trace.hpp"
+
+//оси направлений грани куба face: главная ось и две оси плоскости грани
+static void face_axes( size_t face, Vector & major, Vector & u, Vector & v )
+{
+	float sign = face & 1 ? 1.0f : -1.0f;
+	size_t axis = face / 2;
+	float m[ 3 ] = { 0.0f, 0.0f, 0.0f };
+	float a[ 3 ] = { 0.0f, 0.0f, 0.0f };
+	float b[ 3 ] = { 0.0f, 0.0f, 0.0f };
+	m[ axis ] = sign;
+	a[ ( axis + 1 ) % 3 ] = 1.0f;
+	b[ ( axis + 2 ) % 3 ] = 1.0f;
+	major = Vector( m[ 0 ], m[ 1 ], m[ 2 ] );
+	u = Vector( a[ 0 ], a[ 1 ], a[ 2 ] );
+	v = Vector( b[ 0 ], b[ 1 ], b[ 2 ] );
+}
+
+ShadowCache::ShadowCache( size_t resolution )
+	: m_resolution( std::max< size_t >( resolution, 1 ) )
+{
+}
+
+//ячейки немного расширены, чтобы направления на их границах не зависели от округления
+void ShadowCache::build_map( const Scene & scene, const ObjectLight & light, light_map_t & map ) const
+{
+	const float step = 2.0f / m_resolution;
+	const float overlap = step * 0.01f;
+	float margin = light.extent();
+	std::map< std::vector< uint32_t >, uint32_t > known;
+	CandidateSet set;
+	std::vector< uint32_t > key;
+
+	map.center = light.m_center;
+	map.cells.resize( 6 * m_resolution * m_resolution );
+	map.sets.clear();
+	for( size_t face = 0; face < 6; face++ )
+	{
+		Vector major, u, v;
+		face_axes( face, major, u, v );
+		for( size_t j = 0; j < m_resolution; j++ )
+			for( size_t i = 0; i < m_resolution; i++ )
+			{
+				float u0 = -1.0f + i * step - overlap;
+				float u1 = -1.0f + ( i + 1 ) * step + overlap;
+				float v0 = -1.0f + j * step - overlap;
+				float v1 = -1.0f + ( j + 1 ) * step + overlap;
+				Vector corners[ 4 ] = { light.m_center + major + u.scalar( u0 ) + v.scalar( v0 ),
+										light.m_center + major + u.scalar( u1 ) + v.scalar( v0 ),
+										light.m_center + major + u.scalar( u1 ) + v.scalar( v1 ),
+										light.m_center + major + u.scalar( u0 ) + v.scalar( v1 ) };
+				scene.cull( light.m_center, corners, set, margin );
+
+				key.clear();
+				for( size_t t = 0; t < PRIMITIVE_TYPES; t++ )
+				{
+					key.insert( key.end(), set.index[ t ].begin(), set.index[ t ].end() );
+					key.push_back( ~0u );
+				}
+				std::map< std::vector< uint32_t >, uint32_t >::iterator it = known.find( key );
+				if ( it == known.end() )
+				{
+					it = known.insert( std::make_pair( key, ( uint32_t )map.sets.size() ) ).first;
+					map.sets.push_back( set );
+				}
+				map.cells[ ( face * m_resolution + j ) * m_resolution + i ] = it->second;
+			}
+	}
+}
+
+void ShadowCache::build( const Scene & scene, const std::vector< ObjectLight > & lights )
+{
+	m_maps.resize( lights.size() );
+	for( size_t l = 0; l < lights.size(); l++ )
+	{
+		if ( !m_maps[ l ].cells.empty() )
+			continue;
+		TRACE_SCOPE( "shadow cache build" );
+		build_map( scene, lights[ l ], m_maps[ l ] );
+		printf( "Shadow cache of light %zu: %zu cells, %zu distinct occluder sets\n", l, m_maps[ l ].cells.size(),
+				m_maps[ l ].sets.size() );
+	}
+}
+
+void ShadowCache::invalidate( size_t light )
+{
+	if ( light < m_maps.size() )
+	{
+		m_maps[ light ].cells.clear();
+		m_maps[ light ].sets.clear();
+	}
+}
+
+void ShadowCache::clear()
+{
+	m_maps.clear();
+}
+
+const CandidateSet * ShadowCache::lookup( size_t light, const Vector & point ) const
+{
+	if ( light >= m_maps.size() || m_maps[ light ].cells.empty() )
+		return NULL;
+	const light_map_t & map = m_maps[ light ];
+	float d[ 3 ] = { point.x - map.center.x, point.y - map.center.y, point.z - map.center.z };
+	size_t axis = 0;
+	for( size_t k = 1; k < 3; k++ )
+		if ( fabsf( d[ k ] ) > fabsf( d[ axis ] ) )
+			axis = k;
+	float major = fabsf( d[ axis ] );
+	if ( !( major > 0.0f ) )
+		return NULL;
+	size_t face = axis * 2 + ( d[ axis ] > 0.0f ? 1 : 0 );
+	float scale = 0.5f * m_resolution / major;
+	size_t i = std::min< size_t >( std::max( ( d[ ( axis + 1 ) % 3 ] + major ) * scale, 0.0f ), m_resolution - 1 );
+	size_t j = std::min< size_t >( std::max( ( d[ ( axis + 2 ) % 3 ] + major ) * scale, 0.0f ), m_resolution - 1 );
+	return &map.sets[ map.cells[ ( face * m_resolution + j ) * m_resolution + i ] ];
+}
@@ -0,0 +1,45 @@
+#ifndef SHADOWCACHE_HPP
+#define SHADOWCACHE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "Scene.hpp"
+#include "Object.hpp"
+
+//Кэш теневых запросов. Для каждого источника строится кубическая карта направлений из его
+//центра: в ячейке - набор примитивов, которые могут пересечь отрезок от любой точки в
+//направлениях ячейки до любой точки источника ( пирамида ячейки, расширенная на размер
+//источника ). Теневой луч проверяется только с набором своей ячейки, ответ тот же, что со
+//всей сценой. Одинаковые наборы соседних ячеек хранятся один раз
+class ShadowCache
+{
+private:
+    struct light_map_t
+    {
+        //номер набора для каждой ячейки, 6 граней по resolution x resolution; пусто - карты нет
+        std::vector< uint32_t >     cells;
+        std::vector< CandidateSet > sets;
+        Vector                      center;
+    };
+
+    size_t                      m_resolution;
+    std::vector< light_map_t >  m_maps;
+
+    void build_map( const Scene & scene, const ObjectLight & light, light_map_t & map ) const;
+public:
+    //resolution - ячеек по стороне грани куба
+    ShadowCache( size_t resolution );
+
+    //строит карты источников, у которых их нет, например после invalidate()
+    void build( const Scene & scene, const std::vector< ObjectLight > & lights );
+    //источник сдвинут или изменен его размер
+    void invalidate( size_t light );
+    void clear();
+
+    //примитивы, которые может пересечь теневой луч из point к источнику light, NULL - карты нет
+    const CandidateSet * lookup( size_t light, const Vector & point ) const;
+};
+
+#endif // SHADOWCACHE_HPP
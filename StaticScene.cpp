@@ -0,0 +1,156 @@
+#include "StaticScene.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <algorithm>
+
+static size_t padded( size_t count )
+{
+	return std::max< size_t >( ( count + 3 ) & ~( size_t )3, 4 );
+}
+
+//литерал, который читается обратно в то же число: 9 значащих цифр для float, 17 для double
+static std::string literal( double value, bool single )
+{
+	char buffer[ 64 ];
+	snprintf( buffer, sizeof( buffer ), single ? "%.9g" : "%.17g", value );
+	std::string s = buffer;
+	if ( s.find_first_of( ".e" ) == std::string::npos )
+		s += ".0";
+	if ( single )
+		s += "f";
+	return s;
+}
+
+static std::string literal( const char * text )
+{
+	std::string s = "\"";
+	for( ; *text; text++ )
+	{
+		if ( *text == '"' || *text == '\\' )
+			s += '\\';
+		s += *text;
+	}
+	return s + "\"";
+}
+
+static void write_floats( FILE * f, const float * values, size_t count )
+{
+	fprintf( f, "{ " );
+	for( size_t i = 0; i < count; i++ )
+		fprintf( f, "%s%s", i ? ", " : "", literal( values[ i ], true ).c_str() );
+	fprintf( f, " }" );
+}
+
+struct header_column_writer_t
+{
+	FILE *  f;
+	size_t  count;
+
+	header_column_writer_t( FILE * f_, size_t count_ )
+		: f( f_ ), count( count_ )
+	{}
+
+	void operator()( const SoaColumn< float > & column )
+	{
+		fprintf( f, ",\n        { " );
+		for( size_t i = 0; i < padded( count ); i++ )
+			fprintf( f, "%s%s", i ? ", " : "", literal( i < count ? column[ i ] : 0.0f, true ).c_str() );
+		fprintf( f, " }" );
+	}
+	void operator()( const SoaColumn< uint32_t > & column )
+	{
+		fprintf( f, ",\n        { " );
+		for( size_t i = 0; i < padded( count ); i++ )
+			fprintf( f, "%s%uu", i ? ", " : "", i < count ? column[ i ] : 0u );
+		fprintf( f, " }" );
+	}
+};
+
+template< class A >
+static void write_array( FILE * f, const char * type, const char * name, const A & a )
+{
+	fprintf( f, "    static constexpr %s< %zu > %s =\n    {\n        %zu", type, padded( a.count ), name, a.count );
+	header_column_writer_t writer( f, a.count );
+	A::columns( a, writer );
+	fprintf( f, "\n    };\n" );
+}
+
+bool StaticScene::write( const std::string & file_name, const std::string & name, const Scene & scene,
+						 const std::vector< ObjectLight > & lights )
+{
+	FILE * f = fopen( file_name.c_str(), "w" );
+	if ( !f )
+		return false;
+
+	std::string guard = "STATIC_SCENE_" + name + "_HPP";
+	std::transform( guard.begin(), guard.end(), guard.begin(), ::toupper );
+	fprintf( f, "//статическая сцена, сгенерирована raytracer --compile-scene-header, не редактировать\n" );
+	fprintf( f, "#ifndef %s\n#define %s\n\n#include \"StaticScene.hpp\"\n\n", guard.c_str(), guard.c_str() );
+	fprintf( f, "struct %s\n{\n", name.c_str() );
+	write_array( f, "static_sphere_array_t", "spheres", scene.m_spheres );
+	write_array( f, "static_quad_array_t", "quads", scene.m_quads );
+	write_array( f, "static_box_array_t", "boxes", scene.m_boxes );
+
+	//массивы нулевой длины недопустимы, пустой список получает один неиспользуемый элемент
+	size_t materials = scene.m_materials.size();
+	fprintf( f, "    static constexpr size_t materials_count = %zu;\n", materials );
+	fprintf( f, "    static constexpr static_material_t materials[ %zu ] =\n    {\n", std::max< size_t >( materials, 1 ) );
+	for( size_t i = 0; i < materials; i++ )
+	{
+		const Material & m = scene.m_materials[ i ];
+		float colors[ 3 ][ 3 ] = { { m.m_ambient.r, m.m_ambient.g, m.m_ambient.b },
+								   { m.m_diffuse.r, m.m_diffuse.g, m.m_diffuse.b },
+								   { m.m_specular.r, m.m_specular.g, m.m_specular.b } };
+		//текстура поверх чужих пикселей ( кэш сцены ) не знает своего файла и теряется
+		const char * texture = m.m_texture ? m.m_texture->file_name().c_str() : "";
+		if ( m.m_texture && !*texture )
+			fprintf( stderr, "%s: texture of material %zu has no file name, dropped\n", file_name.c_str(), i );
+		fprintf( f, "        { " );
+		for( size_t k = 0; k < 3; k++ )
+		{
+			write_floats( f, colors[ k ], 3 );
+			fprintf( f, ", " );
+		}
+		fprintf( f, "%s, %s, %s, %s, %s }%s\n", literal( m.m_beta, false ).c_str(), literal( m.m_phong, false ).c_str(),
+				 literal( m.m_refract_amount, false ).c_str(), literal( m.m_refract_coef, false ).c_str(),
+				 literal( texture ).c_str(), i + 1 < materials ? "," : "" );
+	}
+	if ( !materials )
+		fprintf( f, "        {}\n" );
+	fprintf( f, "    };\n" );
+
+	fprintf( f, "    static constexpr size_t lights_count = %zu;\n", lights.size() );
+	fprintf( f, "    static constexpr static_light_t lights[ %zu ] =\n    {\n", std::max< size_t >( lights.size(), 1 ) );
+	for( size_t i = 0; i < lights.size(); i++ )
+	{
+		const ObjectLight & l = lights[ i ];
+		float color[ 3 ] = { l.m_color.r, l.m_color.g, l.m_color.b };
+		float center[ 3 ] = { l.m_center.x, l.m_center.y, l.m_center.z };
+		float u[ 3 ] = { l.m_u.x, l.m_u.y, l.m_u.z };
+		float v[ 3 ] = { l.m_v.x, l.m_v.y, l.m_v.z };
+		fprintf( f, "        { %uu, ", ( uint32_t )l.m_type );
+		write_floats( f, color, 3 );
+		fprintf( f, ", " );
+		write_floats( f, center, 3 );
+		fprintf( f, ", %s, %s, ", literal( l.m_radius, true ).c_str(), literal( l.m_sphere_radius, true ).c_str() );
+		write_floats( f, u, 3 );
+		fprintf( f, ", " );
+		write_floats( f, v, 3 );
+		fprintf( f, " }%s\n", i + 1 < lights.size() ? "," : "" );
+	}
+	if ( lights.empty() )
+		fprintf( f, "        {}\n" );
+	fprintf( f, "    };\n};\n\n" );
+
+	//определения constexpr членов вне класса нужны C++11 для взятия адреса
+	fprintf( f, "constexpr static_sphere_array_t< %zu > %s::spheres;\n", padded( scene.m_spheres.count ), name.c_str() );
+	fprintf( f, "constexpr static_quad_array_t< %zu > %s::quads;\n", padded( scene.m_quads.count ), name.c_str() );
+	fprintf( f, "constexpr static_box_array_t< %zu > %s::boxes;\n", padded( scene.m_boxes.count ), name.c_str() );
+	fprintf( f, "constexpr static_material_t %s::materials[ %zu ];\n", name.c_str(), std::max< size_t >( materials, 1 ) );
+	fprintf( f, "constexpr static_light_t %s::lights[ %zu ];\n\n", name.c_str(), std::max< size_t >( lights.size(), 1 ) );
+	fprintf( f, "typedef %s static_scene_t;\n\n#endif // %s\n", name.c_str(), guard.c_str() );
+	return fclose( f ) == 0;
+}
@@ -0,0 +1,115 @@
+#ifndef STATICSCENE_HPP
+#define STATICSCENE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "Scene.hpp"
+#include "Object.hpp"
+
+//Константные массивы сцены, вкомпилированной в программу. Столбцы названы и перечислены
+//в columns() так же, как в SphereArray, QuadArray и BoxArray, N - длина, выровненная до
+//кратной 4 ( не меньше 4 ), хвост заполнен нулями
+template< size_t N >
+struct static_sphere_array_t
+{
+    size_t      count;
+    float       cx[ N ], cy[ N ], cz[ N ];
+    float       r2[ N ];
+    uint32_t    material[ N ];
+
+    template< class A, class F >
+    static void columns( A & a, F & f )
+    {
+        f( a.cx ); f( a.cy ); f( a.cz );
+        f( a.r2 );
+        f( a.material );
+    }
+};
+
+template< size_t N >
+struct static_quad_array_t
+{
+    size_t      count;
+    float       nx[ N ], ny[ N ], nz[ N ], d[ N ];
+    float       cx[ N ], cy[ N ], cz[ N ];
+    float       ux[ N ], uy[ N ], uz[ N ];
+    float       vx[ N ], vy[ N ], vz[ N ];
+    float       hw[ N ], hh[ N ];
+    uint32_t    material[ N ];
+
+    template< class A, class F >
+    static void columns( A & a, F & f )
+    {
+        f( a.nx ); f( a.ny ); f( a.nz ); f( a.d );
+        f( a.cx ); f( a.cy ); f( a.cz );
+        f( a.ux ); f( a.uy ); f( a.uz );
+        f( a.vx ); f( a.vy ); f( a.vz );
+        f( a.hw ); f( a.hh );
+        f( a.material );
+    }
+};
+
+template< size_t N >
+struct static_box_array_t
+{
+    size_t      count;
+    float       cx[ N ], cy[ N ], cz[ N ];
+    float       a0x[ N ], a0y[ N ], a0z[ N ];
+    float       a1x[ N ], a1y[ N ], a1z[ N ];
+    float       a2x[ N ], a2y[ N ], a2z[ N ];
+    float       h0[ N ], h1[ N ], h2[ N ];
+    uint32_t    material[ N ];
+
+    template< class A, class F >
+    static void columns( A & a, F & f )
+    {
+        f( a.cx ); f( a.cy ); f( a.cz );
+        f( a.a0x ); f( a.a0y ); f( a.a0z );
+        f( a.a1x ); f( a.a1y ); f( a.a1z );
+        f( a.a2x ); f( a.a2y ); f( a.a2z );
+        f( a.h0 ); f( a.h1 ); f( a.h2 );
+        f( a.material );
+    }
+};
+
+//texture - имя PNG, "" без текстуры; пиксели читаются при запуске
+struct static_material_t
+{
+    float       ambient[ 3 ];
+    float       diffuse[ 3 ];
+    float       specular[ 3 ];
+    double      beta;
+    double      phong;
+    double      refract_amount;
+    double      refract_coef;
+    const char* texture;
+};
+
+struct static_light_t
+{
+    uint32_t    type;
+    float       color[ 3 ];
+    float       center[ 3 ];
+    float       radius;
+    float       sphere_radius;
+    float       u[ 3 ];
+    float       v[ 3 ];
+};
+
+//Генератор заголовка статической сцены. Заголовок объявляет структуру с constexpr массивами
+//примитивов, материалов и источников и typedef static_scene_t на нее. Программа, собранная
+//с -DSTATIC_SCENE="file.hpp", подключает массивы к Scene без построения сцены, а ядра
+//пересечения Scene инстанцируются на них с длинами циклов, известными при компиляции.
+//Заголовок подключается только в Scene.cpp
+class StaticScene
+{
+public:
+    //name - имя структуры в заголовке, C++ идентификатор
+    static bool write( const std::string & file_name, const std::string & name, const Scene & scene,
+                       const std::vector< ObjectLight > & lights );
+};
+
+#endif // STATICSCENE_HPP
@@ -1,9 +1,23 @@
 #include "Texture.hpp"
+#include "Trace.hpp"
 
 #include <png.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <sys/stat.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+
+#include "ThreadPool.hpp"
+
+//наибольшая сторона читаемого PFM
+#define PFM_MAX_SIZE 0x7FFFFFFFull
 
 void PNGAPI error_function( png_structp png, png_const_charp dummy )
 {
@@ -12,8 +26,9 @@ void PNGAPI error_function( png_structp png, png_const_charp dummy )
 }
 
 
-int read_png( const std::string& file_name, image_t& image, float gamma )
+int read_png_rgb( const std::string& file_name, std::vector< uint8_t >& pixels, uint32_t& out_width, uint32_t& out_height )
 {
+	TRACE_SCOPE( "texture decode" );
 	png_structp png;
 	png_infop info;
 	int color_type, bit_depth, interlaced;
@@ -22,7 +37,7 @@ int read_png( const std::string& file_name, image_t& image, float gamma )
 	int p;
 	int ok = 0;
 	png_uint_32 width, height, y;
-	int stride;
+	size_t stride;
 	uint8_t* rgb = NULL;
 
 	FILE * fp;
@@ -76,7 +91,7 @@ int read_png( const std::string& file_name, image_t& image, float gamma )
 
 	num_passes = png_set_interlace_handling( png );
 	png_read_update_info( png, info );
-	stride = ( has_alpha ? 4 : 3 ) * width * sizeof( *rgb );
+	stride = sizeof( *rgb ) * ( has_alpha ? 4 : 3 ) * width;
 	rgb = ( uint8_t* )malloc( stride * height );
 	if( rgb == NULL )
 		goto Error;
@@ -91,25 +106,17 @@ int read_png( const std::string& file_name, image_t& image, float gamma )
 	png_read_end( png, info );
 	png_destroy_read_struct( &png, &info, NULL );
 
-	image.width = width;
-	image.height = height;
-	image.image = new Color[height * width];
+	out_width = width;
+	out_height = height;
+	pixels.resize( ( size_t )width * height * 3 );
 	for( size_t y = 0; y < height; y++ )
 		for( size_t x = 0; x < width; x++ )
 		{
 			size_t i = y * width + x;
-			if ( has_alpha )
-			{
-				image.image[i].r = pow( rgb[stride * y + x * 4 + 1] / 255.0f, gamma  );
-				image.image[i].g = pow( rgb[stride * y + x * 4 + 2] / 255.0f, gamma  );
-				image.image[i].b = pow( rgb[stride * y + x * 4 + 3] / 255.0f, gamma  );
-			}
-			else
-			{
-				image.image[i].r = pow( rgb[stride * y + x * 3] / 255.0f, gamma  );
-				image.image[i].g = pow( rgb[stride * y + x * 3 + 1] / 255.0f, gamma  );
-				image.image[i].b = pow( rgb[stride * y + x * 3 + 2] / 255.0f, gamma  );
-			}
+			const uint8_t * src = rgb + stride * y + x * ( has_alpha ? 4 : 3 ) + ( has_alpha ? 1 : 0 );
+			pixels[ i * 3 ] = src[ 0 ];
+			pixels[ i * 3 + 1 ] = src[ 1 ];
+			pixels[ i * 3 + 2 ] = src[ 2 ];
 		}
 	free( rgb );
 
@@ -118,97 +125,373 @@ int read_png( const std::string& file_name, image_t& image, float gamma )
 		return ok;
 }
 
- int save_png( const std::string & file_name, const image_t & image, float gamma )
- {
-	 	int i =0;
- 		uint8_t* rgb = new uint8_t[ image.height * image.width * 3 ];
- 		float deGamma = 1.0f / gamma;
- 		for( size_t y = 0; y < image.height; y++ )
- 			for( size_t x = 0; x < image.width; x++ )
- 			{
- 				size_t j = y * image.width + x;
- 				image.image[ j ].saturate();
- 				rgb[i++] = pow( image.image[j].r, deGamma ) * 255.0f;
- 				rgb[i++] = pow( image.image[j].g, deGamma ) * 255.0f;
- 				rgb[i++] = pow( image.image[j].b, deGamma ) * 255.0f;
- 			}
-
- 		png_structp png;
- 		png_infop info;
- 		png_uint_32 y;
-
- 		png = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
- 		if( png == NULL )
- 			return -1;
-
- 		info = png_create_info_struct( png );
- 		if( info == NULL )
- 		{
- 			png_destroy_write_struct( &png, NULL );
- 			return -1;
- 		}
-
- 		if( setjmp( png_jmpbuf( png ) ) )
- 		{
- 			png_destroy_write_struct( &png, &info );
- 			return -1;
- 		}
- 		FILE * fp = NULL;
-
- 		fp = fopen( file_name.c_str(  ), "wb" );
- 		if( fp == NULL )
- 		{
- 			png_destroy_write_struct( &png, &info );
- 			return -1;
- 		}
- 		png_init_io( png, fp );
- 		png_set_IHDR( png, info, image.width, image.height, 8,
- 			   PNG_COLOR_TYPE_RGB,
- 			   PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
- 			   PNG_FILTER_TYPE_DEFAULT );
- 		png_write_info( png, info );
- 		for ( y = 0; y < image.height; ++y )
- 		{
- 			png_bytep row = rgb + y * image.width * 3;
- 			png_write_rows( png, &row, 1 );
- 		}
- 		png_write_end( png, info );
- 		png_destroy_write_struct( &png, &info );
- 		fclose( fp );
- 		return 0;
- }
+int read_png( const std::string& file_name, image_t& image, float gamma )
+{
+	std::vector< uint8_t > rgb;
+	uint32_t width, height;
+	int ret = read_png_rgb( file_name, rgb, width, height );
+	if ( ret || rgb.empty() )
+		return ret;
+
+	image.width = width;
+	image.height = height;
+	image.image = new Color[ ( size_t )height * width ];
+	//каналы декодируются независимо, таблица на 256 значений дает те же числа, что pow на каждый тексель
+	float decode[ 256 ];
+	for( int i = 0; i < 256; i++ )
+		decode[ i ] = ( Color( i / 255.0f ) ^ gamma ).r;
+	for( size_t i = 0; i < ( size_t )width * height; i++ )
+	{
+		const uint8_t * src = &rgb[ i * 3 ];
+		image.image[i] = Color( decode[ src[0] ], decode[ src[1] ], decode[ src[2] ] );
+	}
+	return 0;
+}
+
+int save_png_rgb( const std::string & file_name, const uint8_t * rgb, uint64_t width, uint64_t height )
+{
+	TRACE_SCOPE( "png encode" );
+	PngWriter writer;
+	//open() отказывает сторонам больше PNG_UINT_31_MAX, дальше высота помещается в uint32_t
+	if ( writer.open( file_name, width, height ) )
+		return -1;
+	writer.write_rows( rgb, ( uint32_t )height );
+	return writer.close();
+}
+
+PngWriter::PngWriter()
+	: m_png( NULL ), m_info( NULL ), m_file( NULL ), m_width( 0 ), m_height( 0 ), m_rows( 0 ), m_failed( false )
+{
+}
+
+PngWriter::~PngWriter()
+{
+	destroy();
+}
+
+void PngWriter::destroy()
+{
+	if ( m_png )
+	{
+		png_structp png = ( png_structp )m_png;
+		png_infop info = ( png_infop )m_info;
+		png_destroy_write_struct( &png, m_info ? &info : NULL );
+	}
+	if ( m_file )
+		fclose( m_file );
+	m_png = NULL;
+	m_info = NULL;
+	m_file = NULL;
+}
+
+int PngWriter::open( const std::string & file_name, uint64_t width, uint64_t height )
+{
+	destroy();
+	m_failed = true;
+	m_rows = 0;
+	if ( !width || !height || width > PNG_UINT_31_MAX || height > PNG_UINT_31_MAX )
+		return -1;
+	m_width = width;
+	m_height = height;
+
+	png_structp png = png_create_write_struct( PNG_LIBPNG_VER_STRING, NULL, NULL, NULL );
+	if( png == NULL )
+		return -1;
+	m_png = png;
+	png_infop info = png_create_info_struct( png );
+	if( info == NULL )
+	{
+		destroy();
+		return -1;
+	}
+	m_info = info;
+
+	m_file = fopen( file_name.c_str(  ), "wb" );
+	if( m_file == NULL )
+	{
+		destroy();
+		return -1;
+	}
+	if( setjmp( png_jmpbuf( png ) ) )
+	{
+		destroy();
+		return -1;
+	}
+	png_init_io( png, m_file );
+	png_set_IHDR( png, info, m_width, m_height, 8,
+		   PNG_COLOR_TYPE_RGB,
+		   PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		   PNG_FILTER_TYPE_DEFAULT );
+	png_write_info( png, info );
+	m_failed = false;
+	return 0;
+}
+
+int PngWriter::write_rows( const uint8_t * rgb, uint32_t rows )
+{
+	if ( m_failed || m_rows + ( uint64_t )rows > m_height )
+	{
+		m_failed = true;
+		return -1;
+	}
+	png_structp png = ( png_structp )m_png;
+	if( setjmp( png_jmpbuf( png ) ) )
+	{
+		m_failed = true;
+		destroy();
+		return -1;
+	}
+	for ( uint32_t y = 0; y < rows; ++y )
+	{
+		png_bytep row = ( png_bytep )rgb + ( size_t )y * m_width * 3;
+		png_write_rows( png, &row, 1 );
+	}
+	m_rows += rows;
+	return 0;
+}
+
+int PngWriter::close()
+{
+	if ( !m_failed && m_png && m_rows == m_height )
+	{
+		png_structp png = ( png_structp )m_png;
+		if( setjmp( png_jmpbuf( png ) ) )
+			m_failed = true;
+		else
+			png_write_end( png, ( png_infop )m_info );
+	}
+	//результат считается после setjmp: локальная переменная, измененная после него, не переживает longjmp
+	bool ok = !m_failed && m_png && m_rows == m_height;
+	if ( ok && m_file )
+	{
+		ok = fclose( m_file ) == 0;
+		m_file = NULL;
+	}
+	destroy();
+	m_failed = false;
+	return ok ? 0 : -1;
+}
+
+//PFM: текстовый заголовок "PF\n<ширина> <высота>\n-1.0\n" ( отрицательный масштаб - little endian ),
+//затем строки снизу вверх по три float на пиксель
+int save_pfm( const std::string & file_name, const image_t & image )
+{
+	FILE * f = fopen( file_name.c_str(), "wb" );
+	if ( !f )
+		return -1;
+	fprintf( f, "PF\n%llu %llu\n-1.0\n", ( unsigned long long )image.width, ( unsigned long long )image.height );
+	std::vector< float > row( image.width * 3 );
+	for( size_t y = image.height; y-- > 0; )
+	{
+		for( size_t x = 0; x < image.width; x++ )
+		{
+			const Color & c = image.image[ y * image.width + x ];
+			row[ x * 3 + 0 ] = c.r;
+			row[ x * 3 + 1 ] = c.g;
+			row[ x * 3 + 2 ] = c.b;
+		}
+		if ( fwrite( &row[ 0 ], sizeof( float ), row.size(), f ) != row.size() )
+		{
+			fclose( f );
+			return -1;
+		}
+	}
+	return fclose( f ) == 0 ? 0 : -1;
+}
+
+int read_pfm( const std::string & file_name, image_t & image )
+{
+	FILE * f = fopen( file_name.c_str(), "rb" );
+	if ( !f )
+		return -1;
+	char magic[ 3 ] = { 0 };
+	unsigned long long width, height;
+	float scale;
+	if ( fscanf( f, "%2s %llu %llu %f", magic, &width, &height, &scale ) != 4 || strcmp( magic, "PF" ) ||
+		 scale >= 0.0f || !width || !height || width > PFM_MAX_SIZE || height > PFM_MAX_SIZE || fgetc( f ) == EOF )
+	{
+		fclose( f );
+		return -1;
+	}
+	std::vector< float > row( width * 3 );
+	Color * pixels = new Color[ width * height ];
+	for( size_t y = height; y-- > 0; )
+	{
+		if ( fread( &row[ 0 ], sizeof( float ), row.size(), f ) != row.size() )
+		{
+			delete[] pixels;
+			fclose( f );
+			return -1;
+		}
+		for( size_t x = 0; x < width; x++ )
+			pixels[ y * width + x ] = Color( row[ x * 3 + 0 ], row[ x * 3 + 1 ], row[ x * 3 + 2 ] );
+	}
+	fclose( f );
+	if ( image.image )
+		delete[] image.image;
+	image.image = pixels;
+	image.width = width;
+	image.height = height;
+	return 0;
+}
 
 float g_gamma = 2.2f;
+static std::mutex g_texture_mutex;
+static std::condition_variable g_texture_loaded;
+//пул декодирования текстур, NULL до InitTextureSystem - тогда текстуры читаются в конструкторе.
+//Объявлен после g_texture_mutex и g_texture_loaded: при выходе он разрушается первым и
+//дожидается потоков, которые еще могут их использовать
+static std::unique_ptr< ThreadPool > g_texture_pool;
 
 void InitTextureSystem( float gamma )
 {
 	g_gamma = gamma;
+	if ( !g_texture_pool )
+		g_texture_pool.reset( new ThreadPool() );
 }
 
 Texture::Texture()
+    : m_pixels( NULL ), m_width( 0 ), m_height( 0 ), m_ready( true )
+{
+
+}
+
+//файл тайлов строится заново, если его нет или PNG новее; пишется во временный файл и
+//переименовывается, чтобы параллельно запущенный процесс не прочитал его недописанным
+static std::shared_ptr< TiledImage > open_tiled( const std::string & file_name )
 {
+    std::string tiles_name = file_name + ".tiles";
+    struct stat source, tiles;
+    bool source_exists = stat( file_name.c_str(), &source ) == 0;
+    if ( stat( tiles_name.c_str(), &tiles ) == 0 && ( !source_exists || tiles.st_mtime >= source.st_mtime ) )
+    {
+        std::shared_ptr< TiledImage > image = TiledImage::open( tiles_name );
+        if ( image )
+            return image;
+    }
+    if ( !source_exists )
+        return std::shared_ptr< TiledImage >();
 
+    std::vector< uint8_t > rgb;
+    uint32_t width, height;
+    if ( read_png_rgb( file_name, rgb, width, height ) || rgb.empty() )
+        return std::shared_ptr< TiledImage >();
+    //текстуры с одним файлом могут строиться параллельно в пуле, у каждой свой временный файл
+    static std::atomic< uint32_t > s_temp_id( 0 );
+    std::string temp_name = tiles_name + ".tmp" + std::to_string( getpid() ) + "." + std::to_string( s_temp_id++ );
+    if ( !TiledImage::write( temp_name, rgb.data(), width, height ) || rename( temp_name.c_str(), tiles_name.c_str() ) )
+    {
+        remove( temp_name.c_str() );
+        return std::shared_ptr< TiledImage >();
+    }
+    printf( "Texture %s converted to %s\n", file_name.c_str(), tiles_name.c_str() );
+    return TiledImage::open( tiles_name );
 }
 
 Texture::Texture( const std::string& filename )
+    : m_pixels( NULL ), m_width( 0 ), m_height( 0 ), m_file_name( filename ), m_ready( false )
 {
-    read_png( filename, m_image, g_gamma );
+    if ( g_texture_pool )
+        g_texture_pool->submit( std::bind( &Texture::load, this ) );
+    else
+        load();
 }
 
-Texture::~Texture()
+void Texture::load()
+{
+    TRACE_SCOPE( "texture load" );
+    if ( texture_cache_enabled() )
+        m_tiles = open_tiled( m_file_name );
+    if ( m_tiles )
+    {
+        m_width = m_tiles->width();
+        m_height = m_tiles->height();
+    }
+    else
+    {
+        read_png( m_file_name, m_image, g_gamma );
+        m_pixels = m_image.image;
+        m_width = m_image.width;
+        m_height = m_image.height;
+    }
+    {
+        std::lock_guard< std::mutex > lock( g_texture_mutex );
+        m_ready.store( true, std::memory_order_release );
+    }
+    g_texture_loaded.notify_all();
+}
+
+void Texture::wait_slow() const
 {
+    TRACE_SCOPE( "texture wait" );
+    std::unique_lock< std::mutex > lock( g_texture_mutex );
+    while( !m_ready.load( std::memory_order_acquire ) )
+        g_texture_loaded.wait( lock );
+}
+
+Texture::Texture( const Texture & other )
+    : m_pixels( NULL ), m_width( 0 ), m_height( 0 ), m_ready( true )
+{
+    other.wait();
+    m_width = other.m_width;
+    m_height = other.m_height;
+    m_tiles = other.m_tiles;
+    m_file_name = other.m_file_name;
+    if ( !other.m_pixels )
+        return;
+    m_image.width = m_width;
+    m_image.height = m_height;
+    m_image.image = new Color[ ( size_t )m_width * m_height ];
+    std::copy( other.m_pixels, other.m_pixels + ( size_t )m_width * m_height, m_image.image );
+    m_pixels = m_image.image;
+}
+
+Texture::Texture( const Color * pixels, uint32_t width, uint32_t height )
+    : m_pixels( pixels ), m_width( width ), m_height( height ), m_ready( true )
+{
+
+}
 
+//задание пула пишет в объект, удалять его можно только после загрузки
+Texture::~Texture()
+{
+    wait();
 }
 
-Color Texture::pixel( const float& x, const float& y )
+Color Texture::pixel( const float& x, const float& y, uint32_t level ) const
 {
-    if( !m_image.image )
+    wait();
+    if ( m_tiles )
+    {
+        level = std::min( level, m_tiles->levels() - 1 );
+        uint32_t width = m_tiles->width( level );
+        uint32_t height = m_tiles->height( level );
+        uint32_t xx = x * width;
+        uint32_t yy = y * height;
+        xx = xx == width ? width - 1 : xx;
+        yy = yy == height ? height - 1 : yy;
+        return m_tiles->texel( level, xx, yy );
+    }
+
+    if( !m_pixels )
         return Color( 1.0f, 1.0f, 1.0f );
 
-    size_t xx = x * m_image.width;
-    size_t yy = y * m_image.height;
-    xx = xx == m_image.width ? m_image.width - 1 : xx;
-    yy = yy == m_image.height ? m_image.height - 1 : yy;
-    return m_image.image[ xx + yy * m_image.width ];
+    size_t xx = x * m_width;
+    size_t yy = y * m_height;
+    xx = xx == m_width ? m_width - 1 : xx;
+    yy = yy == m_height ? m_height - 1 : yy;
+    return m_pixels[ xx + yy * m_width ];
+}
+
+bool Texture::copy_pixels( std::vector< Color > & pixels ) const
+{
+    wait();
+    if ( !m_pixels && !m_tiles )
+        return false;
+    pixels.resize( ( size_t )m_width * m_height );
+    for( uint32_t y = 0; y < m_height; y++ )
+        for( uint32_t x = 0; x < m_width; x++ )
+            pixels[ ( size_t )y * m_width + x ] = m_tiles ? m_tiles->texel( 0, x, y ) : m_pixels[ ( size_t )y * m_width + x ];
+    return true;
 }
 
@@ -2,14 +2,19 @@
 #define TEXTURE_HPP
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
 #include <stdint.h>
+#include <stdio.h>
 #include "Color.hpp"
+#include "TextureCache.hpp"
 
 struct image_t
 {
     Color* 		image;
-    uint16_t 	width;
-    uint16_t 	height;
+    uint64_t 	width;
+    uint64_t 	height;
 
     image_t()
     	: image( NULL ), width( 0 ), height( 0 )
@@ -25,22 +30,113 @@ struct image_t
 };
 
 int read_png( const std::string & file_name, image_t & image, float gamma );
-int save_png( const std::string & file_name, const image_t & image, float gamma );
+//байты RGB без гамма-декодирования, по три на пиксель
+int read_png_rgb( const std::string & file_name, std::vector< uint8_t > & rgb, uint32_t & width, uint32_t & height );
+//готовые байты RGB, по три на пиксель
+int save_png_rgb( const std::string & file_name, const uint8_t * rgb, uint64_t width, uint64_t height );
+
+//Запись PNG по строкам: изображение не обязано целиком лежать в памяти, строки подаются
+//полосами сверху вниз. После ошибки следующие вызовы ничего не делают, close() возвращает -1
+class PngWriter
+{
+private:
+    void*       m_png;
+    void*       m_info;
+    FILE*       m_file;
+    uint32_t    m_width;
+    uint32_t    m_height;
+    uint32_t    m_rows;
+    bool        m_failed;
+
+    void destroy();
+
+    PngWriter( const PngWriter & );
+    PngWriter & operator=( const PngWriter & );
+public:
+    PngWriter();
+    ~PngWriter();
+
+    //ширина и высота PNG не больше 2^31 - 1
+    int open( const std::string & file_name, uint64_t width, uint64_t height );
+    //rows строк по width * 3 байт RGB
+    int write_rows( const uint8_t * rgb, uint32_t rows );
+    //-1, если записаны не все строки или была ошибка
+    int close();
+};
+//линейное изображение без потерь для повторной постобработки
+int save_pfm( const std::string & file_name, const image_t & image );
+int read_pfm( const std::string & file_name, image_t & image );
 uint8_t* ALPHA( const uint32_t & argb );
 uint8_t* RED( const uint32_t & argb );
 uint8_t* GREEN( const uint32_t & argb );
 uint8_t* BLUE( const uint32_t & argb );
+//запускает пул потоков, в котором декодируются текстуры, созданные по имени файла
 void InitTextureSystem( float gamma );
 
 class Texture
 {
 private:
-    image_t m_image;
+    image_t         m_image;
+    //пиксели m_image или внешняя память, которой текстура не владеет
+    const Color*    m_pixels;
+    uint32_t        m_width;
+    uint32_t        m_height;
+    //файл тайлов, если включен кэш текстур; тогда m_pixels пуст
+    std::shared_ptr< TiledImage > m_tiles;
+    //PNG, из которого прочитана текстура, пустое у текстур поверх чужих пикселей
+    std::string     m_file_name;
+    //false, пока файл декодируется в пуле потоков; до этого поля выше не читаются
+    std::atomic< bool > m_ready;
+
+    void load();
+    //блокирует вызывающий поток до окончания загрузки
+    void wait_slow() const;
+    void wait() const
+    {
+        if ( !m_ready.load( std::memory_order_acquire ) )
+            wait_slow();
+    }
 public:
     Texture();
+    //файл читается асинхронно в пуле потоков ( InitTextureSystem ), конструктор не ждет;
+    //первое обращение к пикселям или размерам ждет окончания загрузки.
+    //С кэшем текстур PNG один раз переводится в файл тайлов рядом с ним ( filename.tiles ),
+    //дальше читаются только нужные тайлы
     Texture( const std::string& filename );
+    //копия изображения в памяти, выделенной вызывающим потоком
+    Texture( const Texture & other );
+    //текстура поверх чужих пикселей, например кэша сцены, отображенного в память
+    Texture( const Color * pixels, uint32_t width, uint32_t height );
     ~Texture();
-    Color pixel( const float& x, const float& y );
+    //level - уровень mip-пирамиды, у текстур без файла тайлов есть только 0
+    Color pixel( const float& x, const float& y, uint32_t level = 0 ) const;
+    //все пиксели уровня 0, в том числе текстуры в файле тайлов; false у пустой текстуры
+    bool copy_pixels( std::vector< Color > & pixels ) const;
+
+    const Color * pixels() const
+    {
+        wait();
+        return m_pixels;
+    }
+    uint32_t levels() const
+    {
+        wait();
+        return m_tiles ? m_tiles->levels() : 1;
+    }
+    const std::string & file_name() const
+    {
+        return m_file_name;
+    }
+    uint32_t width() const
+    {
+        wait();
+        return m_width;
+    }
+    uint32_t height() const
+    {
+        wait();
+        return m_height;
+    }
 };
 
 #endif // TEXTURE_HPP
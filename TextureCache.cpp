@@ -0,0 +1,309 @@
+#include "TextureCache.hpp"
+#include "Trace.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+static const char g_magic[ 8 ] = { 'R', 'T', 'T', 'I', 'L', 'E', 'S', 0 };
+
+#define TILE_TEXELS ( TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE )
+#define TILE_BYTES ( TILE_TEXELS * 4 )
+
+struct cache_tile_t
+{
+	Color texels[ TILE_TEXELS ];
+};
+typedef std::shared_ptr< cache_tile_t > tile_ptr_t;
+
+//Общий кэш тайлов: список в порядке использования ( в начале - последний ) и индекс по ключу.
+//Тайл, вытесненный из кэша, живет, пока на него ссылаются кэши потоков
+class TileCache
+{
+private:
+	typedef std::list< std::pair< uint64_t, tile_ptr_t > > lru_t;
+
+	std::mutex                                      m_mutex;
+	lru_t                                           m_lru;
+	std::unordered_map< uint64_t, lru_t::iterator > m_index;
+	size_t                                          m_bytes;
+public:
+	size_t      budget;
+	uint64_t    hits;
+	uint64_t    loads;
+	uint64_t    evictions;
+
+	TileCache()
+		: m_bytes( 0 ), budget( 0 ), hits( 0 ), loads( 0 ), evictions( 0 )
+	{}
+
+	tile_ptr_t get( const TiledImage & image, uint64_t key, uint64_t tile );
+
+	size_t bytes() const
+	{
+		return m_bytes;
+	}
+};
+
+static TileCache g_tile_cache;
+static std::atomic< uint32_t > g_next_image_id( 0 );
+//байт канала PNG -> линейное значение, как в read_png
+static float g_decode[ 256 ];
+static float g_gamma = 2.2f;
+
+struct micro_entry_t
+{
+	uint64_t    key;
+	tile_ptr_t  tile;
+
+	micro_entry_t()
+		: key( ~0ull )
+	{}
+};
+
+//кэш потока с прямым отображением, попадание не трогает ни мьютекс, ни счетчики ссылок
+static thread_local micro_entry_t t_micro[ TEXTURE_MICRO_CACHE ];
+
+//чтение тайла идет без блокировки, тайл, который успел загрузить другой поток, не дублируется
+tile_ptr_t TileCache::get( const TiledImage & image, uint64_t key, uint64_t tile )
+{
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		std::unordered_map< uint64_t, lru_t::iterator >::iterator it = m_index.find( key );
+		if ( it != m_index.end() )
+		{
+			m_lru.splice( m_lru.begin(), m_lru, it->second );
+			hits++;
+			return it->second->second;
+		}
+	}
+
+	TRACE_SCOPE( "texture tile load" );
+	tile_ptr_t loaded( new cache_tile_t );
+	if ( !image.read_tile( tile, loaded->texels ) )
+	{
+		fprintf( stderr, "can't read texture tile %llu\n", ( unsigned long long )tile );
+		std::fill( loaded->texels, loaded->texels + TILE_TEXELS, Color( 1.0f, 1.0f, 1.0f ) );
+	}
+
+	std::lock_guard< std::mutex > lock( m_mutex );
+	std::unordered_map< uint64_t, lru_t::iterator >::iterator it = m_index.find( key );
+	if ( it != m_index.end() )
+		return it->second->second;
+	m_lru.push_front( std::make_pair( key, loaded ) );
+	m_index[ key ] = m_lru.begin();
+	m_bytes += sizeof( cache_tile_t );
+	loads++;
+	while( m_bytes > budget && m_lru.size() > 1 )
+	{
+		m_index.erase( m_lru.back().first );
+		m_lru.pop_back();
+		m_bytes -= sizeof( cache_tile_t );
+		evictions++;
+	}
+	return loaded;
+}
+
+void InitTextureCacheSystem( size_t budget, float gamma )
+{
+	g_tile_cache.budget = budget;
+	g_gamma = gamma;
+	for( int i = 0; i < 256; i++ )
+		g_decode[ i ] = ( Color( i / 255.0f ) ^ gamma ).r;
+}
+
+bool texture_cache_enabled()
+{
+	return g_tile_cache.budget > 0;
+}
+
+void print_texture_cache_stats()
+{
+	printf( "Texture tiles loaded %llu, hits %llu, evictions %llu, resident %.1f MB of %.1f MB\n",
+			( unsigned long long )g_tile_cache.loads, ( unsigned long long )g_tile_cache.hits,
+			( unsigned long long )g_tile_cache.evictions, g_tile_cache.bytes() / 1048576.0, g_tile_cache.budget / 1048576.0 );
+}
+
+TiledImage::TiledImage()
+	: m_fd( -1 ), m_id( g_next_image_id++ ), m_tiles_offset( 0 )
+{
+}
+
+TiledImage::~TiledImage()
+{
+	if ( m_fd >= 0 )
+		close( m_fd );
+}
+
+static uint8_t encode( float linear )
+{
+	float v = powf( std::max( linear, 0.0f ), 1.0f / g_gamma ) * 255.0f + 0.5f;
+	return v >= 255.0f ? 255 : ( uint8_t )v;
+}
+
+bool TiledImage::write( const std::string & file_name, const uint8_t * rgb, uint32_t width, uint32_t height )
+{
+	if ( !width || !height )
+		return false;
+	TRACE_SCOPE( "texture convert" );
+
+	//mip-пирамида до 1x1, тексели RGBA
+	std::vector< std::vector< uint8_t > > pixels( 1, std::vector< uint8_t >( ( size_t )width * height * 4, 255 ) );
+	std::vector< texture_tile_level_t > levels( 1 );
+	for( size_t i = 0; i < ( size_t )width * height; i++ )
+		memcpy( &pixels[ 0 ][ i * 4 ], rgb + i * 3, 3 );
+	levels[ 0 ].width = width;
+	levels[ 0 ].height = height;
+	while( levels.back().width > 1 || levels.back().height > 1 )
+	{
+		const texture_tile_level_t & src = levels.back();
+		const std::vector< uint8_t > & from = pixels.back();
+		texture_tile_level_t dst;
+		dst.width = std::max< uint32_t >( src.width / 2, 1 );
+		dst.height = std::max< uint32_t >( src.height / 2, 1 );
+		std::vector< uint8_t > to( ( size_t )dst.width * dst.height * 4, 255 );
+		for( uint32_t y = 0; y < dst.height; y++ )
+			for( uint32_t x = 0; x < dst.width; x++ )
+				for( int c = 0; c < 3; c++ )
+				{
+					float sum = 0.0f;
+					for( uint32_t k = 0; k < 4; k++ )
+					{
+						uint32_t sx = std::min( x * 2 + ( k & 1 ), src.width - 1 );
+						uint32_t sy = std::min( y * 2 + ( k >> 1 ), src.height - 1 );
+						sum += g_decode[ from[ ( ( size_t )sy * src.width + sx ) * 4 + c ] ];
+					}
+					to[ ( ( size_t )y * dst.width + x ) * 4 + c ] = encode( sum * 0.25f );
+				}
+		levels.push_back( dst );
+		pixels.push_back( to );
+	}
+
+	uint64_t tiles = 0;
+	for( size_t l = 0; l < levels.size(); l++ )
+	{
+		levels[ l ].tiles_x = ( levels[ l ].width + TEXTURE_TILE_SIZE - 1 ) / TEXTURE_TILE_SIZE;
+		levels[ l ].tiles_y = ( levels[ l ].height + TEXTURE_TILE_SIZE - 1 ) / TEXTURE_TILE_SIZE;
+		levels[ l ].first_tile = tiles;
+		tiles += ( uint64_t )levels[ l ].tiles_x * levels[ l ].tiles_y;
+	}
+
+	texture_tile_header_t header;
+	memset( &header, 0, sizeof( header ) );
+	memcpy( header.magic, g_magic, sizeof( g_magic ) );
+	header.version = TEXTURE_TILE_FILE_VERSION;
+	header.header_size = sizeof( header );
+	header.width = width;
+	header.height = height;
+	header.tile_size = TEXTURE_TILE_SIZE;
+	header.levels = levels.size();
+	header.tiles_offset = ( sizeof( header ) + levels.size() * sizeof( texture_tile_level_t ) + 4095 ) & ~( uint64_t )4095;
+	header.file_size = header.tiles_offset + tiles * TILE_BYTES;
+
+	FILE * f = fopen( file_name.c_str(), "wb" );
+	if ( !f )
+		return false;
+	bool ok = fwrite( &header, sizeof( header ), 1, f ) == 1 &&
+			  fwrite( levels.data(), sizeof( texture_tile_level_t ), levels.size(), f ) == levels.size() &&
+			  fseek( f, header.tiles_offset, SEEK_SET ) == 0;
+	std::vector< uint8_t > tile( TILE_BYTES );
+	for( size_t l = 0; ok && l < levels.size(); l++ )
+	{
+		const texture_tile_level_t & level = levels[ l ];
+		for( uint32_t ty = 0; ok && ty < level.tiles_y; ty++ )
+			for( uint32_t tx = 0; ok && tx < level.tiles_x; tx++ )
+			{
+				for( uint32_t y = 0; y < TEXTURE_TILE_SIZE; y++ )
+					for( uint32_t x = 0; x < TEXTURE_TILE_SIZE; x++ )
+					{
+						uint32_t sx = std::min( tx * TEXTURE_TILE_SIZE + x, level.width - 1 );
+						uint32_t sy = std::min( ty * TEXTURE_TILE_SIZE + y, level.height - 1 );
+						memcpy( &tile[ ( y * TEXTURE_TILE_SIZE + x ) * 4 ], &pixels[ l ][ ( ( size_t )sy * level.width + sx ) * 4 ], 4 );
+					}
+				ok = fwrite( tile.data(), 1, tile.size(), f ) == tile.size();
+			}
+	}
+	ok = fclose( f ) == 0 && ok;
+	return ok;
+}
+
+std::shared_ptr< TiledImage > TiledImage::open( const std::string & file_name )
+{
+	std::shared_ptr< TiledImage > image( new TiledImage() );
+	image->m_fd = ::open( file_name.c_str(), O_RDONLY );
+	if ( image->m_fd < 0 )
+		return std::shared_ptr< TiledImage >();
+
+	texture_tile_header_t header;
+	struct stat st;
+	bool valid = fstat( image->m_fd, &st ) == 0 &&
+				 pread( image->m_fd, &header, sizeof( header ), 0 ) == sizeof( header ) &&
+				 memcmp( header.magic, g_magic, sizeof( g_magic ) ) == 0 && header.version == TEXTURE_TILE_FILE_VERSION &&
+				 header.header_size == sizeof( header ) && header.tile_size == TEXTURE_TILE_SIZE &&
+				 header.file_size == ( uint64_t )st.st_size && header.levels > 0 && header.levels <= 32;
+	if ( valid )
+	{
+		image->m_levels.resize( header.levels );
+		size_t bytes = header.levels * sizeof( texture_tile_level_t );
+		valid = pread( image->m_fd, image->m_levels.data(), bytes, sizeof( header ) ) == ( ssize_t )bytes;
+	}
+	uint64_t tiles = 0;
+	for( uint32_t l = 0; valid && l < header.levels; l++ )
+	{
+		const texture_tile_level_t & level = image->m_levels[ l ];
+		valid = level.width && level.height && level.first_tile == tiles &&
+				level.tiles_x == ( level.width + TEXTURE_TILE_SIZE - 1 ) / TEXTURE_TILE_SIZE &&
+				level.tiles_y == ( level.height + TEXTURE_TILE_SIZE - 1 ) / TEXTURE_TILE_SIZE;
+		tiles += ( uint64_t )level.tiles_x * level.tiles_y;
+	}
+	valid = valid && image->m_levels[ 0 ].width == header.width && image->m_levels[ 0 ].height == header.height &&
+			header.tiles_offset + tiles * TILE_BYTES == header.file_size;
+	if ( !valid )
+	{
+		fprintf( stderr, "%s: not a valid texture tile file\n", file_name.c_str() );
+		return std::shared_ptr< TiledImage >();
+	}
+	image->m_tiles_offset = header.tiles_offset;
+	return image;
+}
+
+bool TiledImage::read_tile( uint64_t tile, Color * texels ) const
+{
+	uint8_t bytes[ TILE_BYTES ];
+	uint64_t offset = m_tiles_offset + tile * TILE_BYTES;
+	size_t done = 0;
+	while( done < TILE_BYTES )
+	{
+		ssize_t n = pread( m_fd, bytes + done, TILE_BYTES - done, offset + done );
+		if ( n <= 0 )
+			return false;
+		done += n;
+	}
+	for( size_t i = 0; i < TILE_TEXELS; i++ )
+		texels[ i ] = Color( g_decode[ bytes[ i * 4 ] ], g_decode[ bytes[ i * 4 + 1 ] ], g_decode[ bytes[ i * 4 + 2 ] ] );
+	return true;
+}
+
+Color TiledImage::texel( uint32_t level, uint32_t x, uint32_t y ) const
+{
+	const texture_tile_level_t & l = m_levels[ level ];
+	uint64_t tile = l.first_tile + ( uint64_t )( y / TEXTURE_TILE_SIZE ) * l.tiles_x + x / TEXTURE_TILE_SIZE;
+	uint64_t key = ( ( uint64_t )m_id << 40 ) | tile;
+	//соседние тайлы одного изображения попадают в разные ячейки
+	micro_entry_t & entry = t_micro[ ( tile + m_id * 7 ) & ( TEXTURE_MICRO_CACHE - 1 ) ];
+	if ( entry.key != key )
+	{
+		entry.tile = g_tile_cache.get( *this, key, tile );
+		entry.key = key;
+	}
+	return entry.tile->texels[ ( y % TEXTURE_TILE_SIZE ) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE ];
+}
@@ -0,0 +1,93 @@
+#ifndef TEXTURECACHE_HPP
+#define TEXTURECACHE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Color.hpp"
+
+#define TEXTURE_TILE_FILE_VERSION 1
+//сторона тайла в текселях, степень двойки
+#define TEXTURE_TILE_SIZE 64
+//тайлов в кэше каждого потока, степень двойки
+#define TEXTURE_MICRO_CACHE 16
+
+//Файл тайлов текстуры: заголовок, описания уровней mip-пирамиды, затем тайлы всех уровней
+//подряд. Тайл - TEXTURE_TILE_SIZE^2 текселей RGBA по байту на канал в гамма-пространстве
+//исходного PNG, крайние тайлы дополнены повтором последнего столбца и строки. Уровень 0 хранит
+//байты PNG без изменений, следующие - уменьшение вдвое усреднением в линейном пространстве
+struct texture_tile_header_t
+{
+    char        magic[ 8 ];
+    uint32_t    version;
+    uint32_t    header_size;
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    tile_size;
+    uint32_t    levels;
+    uint64_t    tiles_offset;
+    uint64_t    file_size;
+};
+
+struct texture_tile_level_t
+{
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    tiles_x;
+    uint32_t    tiles_y;
+    //номер первого тайла уровня среди всех тайлов файла
+    uint64_t    first_tile;
+};
+
+//Текстура в файле тайлов. Тайлы читаются только при первом обращении и живут в общем кэше
+//ограниченного размера ( InitTextureCacheSystem ), перед ним у каждого потока маленький кэш
+//без блокировок
+class TiledImage
+{
+private:
+    int                                 m_fd;
+    //номер в ключах кэша, не повторяется за время работы процесса
+    uint32_t                            m_id;
+    uint64_t                            m_tiles_offset;
+    std::vector< texture_tile_level_t > m_levels;
+
+    TiledImage();
+    TiledImage( const TiledImage & );
+    TiledImage & operator=( const TiledImage & );
+public:
+    ~TiledImage();
+
+    //rgb - width * height текселей по три байта, как в PNG
+    static bool write( const std::string & file_name, const uint8_t * rgb, uint32_t width, uint32_t height );
+    //NULL, если файла нет или он поврежден
+    static std::shared_ptr< TiledImage > open( const std::string & file_name );
+
+    uint32_t levels() const
+    {
+        return m_levels.size();
+    }
+    uint32_t width( uint32_t level = 0 ) const
+    {
+        return m_levels[ level ].width;
+    }
+    uint32_t height( uint32_t level = 0 ) const
+    {
+        return m_levels[ level ].height;
+    }
+
+    //линейный цвет текселя уровня level
+    Color texel( uint32_t level, uint32_t x, uint32_t y ) const;
+    //читает и декодирует тайл с диска мимо кэша, tile - номер среди всех тайлов файла
+    bool read_tile( uint64_t tile, Color * texels ) const;
+};
+
+//budget - предел памяти под декодированные тайлы в байтах, 0 - текстуры читаются целиком, как
+//раньше. gamma - как у InitTextureSystem
+void InitTextureCacheSystem( size_t budget, float gamma );
+bool texture_cache_enabled();
+void print_texture_cache_stats();
+
+#endif // TEXTURECACHE_HPP
@@ -0,0 +1,68 @@
+#include "ThreadPool.hpp"
+
+#include <stdio.h>
+#include <algorithm>
+
+#include "Trace.hpp"
+
+ThreadPool::ThreadPool( size_t threads )
+	: m_running( 0 ), m_stop( false )
+{
+	if ( !threads )
+		threads = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+	for( size_t i = 0; i < threads; i++ )
+		m_threads.push_back( std::thread( &ThreadPool::worker, this, i ) );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_stop = true;
+	}
+	m_wake.notify_all();
+	for( size_t i = 0; i < m_threads.size(); i++ )
+		m_threads[ i ].join();
+}
+
+void ThreadPool::submit( const std::function< void() > & job )
+{
+	{
+		std::lock_guard< std::mutex > lock( m_mutex );
+		m_jobs.push_back( job );
+	}
+	m_wake.notify_one();
+}
+
+void ThreadPool::wait()
+{
+	std::unique_lock< std::mutex > lock( m_mutex );
+	while( !m_jobs.empty() || m_running )
+		m_idle.wait( lock );
+}
+
+//при остановке очередь дорабатывается до конца: задания ссылаются на объекты, которые
+//ждут их завершения
+void ThreadPool::worker( size_t index )
+{
+	char name[ 32 ];
+	snprintf( name, sizeof( name ), "pool %zu", index );
+	trace_thread( 100 + index, name );
+	std::unique_lock< std::mutex > lock( m_mutex );
+	for( ;; )
+	{
+		while( m_jobs.empty() && !m_stop )
+			m_wake.wait( lock );
+		if ( m_jobs.empty() )
+			break;
+		std::function< void() > job = m_jobs.front();
+		m_jobs.pop_front();
+		m_running++;
+		lock.unlock();
+		job();
+		lock.lock();
+		m_running--;
+		if ( m_jobs.empty() && !m_running )
+			m_idle.notify_all();
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <stddef.h>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+//Пул потоков с общей очередью заданий в порядке поступления. Задание - вызываемый объект
+//без аргументов, обычно std::bind метода объекта, который живет до завершения задания.
+//Деструктор дожидается всех поставленных заданий
+class ThreadPool
+{
+private:
+    std::vector< std::thread >              m_threads;
+    std::deque< std::function< void() > >   m_jobs;
+    std::mutex                              m_mutex;
+    std::condition_variable                 m_wake;
+    std::condition_variable                 m_idle;
+    size_t                                  m_running;
+    bool                                    m_stop;
+
+    void worker( size_t index );
+
+    ThreadPool( const ThreadPool & );
+    ThreadPool & operator=( const ThreadPool & );
+public:
+    //threads == 0 - по числу процессоров
+    ThreadPool( size_t threads = 0 );
+    ~ThreadPool();
+
+    void submit( const std::function< void() > & job );
+    //ждет, пока очередь не опустеет и все задания не завершатся
+    void wait();
+
+    size_t size() const
+    {
+        return m_threads.size();
+    }
+};
+
+#endif // THREADPOOL_HPP
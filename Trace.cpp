@@ -0,0 +1,117 @@
+#include "Trace.hpp"
+
+#include <stdio.h>
+#include <time.h>
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+struct trace_buffer_t
+{
+	std::string                     name;
+	std::vector< trace_event_t >    events;
+	//всего записано событий, позиция записи - count % TRACE_BUFFER_EVENTS
+	uint64_t                        count;
+
+	trace_buffer_t()
+		: events( TRACE_BUFFER_EVENTS ), count( 0 )
+	{}
+};
+
+//буферы живут до конца процесса: рабочие потоки завершаются после каждого прохода,
+//а события нужны при сохранении
+static std::mutex g_trace_mutex;
+static std::map< uint32_t, trace_buffer_t* > g_trace_buffers;
+static uint32_t g_trace_next_id = 1000;
+static uint64_t g_trace_origin = trace_now();
+static thread_local trace_buffer_t * t_trace_buffer = NULL;
+
+uint64_t trace_now()
+{
+	timespec tp;
+	clock_gettime( CLOCK_MONOTONIC, &tp );
+	return ( uint64_t )tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+static trace_buffer_t * buffer_of( uint32_t id, const std::string & name )
+{
+	std::lock_guard< std::mutex > lock( g_trace_mutex );
+	trace_buffer_t *& buffer = g_trace_buffers[ id ];
+	if ( !buffer )
+		buffer = new trace_buffer_t();
+	buffer->name = name;
+	return buffer;
+}
+
+void trace_thread( uint32_t id, const std::string & name )
+{
+#if TRACE
+	t_trace_buffer = buffer_of( id, name );
+#else
+	( void )id;
+	( void )name;
+#endif
+}
+
+void trace_record( const char * name, uint64_t start, int32_t x, int32_t y )
+{
+	trace_buffer_t * buffer = t_trace_buffer;
+	if ( !buffer )
+	{
+		uint32_t id;
+		{
+			std::lock_guard< std::mutex > lock( g_trace_mutex );
+			id = g_trace_next_id++;
+		}
+		char thread_name[ 32 ];
+		snprintf( thread_name, sizeof( thread_name ), "thread %u", id );
+		buffer = t_trace_buffer = buffer_of( id, thread_name );
+	}
+	trace_event_t & e = buffer->events[ buffer->count++ % TRACE_BUFFER_EVENTS ];
+	e.name = name;
+	e.start = start;
+	e.duration = trace_now() - start;
+	e.x = x;
+	e.y = y;
+}
+
+//имена событий - строковые литералы из кода, экранирование не нужно
+bool trace_write( const std::string & file_name )
+{
+#if TRACE
+	FILE * f = fopen( file_name.c_str(), "w" );
+	if ( !f )
+		return false;
+	std::lock_guard< std::mutex > lock( g_trace_mutex );
+	fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	bool first = true;
+	for( std::map< uint32_t, trace_buffer_t* >::const_iterator it = g_trace_buffers.begin(); it != g_trace_buffers.end(); ++it )
+	{
+		const trace_buffer_t & buffer = *it->second;
+		fprintf( f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				 first ? "" : ",\n", it->first, buffer.name.c_str() );
+		fprintf( f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}",
+				 it->first, it->first );
+		first = false;
+		uint64_t begin = buffer.count > TRACE_BUFFER_EVENTS ? buffer.count - TRACE_BUFFER_EVENTS : 0;
+		for( uint64_t i = begin; i < buffer.count; i++ )
+		{
+			const trace_event_t & e = buffer.events[ i % TRACE_BUFFER_EVENTS ];
+			fprintf( f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+					 e.name, it->first, ( int64_t )( e.start - g_trace_origin ) / 1000.0, e.duration / 1000.0 );
+			if ( e.x >= 0 )
+				fprintf( f, ",\"args\":{\"x\":%d,\"y\":%d}", e.x, e.y );
+			fprintf( f, "}" );
+		}
+		if ( begin )
+			fprintf( stderr, "trace: %s lost %llu oldest events\n", buffer.name.c_str(), ( unsigned long long )begin );
+	}
+	fprintf( f, "\n]}\n" );
+	return fclose( f ) == 0;
+#else
+	( void )file_name;
+	fprintf( stderr, "tracing is compiled out, build with -DTRACE\n" );
+	return false;
+#endif
+}
@@ -0,0 +1,61 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <stdint.h>
+#include <string>
+
+//событий в кольцевом буфере потока, при переполнении старые события затираются
+#define TRACE_BUFFER_EVENTS 65536
+
+//Трассировка интервалов времени для временной шкалы chrome://tracing или Perfetto.
+//Включается флагом компиляции -DTRACE ( как -DSSE ), без него макросы TRACE_SCOPE ничего не
+//генерируют. Каждый поток пишет в свой буфер без блокировок, блокировка только при первом
+//событии потока
+struct trace_event_t
+{
+    const char* name;
+    uint64_t    start;
+    uint64_t    duration;
+    //аргументы события, например координаты тайла; -1 - нет
+    int32_t     x;
+    int32_t     y;
+};
+
+uint64_t trace_now();
+void trace_record( const char * name, uint64_t start, int32_t x, int32_t y );
+
+//задает номер и имя дорожки вызывающего потока. Потоки с одним номером ( рабочие потоки
+//разных проходов ) пишут в одну дорожку, поэтому не должны работать одновременно
+void trace_thread( uint32_t id, const std::string & name );
+//сохраняет события всех потоков в JSON формата Chrome trace, false при ошибке или без -DTRACE
+bool trace_write( const std::string & file_name );
+
+class TraceScope
+{
+private:
+    const char* m_name;
+    uint64_t    m_start;
+    int32_t     m_x;
+    int32_t     m_y;
+public:
+    TraceScope( const char * name, int32_t x = -1, int32_t y = -1 )
+        : m_name( name ), m_start( trace_now() ), m_x( x ), m_y( y )
+    {}
+    ~TraceScope()
+    {
+        trace_record( m_name, m_start, m_x, m_y );
+    }
+};
+
+#define TRACE_CONCAT_( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT_( a, b )
+
+#if TRACE
+#define TRACE_SCOPE( name ) TraceScope TRACE_CONCAT( trace_scope_, __LINE__ )( name )
+#define TRACE_SCOPE_XY( name, x, y ) TraceScope TRACE_CONCAT( trace_scope_, __LINE__ )( name, x, y )
+#else
+#define TRACE_SCOPE( name )
+#define TRACE_SCOPE_XY( name, x, y )
+#endif
+
+#endif // TRACE_HPP
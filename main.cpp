@@ -1,8 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <algorithm>
+#include <chrono>
+
 #include "raytracer.h"
 
+//Скрипт перезасветки, по команде в строке:
+//  light i color r g b | light i position x y z | light i radius r
+//  material i ambient|diffuse|specular r g b | material i phong p
+//  frame - рендеринг с текущими правками в relightNN.png
+//пустые строки и строки с # пропускаются
+static bool run_relight_script( RayTracer & rt, const std::string & file_name )
+{
+    FILE * f = fopen( file_name.c_str(), "r" );
+    if ( !f )
+        return false;
+    char line[ 256 ];
+    uint32_t frame = 0;
+    for( int number = 1; fgets( line, sizeof( line ), f ); number++ )
+    {
+        char object[ 32 ], field[ 32 ];
+        unsigned index;
+        float v[ 3 ];
+        int n = sscanf( line, "%31s %u %31s %f %f %f", object, &index, field, &v[ 0 ], &v[ 1 ], &v[ 2 ] );
+        if ( n <= 0 || object[ 0 ] == '#' )
+            continue;
+        if ( !strcmp( object, "frame" ) )
+        {
+            rt.render();
+            char output[ 64 ];
+            snprintf( output, sizeof( output ), "relight%02u.png", frame++ );
+            rt.save( output );
+            continue;
+        }
+        bool ok = false;
+        if ( !strcmp( object, "light" ) && n >= 4 && index < rt.lights_count() )
+        {
+            ObjectLight light = rt.light( index );
+            ok = true;
+            if ( !strcmp( field, "color" ) && n == 6 )
+                light.m_color = Color( v[ 0 ], v[ 1 ], v[ 2 ] );
+            else if ( !strcmp( field, "position" ) && n == 6 )
+                light.m_center = Vector( v[ 0 ], v[ 1 ], v[ 2 ] );
+            else if ( !strcmp( field, "radius" ) )
+                light.m_radius = v[ 0 ];
+            else
+                ok = false;
+            if ( ok )
+                rt.set_light( index, light );
+        }
+        else if ( !strcmp( object, "material" ) && n >= 4 && index < rt.materials_count() )
+        {
+            Material material = rt.material( index );
+            ok = true;
+            if ( !strcmp( field, "ambient" ) && n == 6 )
+                material.m_ambient = Color( v[ 0 ], v[ 1 ], v[ 2 ] );
+            else if ( !strcmp( field, "diffuse" ) && n == 6 )
+                material.m_diffuse = Color( v[ 0 ], v[ 1 ], v[ 2 ] );
+            else if ( !strcmp( field, "specular" ) && n == 6 )
+                material.m_specular = Color( v[ 0 ], v[ 1 ], v[ 2 ] );
+            else if ( !strcmp( field, "phong" ) )
+                material.m_phong = v[ 0 ];
+            else
+                ok = false;
+            if ( ok )
+                rt.set_material( index, material );
+        }
+        if ( !ok )
+            printf( "%s:%d: bad command\n", file_name.c_str(), number );
+    }
+    fclose( f );
+    return true;
+}
+
+static RayTracer * g_tracer = NULL;
+static volatile sig_atomic_t g_interrupted = 0;
+
+//первый Ctrl+C прерывает рендеринг, полученное к этому моменту изображение сохраняется, а
+//следующие кадры и скрипт перезасветки пропускаются; второй завершает программу
+static void on_interrupt( int )
+{
+    signal( SIGINT, SIG_DFL );
+    g_interrupted = 1;
+    if ( g_tracer )
+        g_tracer->cancel();
+}
+
+//задание скрипта --jobs, рендерится в своем потоке на общем планировщике; RayTracer
+//создается заранее на главном потоке, поток только ждет запуска и рендерит
+struct render_job_t
+{
+    std::string         name;
+    render_settings_t   settings;
+    //задержка запуска от начала скрипта в секундах
+    double              start;
+    render_stats_t      stats;
+    RayTracer*          tracer;
+
+    void run()
+    {
+        std::this_thread::sleep_for( std::chrono::duration< double >( start ) );
+        stats = tracer->render();
+        tracer->save( name + ".png" );
+    }
+};
+
+//Скрипт заданий, по заданию в строке:
+//  name priority weight WxH spp start_seconds [preview|progressive]
+//задания рендерятся одновременно на одном планировщике из threads потоков ( 0 - по числу
+//процессоров ), каждое в name.png. Остальные настройки, в том числе общие для процесса сэмплер,
+//seed и кэш текстур, берутся из командной строки. Пустые строки и строки с # пропускаются
+static bool run_jobs_script( const render_settings_t & base, const std::string & file_name, size_t threads )
+{
+    FILE * f = fopen( file_name.c_str(), "r" );
+    if ( !f )
+        return false;
+    std::vector< render_job_t > jobs;
+    char line[ 256 ];
+    for( int number = 1; fgets( line, sizeof( line ), f ); number++ )
+    {
+        char name[ 64 ], mode[ 32 ] = "";
+        render_job_t job;
+        job.settings = base;
+        job.tracer = NULL;
+        int n = sscanf( line, "%63s %u %f %zux%zu %u %lf %31s", name, &job.settings.priority, &job.settings.weight,
+                        &job.settings.width, &job.settings.height, &job.settings.samples, &job.start, mode );
+        if ( n <= 0 || name[ 0 ] == '#' )
+            continue;
+        if ( n < 7 || !job.settings.width || !job.settings.height || job.settings.width > MAX_IMAGE_SIDE ||
+             job.settings.height > MAX_IMAGE_SIDE )
+        {
+            printf( "%s:%d: can't parse \"%s\"\n", file_name.c_str(), number, name );
+            continue;
+        }
+        job.name = name;
+        job.settings.preview = !strcmp( mode, "preview" );
+        job.settings.progressive = !strcmp( mode, "progressive" );
+        jobs.push_back( job );
+    }
+    fclose( f );
+
+    Scheduler scheduler( threads );
+    printf( "Jobs %zu on %zu scheduler threads\n", jobs.size(), scheduler.size() );
+    for( size_t i = 0; i < jobs.size(); i++ )
+    {
+        jobs[ i ].settings.scheduler = &scheduler;
+        jobs[ i ].tracer = new RayTracer( jobs[ i ].settings );
+    }
+    std::vector< std::thread > job_threads;
+    for( size_t i = 0; i < jobs.size(); i++ )
+        job_threads.push_back( std::thread( &render_job_t::run, &jobs[ i ] ) );
+    for( size_t i = 0; i < job_threads.size(); i++ )
+        job_threads[ i ].join();
+    for( size_t i = 0; i < jobs.size(); i++ )
+        delete jobs[ i ].tracer;
+    for( size_t i = 0; i < jobs.size(); i++ )
+        printf( "Job %s: priority %u weight %g, started at %gs, rendered in %gs\n", jobs[ i ].name.c_str(),
+                jobs[ i ].settings.priority, jobs[ i ].settings.weight, jobs[ i ].start, jobs[ i ].stats.time );
+    return true;
+}
 
 int main(int argc, char *argv[])
 {
-    RayTracer rt(1024, 1024);
+    render_settings_t settings;
+    std::string compile_file;
+    std::string compile_geometry_file;
+    std::string compile_header_file;
+    std::string trace_file;
+    std::string bake_file;
+    std::string linear_file;
+    std::string regrade_file;
+    std::string relight_file;
+    std::string jobs_file;
+    size_t jobs_threads = 0;
+    bool autotune = false;
+    uint32_t frames = 1;
+    float camera_step[ 3 ] = { 0.0f, 0.0f, 0.0f };
+    trace_thread( 0, "main" );
+    for( int i = 1; i < argc; i++ )
+    {
+        if ( !strcmp( argv[ i ], "--progressive" ) )
+        {
+            settings.progressive = true;
+            if ( settings.samples == 1 )
+                settings.samples = 64;
+        }
+        else if ( !strcmp( argv[ i ], "--preview" ) )
+            settings.preview = true;
+        else if ( !strcmp( argv[ i ], "--time-budget" ) && i + 1 < argc )
+            settings.time_budget = atof( argv[ ++i ] );
+        else if ( !strcmp( argv[ i ], "--spp" ) && i + 1 < argc )
+            settings.samples = atoi( argv[ ++i ] );
+        else if ( !strcmp( argv[ i ], "--snapshots" ) && i + 1 < argc )
+            settings.snapshot_prefix = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--sampler" ) && i + 1 < argc )
+        {
+            i++;
+            if ( !strcmp( argv[ i ], "sobol" ) )
+                settings.sampler = SAMPLER_SOBOL;
+            else if ( !strcmp( argv[ i ], "bluenoise" ) )
+                settings.sampler = SAMPLER_BLUE_NOISE;
+        }
+        else if ( !strcmp( argv[ i ], "--denoise" ) )
+            settings.denoise = true;
+        else if ( !strcmp( argv[ i ], "--rect-lights" ) )
+            settings.rect_lights = true;
+        else if ( !strcmp( argv[ i ], "--scatter" ) && i + 1 < argc )
+            settings.scatter = atoi( argv[ ++i ] );
+        else if ( !strcmp( argv[ i ], "--numa" ) )
+            settings.numa = true;
+        else if ( !strcmp( argv[ i ], "--scene" ) && i + 1 < argc )
+            settings.scene_cache = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--compile-scene" ) && i + 1 < argc )
+            compile_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--compile-scene-header" ) && i + 1 < argc )
+            compile_header_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--geometry" ) && i + 1 < argc )
+            settings.geometry_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--geometry-cache" ) && i + 1 < argc )
+            settings.geometry_cache = ( size_t )( atof( argv[ ++i ] ) * 1048576.0 );
+        else if ( !strcmp( argv[ i ], "--compile-geometry" ) && i + 1 < argc )
+            compile_geometry_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--texture-cache" ) && i + 1 < argc )
+            settings.texture_cache = ( size_t )( atof( argv[ ++i ] ) * 1048576.0 );
+        else if ( !strcmp( argv[ i ], "--trace" ) && i + 1 < argc )
+            trace_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--lightmap" ) && i + 1 < argc )
+            settings.lightmap = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--bake-lighting" ) && i + 1 < argc )
+            bake_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--exposure" ) && i + 1 < argc )
+            settings.post.exposure = atof( argv[ ++i ] );
+        else if ( !strcmp( argv[ i ], "--tonemap" ) && i + 1 < argc )
+        {
+            i++;
+            if ( !strcmp( argv[ i ], "clamp" ) )
+                settings.post.tonemap = TONEMAP_CLAMP;
+            else if ( !strcmp( argv[ i ], "reinhard-luminance" ) )
+                settings.post.tonemap = TONEMAP_REINHARD_LUMINANCE;
+            else if ( !strcmp( argv[ i ], "reinhard" ) )
+                settings.post.tonemap = TONEMAP_REINHARD;
+            else if ( !strcmp( argv[ i ], "aces" ) )
+                settings.post.tonemap = TONEMAP_ACES;
+        }
+        else if ( !strcmp( argv[ i ], "--gamma" ) && i + 1 < argc )
+        {
+            i++;
+            settings.post.gamma = !strcmp( argv[ i ], "srgb" ) ? 0.0f : atof( argv[ i ] );
+        }
+        else if ( !strcmp( argv[ i ], "--dither" ) )
+            settings.post.dither = true;
+        else if ( !strcmp( argv[ i ], "--save-linear" ) && i + 1 < argc )
+            linear_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--regrade" ) && i + 1 < argc )
+            regrade_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--temporal" ) && i + 1 < argc )
+        {
+            settings.temporal = true;
+            settings.temporal_error = atof( argv[ ++i ] );
+        }
+        else if ( !strcmp( argv[ i ], "--relight" ) && i + 1 < argc )
+        {
+            settings.relight = true;
+            relight_file = argv[ ++i ];
+        }
+        else if ( !strcmp( argv[ i ], "--stream" ) && i + 1 < argc )
+            settings.stream_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--jobs" ) && i + 1 < argc )
+            jobs_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--jobs-threads" ) && i + 1 < argc )
+            jobs_threads = atoi( argv[ ++i ] );
+        else if ( !strcmp( argv[ i ], "--autotune" ) )
+            autotune = true;
+        else if ( !strcmp( argv[ i ], "--tuning-file" ) && i + 1 < argc )
+            settings.tuning_file = argv[ ++i ];
+        else if ( !strcmp( argv[ i ], "--frames" ) && i + 1 < argc )
+            frames = std::max( atoi( argv[ ++i ] ), 1 );
+        else if ( !strcmp( argv[ i ], "--camera-step" ) && i + 1 < argc )
+            sscanf( argv[ ++i ], "%f,%f,%f", &camera_step[ 0 ], &camera_step[ 1 ], &camera_step[ 2 ] );
+        else if ( !strcmp( argv[ i ], "--seed" ) && i + 1 < argc )
+            settings.seed = strtoul( argv[ ++i ], NULL, 10 );
+        else if ( !strcmp( argv[ i ], "--size" ) && i + 1 < argc )
+            sscanf( argv[ ++i ], "%zux%zu", &settings.width, &settings.height );
+        else
+        {
+            printf( "usage: %s [--size WxH] [--spp N] [--progressive | --preview] [--time-budget seconds] [--snapshots prefix]"
+                    " [--sampler sobol|bluenoise] [--seed N] [--denoise] [--numa] [--rect-lights] [--scatter N]"
+                    " [--scene cache_file] [--compile-scene cache_file] [--compile-scene-header file.hpp]"
+                    " [--geometry file] [--geometry-cache MB] [--compile-geometry file]"
+                    " [--texture-cache MB] [--trace trace.json]"
+                    " [--lightmap file] [--bake-lighting file]"
+                    " [--exposure stops] [--tonemap clamp|reinhard-luminance|reinhard|aces] [--gamma G|srgb] [--dither]"
+                    " [--save-linear file.pfm] [--regrade file.pfm]"
+                    " [--frames N] [--camera-step dx,dy,dz] [--temporal error_pixels]"
+                    " [--relight script] [--stream file.png]"
+                    " [--autotune] [--tuning-file file] [--jobs script] [--jobs-threads N]\n", argv[ 0 ] );
+            return 1;
+        }
+    }
+
+    if ( !settings.width || !settings.height || settings.width > MAX_IMAGE_SIDE || settings.height > MAX_IMAGE_SIDE )
+    {
+        printf( "bad size %zux%zu, each side must be 1..%u\n", settings.width, settings.height, MAX_IMAGE_SIDE );
+        return 1;
+    }
+
+    //повторная постобработка сохраненного линейного изображения без рендеринга
+    if ( !regrade_file.empty() )
+    {
+        image_t image;
+        if ( read_pfm( regrade_file, image ) )
+        {
+            printf( "can't read %s\n", regrade_file.c_str() );
+            return 1;
+        }
+        return save_graded_png( "out.png", image, settings.post, THREADS ) ? 1 : 0;
+    }
+
+    //несколько рендерингов с приоритетами на общем пуле потоков
+    if ( !jobs_file.empty() )
+    {
+        if ( !run_jobs_script( settings, jobs_file, jobs_threads ) )
+        {
+            printf( "can't read %s\n", jobs_file.c_str() );
+            return 1;
+        }
+        if ( !trace_file.empty() && trace_write( trace_file ) )
+            printf( "Trace written to %s\n", trace_file.c_str() );
+        return 0;
+    }
+
+    RayTracer rt( settings );
+    if ( !compile_file.empty() )
+    {
+        if ( !rt.compile_scene( compile_file ) )
+        {
+            printf( "can't write %s\n", compile_file.c_str() );
+            return 1;
+        }
+        return 0;
+    }
+    if ( !compile_header_file.empty() )
+    {
+        if ( !rt.compile_scene_header( compile_header_file ) )
+        {
+            printf( "can't write %s\n", compile_header_file.c_str() );
+            return 1;
+        }
+        return 0;
+    }
+    if ( !compile_geometry_file.empty() )
+    {
+        if ( !rt.compile_geometry( compile_geometry_file ) )
+        {
+            printf( "can't write %s\n", compile_geometry_file.c_str() );
+            return 1;
+        }
+        return 0;
+    }
+    if ( !bake_file.empty() )
+    {
+        if ( !rt.bake_lighting( bake_file ) )
+        {
+            printf( "can't write %s\n", bake_file.c_str() );
+            return 1;
+        }
+        return 0;
+    }
+    g_tracer = &rt;
+    signal( SIGINT, on_interrupt );
+    //подобранные потоки и тайлы записываются в tuning_file и подхватываются следующими запусками;
+    //после Ctrl+C во время подбора кадр не рендерится
+    autotune_result_t tuned = autotune ? rt.autotune() : AUTOTUNE_SAVED;
+    if ( tuned == AUTOTUNE_NOT_SAVED )
+        printf( "can't write %s\n", settings.tuning_file.c_str() );
+    if ( tuned == AUTOTUNE_CANCELLED )
+    {
+        signal( SIGINT, SIG_DFL );
+        g_tracer = NULL;
+        return 1;
+    }
+    //последовательность кадров: камера сдвигается на camera_step перед каждым следующим,
+    //кадры сохраняются в outNNNN.png
+    Vector step( camera_step[ 0 ], camera_step[ 1 ], camera_step[ 2 ] );
+    for( uint32_t frame = 0; frame < frames && !( frame && g_interrupted ); frame++ )
+    {
+        if ( frame )
+            rt.set_camera( rt.camera() + step );
+        rt.render();
+        if ( frames > 1 )
+        {
+            char file_name[ 64 ];
+            snprintf( file_name, sizeof( file_name ), "out%04u.png", frame );
+            rt.save( file_name );
+        }
+    }
+    //в потоковом режиме изображение уже записано полосами
+    bool streamed = !settings.stream_file.empty();
+    if ( frames == 1 && !streamed )
+        rt.save( "out.png" );
+    if ( !relight_file.empty() && !streamed && !g_interrupted && !run_relight_script( rt, relight_file ) )
+        printf( "can't read %s\n", relight_file.c_str() );
+    if ( !linear_file.empty() && !streamed && rt.save_linear( linear_file ) )
+        printf( "can't write %s\n", linear_file.c_str() );
+    if ( !trace_file.empty() && trace_write( trace_file ) )
+        printf( "Trace written to %s\n", trace_file.c_str() );
+    signal( SIGINT, SIG_DFL );
+    g_tracer = NULL;
     return 0;
 }
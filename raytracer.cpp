@@ -2,71 +2,183 @@
 #include <math.h>
 #include <time.h>
 #include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
 
 #include "raytracer.h"
 #include "Texture.hpp"
 
+//копия сцены узла NUMA, на котором работает поток, NULL - общая m_scene
+static thread_local const Scene * t_scene = NULL;
+//чанки геометрии, которых не хватило лучам потока, и закрепленные за текущим тайлом
+static thread_local std::vector< uint32_t > t_missing;
+static thread_local std::vector< uint32_t > t_pinned;
+//временной режим: шейдинг первичного попадания из прошлого кадра и запись для следующего
+static thread_local const void * t_reuse = NULL;
+static thread_local void * t_record = NULL;
+//перезасветка: пиксель G-буфера, первичное попадание которого шейдится
+static thread_local void * t_gbuffer = NULL;
+//примитивы, видимые через тайл потока, NULL - первичные лучи пересекаются со всей сценой
+static thread_local const CandidateSet * t_candidates = NULL;
+
 void RayTracer::prepare_scene()
 {
-    Material m1( Color( 0.0, 0.0, 0.0 ), Color( 1.0, 1.0, 1.0 ), Color( 0.5, 0.5, 0.5 ), 5, 15, 0, 0, "wall.png" );
-    Material m2( Color( 0.0, 0.1, 0.0 ), Color( 0.1, 0.4, 0.1 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 );
-    Material m3( Color( 0.0, 0.0, 0.1 ), Color( 0.1, 0.1, 0.4 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 );
-    Material m4( Color( 0.1, 0.1, 0.0 ), Color( 0.4, 0.4, 0.1 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 );
-    Material m5( Color( 0.0, 0.1, 0.1 ), Color( 0.1, 0.4, 0.4 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 );
-    Material m6( Color(), Color(), Color(), 0.01, 2, 0, 0 );
-    Material m7( Color(), Color(), Color( 0.5, 0.5, 0.5 ), 0, 10, 1, 0.5 );
-    Material m8( Color(), Color( 0.2, 0.7, 0.5 ), Color( 0.5, 0.5, 0.5 ), 0.5, 10, 0, 0 );
-    Material m9( Color(), Color(), Color( 0.5, 0.5, 0.5 ), 0, 10, 1, 0.6 );
+    uint32_t m1 = m_scene.add_material( Material( Color( 0.0, 0.0, 0.0 ), Color( 1.0, 1.0, 1.0 ), Color( 0.5, 0.5, 0.5 ), 5, 15, 0, 0, "wall.png" ) );
+    uint32_t m2 = m_scene.add_material( Material( Color( 0.0, 0.1, 0.0 ), Color( 0.1, 0.4, 0.1 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 ) );
+    uint32_t m3 = m_scene.add_material( Material( Color( 0.0, 0.0, 0.1 ), Color( 0.1, 0.1, 0.4 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 ) );
+    uint32_t m4 = m_scene.add_material( Material( Color( 0.1, 0.1, 0.0 ), Color( 0.4, 0.4, 0.1 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 ) );
+    uint32_t m5 = m_scene.add_material( Material( Color( 0.0, 0.1, 0.1 ), Color( 0.1, 0.4, 0.4 ), Color( 0.5, 0.5, 0.5 ), 5, 8, 0, 0 ) );
+    //материалы 5 и 6 - для закомментированных сфер ниже, остаются ради прежних номеров материалов
+    m_scene.add_material( Material( Color(), Color(), Color(), 0.01, 2, 0, 0 ) );
+    m_scene.add_material( Material( Color(), Color(), Color( 0.5, 0.5, 0.5 ), 0, 10, 1, 0.5 ) );
+    uint32_t m8 = m_scene.add_material( Material( Color(), Color( 0.2, 0.7, 0.5 ), Color( 0.5, 0.5, 0.5 ), 0.5, 10, 0, 0 ) );
+    uint32_t m9 = m_scene.add_material( Material( Color(), Color(), Color( 0.5, 0.5, 0.5 ), 0, 10, 1, 0.6 ) );
 
     float box_size = 12;
 
     //YZ far
     Matrix m = Matrix::TranslateMatrix( -box_size / 2, 0, 0 );
     m = Matrix::RotateY( PI / 2 ) * m;
-    objects.push_back( new ObjectPlane( m, box_size, box_size, m1 ) );
+    m_scene.add_plane( m, box_size, box_size, m1 );
     //XY top
     m = Matrix::TranslateMatrix( 0, 0, box_size / 2 );
-    objects.push_back( new ObjectPlane( m, box_size, box_size, m1, true ) );
+    m_scene.add_plane( m, box_size, box_size, m1, true );
     //XY bottom
     m = Matrix::TranslateMatrix( 0, 0, -box_size / 2 );
-    objects.push_back( new ObjectPlane( m, box_size, box_size, m1 ) );
+    m_scene.add_plane( m, box_size, box_size, m1 );
     //XZ left
     m = Matrix::TranslateMatrix( 0, box_size / 2, 0 );
     m = Matrix::RotateX( PI / 2 ) * m;
-    objects.push_back( new ObjectPlane( m, box_size, box_size, m1 ) );
+    m_scene.add_plane( m, box_size, box_size, m1 );
     //XZ right
     m = Matrix::TranslateMatrix( 0, -box_size / 2, 0 );
     m = Matrix::RotateX( -PI / 2 ) * m;
-    objects.push_back( new ObjectPlane( m, box_size, box_size, m1 ) );
+    m_scene.add_plane( m, box_size, box_size, m1 );
+
+    m_scene.add_box( Vector( 0.0f, -2.0f, -box_size / 2.0f + 1.5f ), Vector( 0.0f, 0.0f, -0.5f ), 3, m8 );
+    m_scene.add_box( Vector( 1.0f, 2.0f, -box_size / 2.0f + 1.5f ), Vector( 0.0f, 0.0f, 0.9f ), 3, m8 );
 
-    objects.push_back( new ObjectBox( Vector( 0.0f, -2.0f, -box_size / 2.0f + 1.5f ), Vector( 0.0f, 0.0f, -0.5f ), 3, m8 ) );
-    objects.push_back( new ObjectBox( Vector( 1.0f, 2.0f, -box_size / 2.0f + 1.5f ), Vector( 0.0f, 0.0f, 0.9f ), 3, m8 ) );
+    //m_scene.add_sphere( Vector( 1.5, 1.5, -box_size / 2 + 2 ), 2, 5 );
+    m_scene.add_sphere( Vector( 5, -2, -4 ), 2, m9 );
+    //m_scene.add_sphere( Vector( 0, -2, -box_size / 2 + 4.5 ), 1.5, 6 );
 
-    //objects.push_back( new ObjectSphere( Vector( 1.5, 1.5, -box_size / 2 + 2 ), 2, m6 ) );
-    objects.push_back( new ObjectSphere( Vector( 5, -2, -4 ), 2, m9 ) );
-    //objects.push_back( new ObjectSphere( Vector( 0, -2, -box_size / 2 + 4.5 ), 1.5, m7 ) );
+    uint32_t side = ( uint32_t )ceil( sqrt( ( double )m_settings.scatter ) );
+    uint32_t scatter_materials[ 4 ] = { m2, m3, m4, m5 };
+    for( uint32_t i = 0; i < m_settings.scatter; i++ )
+    {
+        float step = ( box_size - 2.0f ) / side;
+        Vector center( -box_size / 2.0f + 1.0f + step * ( i % side + 0.5f ), -box_size / 2.0f + 1.0f + step * ( i / side + 0.5f ),
+                       -box_size / 2.0f + step * 0.3f );
+        m_scene.add_sphere( center, step * 0.3f, scatter_materials[ i % 4 ] );
+    }
 
-    float x = 0.0f, y = 0.0f;
     float light_intensity = 0.2f;
-    //for( x = 0; x < 1; x += 0.2f )
-    //    for( y = 0; y < 1; y += 0.2f )
-        {
-            lights.push_back( ObjectLight( Vector( x + 2.0f, -4.0f + y, 2.0f ), Color( light_intensity ), 15.0f ) );
-            lights.push_back( ObjectLight( Vector( x + 4.0f, y + 4.0f, 3.0f ), Color( light_intensity ), 15.0f ) );
-        }
+    Vector centers[ 2 ] = { Vector( 2.0f, -4.0f, 2.0f ), Vector( 4.0f, 4.0f, 3.0f ) };
+    for( int i = 0; i < 2; i++ )
+    {
+        if ( m_settings.rect_lights )
+            lights.push_back( ObjectLight::Rect( centers[ i ], Vector( 0.5f, 0.0f, 0.0f ), Vector( 0.0f, 0.5f, 0.0f ),
+                                                 Color( light_intensity ), 15.0f ) );
+        else
+            lights.push_back( ObjectLight::Sphere( centers[ i ], 0.5f, Color( light_intensity ), 15.0f ) );
+    }
+}
+
+template< uint32_t F >
+void RayTracer::init_shaders()
+{
+    m_shaders[ F ] = &RayTracer::shade< F >;
+    init_shaders< F + 1 >();
+}
+
+template<>
+void RayTracer::init_shaders< MATERIAL_FEATURES >()
+{
 }
 
-RayTracer::RayTracer( size_t width, size_t height )
-	: m_tasks_count( 0 )
+//Системы общие для процесса и настраиваются первым RayTracer. Повторная инициализация из
+//конструктора на другом потоке ( задания --jobs ) перестраивала бы таблицы и список узлов под
+//уже идущим рендерингом. s_systems - настройки, с которыми они построены
+static std::once_flag s_systems_once;
+static render_settings_t s_systems;
+
+static void init_systems( const render_settings_t & settings )
 {
+	TRACE_SCOPE( "init systems" );
+	s_systems = settings;
+	InitMathSystem( MATH_QUALITY );
 	InitTextureSystem( 2.2f );
+	InitTextureCacheSystem( settings.texture_cache, 2.2f );
+	InitSamplerSystem( settings.sampler, settings.seed );
+	InitNumaSystem();
+}
 
-	prepare_scene();
+RayTracer::RayTracer( const render_settings_t & settings )
+	: m_settings( settings ), m_shadow_cache( SHADOW_CACHE_RESOLUTION ), m_band_y( 0 ), m_band_rows( 0 ), m_developed( false ),
+	  m_temporal( false ), m_reused( 0 ), m_gbuffer_ready( false ), m_visibility_cached( 0 ), m_tasks_count( 0 ), m_tiles_total( 0 ), m_deadline( 0.0 ), m_cancel( false ),
+	  m_threads( THREADS, NULL ), m_tile_size( TILE_SIZE ), m_fingerprint( 0 ), m_rays( 0 ), m_quiet( false )
+{
+	std::call_once( s_systems_once, init_systems, std::cref( settings ) );
+	if ( settings.sampler != s_systems.sampler || settings.seed != s_systems.seed ||
+		 settings.texture_cache != s_systems.texture_cache )
+		printf( "Sampler, seed and texture cache are shared by the process, keeping those of the first renderer\n" );
 
-	m_buf_size = width * height;
-	m_image.height = height;
-	m_image.width = width;
-	m_image.image = new Color[ m_buf_size ];
+	init_shaders< 0 >();
+	{
+		TRACE_SCOPE( "scene build" );
+		if ( !settings.scene_cache.empty() && m_scene_cache.load( settings.scene_cache, m_scene, lights ) )
+			printf( "Scene mapped from %s\n", settings.scene_cache.c_str() );
+		else if ( m_scene.attach_static( lights ) )
+			printf( "Scene compiled in\n" );
+		else
+			prepare_scene();
+	}
+
+	//отпечаток запеченного освещения считается по геометрии, до ее выгрузки пейджером
+	if ( !settings.lightmap.empty() && m_lightmap.load( settings.lightmap, m_scene, lights ) )
+		printf( "Direct lighting baked in %s\n", settings.lightmap.c_str() );
+	m_fingerprint = Lightmap::fingerprint( m_scene, lights );
+
+	if ( !settings.geometry_file.empty() )
+	{
+		if ( m_pager.open( settings.geometry_file, settings.geometry_cache ) )
+		{
+			m_scene.clear_geometry();
+			printf( "Geometry paged from %s, cache %zu MB\n", settings.geometry_file.c_str(), settings.geometry_cache >> 20 );
+		}
+		else
+			printf( "can't open geometry %s, using scene geometry\n", settings.geometry_file.c_str() );
+	}
+
+	//каждую копию сцены создает поток, привязанный к своему узлу, страницы копии
+	//выделяются в памяти этого узла
+	const std::vector< numa_node_t > & nodes = numa_nodes();
+	m_tasks.resize( settings.numa ? nodes.size() : 1 );
+	if ( settings.numa )
+	{
+		m_replicas.resize( nodes.size(), NULL );
+		std::vector< std::thread > workers;
+		for( size_t n = 0; n < nodes.size(); n++ )
+			workers.push_back( std::thread( &RayTracer::replicate_scene, this, n ) );
+		for( size_t n = 0; n < workers.size(); n++ )
+			workers[ n ].join();
+		printf( "NUMA nodes %zu, scene replicated per node\n", nodes.size() );
+	}
+
+	size_t width = settings.width;
+	size_t height = settings.height;
+	if ( !settings.stream_file.empty() )
+	{
+		m_settings.progressive = false;
+		m_settings.preview = false;
+		m_settings.temporal = false;
+		m_settings.relight = false;
+		if ( m_settings.denoise )
+			printf( "Denoising is not supported with streaming output, disabled\n" );
+		m_settings.denoise = false;
+	}
 
 	float aspectRatio = ( float )width / ( float )height;
 	m_cameraPos = Vector( 17.0f, 0.0f, 0.0f );
@@ -78,207 +190,1309 @@ RayTracer::RayTracer( size_t width, size_t height )
 					  	  Vector( f, -viewportWidth / 2.0f, -viewportHeight / 2.0f ),
 					  	  Vector( f,  viewportWidth / 2.0f, -viewportHeight / 2.0f ) );
 
-	m_aaSamples = 1;
+	m_aaSamples = std::max< uint32_t >( settings.samples, 1 );
+	if ( !settings.tuning_file.empty() && load_tuning() )
+		printf( "Tuning from %s: threads %zu, tile %u\n", settings.tuning_file.c_str(), m_threads.size(), m_tile_size );
+	//высота полосы зависит от числа потоков, заданного настройками
+	init_framebuffer();
+}
 
-	//
+void RayTracer::init_framebuffer()
+{
+	size_t width = m_settings.width;
+	size_t height = m_settings.height;
+	m_band_rows = height;
+	if ( !m_settings.stream_file.empty() )
+	{
+		size_t tiles_x = ( width + TILE_SIZE - 1 ) / TILE_SIZE;
+		size_t band_tiles = STREAM_BAND_TILES_PER_THREAD * m_threads.size();
+		size_t tile_rows = std::max< size_t >( ( band_tiles + tiles_x - 1 ) / tiles_x, 1 );
+		m_band_rows = std::min( height, tile_rows * TILE_SIZE );
+	}
+	m_framebuffer.init( width, m_band_rows, m_tile_size, FRAMEBUFFER_LAYOUT, FRAMEBUFFER_FORMAT, m_settings.numa );
+	resize_aux( width * m_band_rows );
+}
 
+//машина: имя хоста, модель процессора и число логических процессоров, без пробелов
+static std::string host_key()
+{
+	char name[ 256 ] = "unknown";
+	gethostname( name, sizeof( name ) - 1 );
+	std::string model = "cpu";
+	FILE * f = fopen( "/proc/cpuinfo", "r" );
+	if ( f )
+	{
+		char line[ 512 ];
+		while( fgets( line, sizeof( line ), f ) )
+		{
+			const char * colon = strchr( line, ':' );
+			if ( !strncmp( line, "model name", 10 ) && colon )
+			{
+				model = colon + 1;
+				break;
+			}
+		}
+		fclose( f );
+	}
+	char count[ 32 ];
+	snprintf( count, sizeof( count ), "%u", std::thread::hardware_concurrency() );
+	std::string key = std::string( name ) + "/" + model + "/" + count;
+	std::string ret;
+	for( size_t i = 0; i < key.size(); i++ )
+	{
+		if ( isspace( ( unsigned char )key[ i ] ) )
+		{
+			if ( !ret.empty() && ret[ ret.size() - 1 ] != '_' && ret[ ret.size() - 1 ] != '/' )
+				ret += '_';
+			continue;
+		}
+		if ( key[ i ] == '/' && !ret.empty() && ret[ ret.size() - 1 ] == '_' )
+			ret.erase( ret.size() - 1 );
+		ret += key[ i ];
+	}
+	return ret;
+}
+
+//Файл настроек автотюнинга: строка на машину и сцену,
+//"<машина> <отпечаток сцены> <потоков> <сторона тайла> <лучей в секунду>"
+struct tuning_entry_t
+{
+	std::string host;
+	uint64_t    fingerprint;
+	uint32_t    threads;
+	uint32_t    tile_size;
+	double      rate;
+};
+
+static std::vector< tuning_entry_t > read_tuning( const std::string & file_name )
+{
+	std::vector< tuning_entry_t > entries;
+	FILE * f = fopen( file_name.c_str(), "r" );
+	if ( !f )
+		return entries;
+	char host[ 512 ];
+	unsigned long long fingerprint;
+	tuning_entry_t e;
+	while( fscanf( f, "%511s %llx %u %u %lf", host, &fingerprint, &e.threads, &e.tile_size, &e.rate ) == 5 )
+	{
+		e.host = host;
+		e.fingerprint = fingerprint;
+		entries.push_back( e );
+	}
+	fclose( f );
+	return entries;
+}
+
+bool RayTracer::load_tuning()
+{
+	std::vector< tuning_entry_t > entries = read_tuning( m_settings.tuning_file );
+	std::string host = host_key();
+	for( size_t i = entries.size(); i-- > 0; )
+		if ( entries[ i ].host == host && entries[ i ].fingerprint == m_fingerprint )
+		{
+			set_tuning( entries[ i ].threads, entries[ i ].tile_size );
+			return true;
+		}
+	return false;
+}
+
+void RayTracer::set_tuning( uint32_t threads, uint32_t tile_size )
+{
+	//номер потока хранится в uint8_t
+	m_threads.assign( std::min< uint32_t >( std::max< uint32_t >( threads, 1 ), 255 ), NULL );
+	m_tile_size = PREVIEW_STRIDE;
+	while( m_tile_size * 2 <= std::min< uint32_t >( tile_size, TILE_SIZE ) )
+		m_tile_size *= 2;
+}
+
+//Сетка: число логических процессоров, вдвое меньше и вдвое больше, и THREADS; тайлы от TILE_SIZE
+//до PREVIEW_STRIDE, с меньшими растут накладные расходы на тайл. Калибровка идет обычным рендерингом кадра в
+//низком разрешении, режимы, которые меняют работу между кадрами ( история, G-буфер ), на время
+//выключаются, их буферы сбрасываются
+autotune_result_t RayTracer::autotune()
+{
+	TRACE_SCOPE( "autotune" );
+	render_settings_t saved = m_settings;
+	uint32_t saved_threads = m_threads.size();
+	uint32_t saved_tile_size = m_tile_size;
+	m_settings.progressive = false;
+	m_settings.preview = false;
+	m_settings.temporal = false;
+	m_settings.relight = false;
+	m_settings.stream_file.clear();
+	m_settings.snapshot_prefix.clear();
+	m_settings.time_budget = 0.0;
+	m_settings.width = std::min< size_t >( AUTOTUNE_WIDTH, saved.width );
+	m_settings.height = std::max< size_t >( saved.height * m_settings.width / saved.width, 1 );
+	m_history.clear();
+	m_gbuffer.clear();
+	m_gbuffer_ready = false;
+	m_quiet = true;
+
+	uint32_t cpus = std::max< uint32_t >( std::thread::hardware_concurrency(), 1 );
+	uint32_t grid[ 4 ] = { std::max< uint32_t >( cpus / 2, 1 ), cpus, cpus * 2, THREADS };
+	std::vector< uint32_t > threads( grid, grid + 4 );
+	std::sort( threads.begin(), threads.end() );
+	threads.erase( std::unique( threads.begin(), threads.end() ), threads.end() );
+
+	tuning_entry_t best;
+	best.host = host_key();
+	best.fingerprint = m_fingerprint;
+	best.threads = m_threads.size();
+	best.tile_size = m_tile_size;
+	best.rate = 0.0;
+	//калибровочный рендеринг без ограничения времени неполон только после cancel()
+	bool cancelled = false;
+	for( size_t t = 0; t < threads.size() && !cancelled; t++ )
+		for( uint32_t tile_size = TILE_SIZE; tile_size >= PREVIEW_STRIDE && !cancelled; tile_size /= 2 )
+		{
+			set_tuning( threads[ t ], tile_size );
+			init_framebuffer();
+			double rate = 0.0;
+			for( uint32_t r = 0; r < AUTOTUNE_REPEATS && !cancelled; r++ )
+			{
+				render_stats_t stats = render();
+				cancelled = !stats.complete;
+				if ( !cancelled && stats.time > 0.0 )
+					rate = std::max( rate, stats.rays / stats.time );
+			}
+			if ( cancelled )
+				break;
+			printf( "Autotune threads %u, tile %u: %.0f rays/s\n", threads[ t ], tile_size, rate );
+			if ( rate > best.rate )
+			{
+				best.threads = threads[ t ];
+				best.tile_size = tile_size;
+				best.rate = rate;
+			}
+		}
+
+	m_quiet = false;
+	m_settings = saved;
+	if ( cancelled )
+	{
+		set_tuning( saved_threads, saved_tile_size );
+		init_framebuffer();
+		printf( "Autotune cancelled, keeping threads %u, tile %u\n", saved_threads, saved_tile_size );
+		return AUTOTUNE_CANCELLED;
+	}
+	set_tuning( best.threads, best.tile_size );
+	init_framebuffer();
+	printf( "Autotune best: threads %u, tile %u, %.0f rays/s\n", best.threads, best.tile_size, best.rate );
+	if ( m_settings.tuning_file.empty() || best.rate <= 0.0 )
+		return AUTOTUNE_NOT_SAVED;
+
+	//прежняя запись для этой машины и сцены заменяется
+	std::vector< tuning_entry_t > entries = read_tuning( m_settings.tuning_file );
+	FILE * f = fopen( m_settings.tuning_file.c_str(), "w" );
+	if ( !f )
+		return AUTOTUNE_NOT_SAVED;
+	entries.push_back( best );
+	for( size_t i = 0; i < entries.size(); i++ )
+	{
+		const tuning_entry_t & e = entries[ i ];
+		if ( i + 1 < entries.size() && e.host == best.host && e.fingerprint == best.fingerprint )
+			continue;
+		fprintf( f, "%s %016llx %u %u %.0f\n", e.host.c_str(), ( unsigned long long )e.fingerprint, e.threads, e.tile_size, e.rate );
+	}
+	return fclose( f ) == 0 ? AUTOTUNE_SAVED : AUTOTUNE_NOT_SAVED;
+}
+
+void RayTracer::replicate_scene( size_t node )
+{
+	pin_current_thread( numa_nodes()[ node ].cpus[ 0 ] );
+	TRACE_SCOPE( "scene replicate" );
+	m_replicas[ node ] = m_scene.replicate();
+}
+
+static double now()
+{
 	timespec tp;
-	double startTime, endTime;
+	clock_gettime( CLOCK_MONOTONIC, &tp );
+	return tp.tv_sec + tp.tv_nsec / 1000000000.0;
+}
+
+void RayTracer::clear_framebuffer()
+{
+	if ( m_settings.numa )
+	{
+		//обнуление тайлов теми же потоками на тех же узлах, что будут их рендерить
+		m_pass = pass_t();
+		m_pass.clear = true;
+		run_pass();
+	}
+	else
+		m_framebuffer.clear();
+}
+
+//Прогрессивный режим: сначала проходы по разреженным сеткам пикселей с шагом PROGRESSIVE_STRIDE, ...,
+//2, 1 ( по одной выборке, каждый пиксель трассируется один раз ), затем проходы, удваивающие число
+//выборок на пиксель. Рендеринг останавливается по истечении time_budget или по cancel(), в
+//фреймбуфере всегда лежит лучшее на этот момент изображение
+render_stats_t RayTracer::render()
+{
+	//при подкачке геометрии примитивов в сцене нет; карты строятся один раз и после сдвига источника
+	if ( SHADOW_CACHE_RESOLUTION && !m_pager.is_open() )
+		m_shadow_cache.build( m_scene, lights );
+	if ( !m_settings.stream_file.empty() )
+		return render_stream();
+
+	std::vector< pass_t > passes;
+	if ( m_settings.preview )
+	{
+		passes.push_back( pass_t() );
+		passes.back().preview = true;
+	}
+	else if ( m_settings.progressive )
+	{
+		for( uint32_t stride = PROGRESSIVE_STRIDE; stride >= 1; stride /= 2 )
+			passes.push_back( pass_t( stride, stride < PROGRESSIVE_STRIDE ? stride * 2 : 0, 0, 1 ) );
+		for( uint32_t spp = 1; spp < m_aaSamples; spp *= 2 )
+			passes.push_back( pass_t( 1, 0, spp, std::min( spp, m_aaSamples - spp ) ) );
+	}
+	else
+		passes.push_back( pass_t( 1, 0, 0, m_aaSamples ) );
+
+	double startTime = now();
+	m_deadline = 0.0;
+	//cancel() прерывает только текущий рендеринг
+	m_cancel = false;
+	clear_framebuffer();
+	m_deadline = m_settings.time_budget > 0.0 ? startTime + m_settings.time_budget : 0.0;
+	m_rays = 0;
+	std::fill( m_aux.begin(), m_aux.end(), aux_pixel_t() );
+	size_t pixels = ( size_t )m_framebuffer.width() * m_framebuffer.height();
+	//история пишется только за один полный проход всеми выборками
+	m_temporal = m_settings.temporal && !m_settings.relight && !m_settings.preview && !m_settings.progressive &&
+				 lights.size() <= TEMPORAL_MAX_LIGHTS;
+	if ( m_settings.relight && !m_settings.preview && m_gbuffer.size() != pixels )
+	{
+		m_gbuffer.assign( pixels, gbuffer_pixel_t() );
+		m_gbuffer_ready = false;
+	}
+	m_reused = 0;
+	if ( m_temporal )
+		m_next_history.assign( pixels, history_pixel_t() );
+
+	render_stats_t stats;
+	for( size_t p = 0; p < passes.size(); p++ )
+	{
+		if ( stopped() )
+			break;
 
-	clock_gettime( CLOCK_REALTIME, &tp );
-	startTime = tp.tv_sec + tp.tv_nsec / 1000000000.0;
+		m_pass = passes[ p ];
+		if ( !run_pass() )
+			break;
 
+		stats.passes++;
+		if ( !m_settings.snapshot_prefix.empty() && p + 1 < passes.size() )
+		{
+			char file_name[ 256 ];
+			snprintf( file_name, sizeof( file_name ), "%s%02zu.png", m_settings.snapshot_prefix.c_str(), p );
+			save( file_name );
+		}
+	}
+
+	stats.time = now() - startTime;
+	stats.complete = stats.passes == passes.size();
+	//пиксели, до которых не дошел прерванный кадр, остаются недействительными
+	//неполный G-буфер дописывается следующим рендерингом
+	if ( m_settings.relight && !m_settings.preview && stats.complete )
+	{
+		m_gbuffer_ready = true;
+		m_visibility_cached = lights.size() <= RELIGHT_MAX_LIGHTS ? ( uint32_t )( ( 1ull << lights.size() ) - 1 ) : 0;
+	}
+	if ( m_temporal )
+	{
+		m_history.swap( m_next_history );
+		m_history_camera = m_cameraPos;
+		m_history_viewport = m_viewport;
+	}
+
+	m_framebuffer.resolve( m_image );
+	m_developed = false;
+	stats.min_samples = ~0u;
+	double total = 0.0;
+	for( size_t i = 0; i < m_image.width * m_image.height; i++ )
+	{
+		stats.min_samples = std::min< uint32_t >( stats.min_samples, m_image.image[ i ].a );
+		total += m_image.image[ i ].a;
+	}
+	stats.mean_samples = total / ( m_image.width * m_image.height );
+	stats.rays = m_rays;
+	if ( m_quiet )
+		return stats;
+
+	printf( "Render time: %g, %.0f rays/s\n", stats.time, stats.rays / stats.time );
+	printf( "Passes %u/%zu, samples per pixel min %u mean %g%s\n", stats.passes, passes.size(),
+			stats.min_samples, stats.mean_samples, stats.complete ? "" : " ( stopped early )" );
+	if ( m_temporal )
+		printf( "Temporal reuse %zu of %zu pixels\n", m_reused.load(), ( size_t )m_image.width * m_image.height );
+	if ( m_pager.is_open() )
+		m_pager.print_stats();
+	if ( texture_cache_enabled() )
+		print_texture_cache_stats();
+	return stats;
+}
+
+//Полосы рендерятся по очереди одним проходом со всеми выборками. Готовая полоса проявляется,
+//проходит постобработку и отдается потоку записи, который сжимает ее в PNG, пока рендерится
+//следующая; в памяти фреймбуфер полосы, ее копия и два буфера RGB. После остановки по времени
+//или cancel() оставшиеся полосы записываются черными, файл остается корректным
+render_stats_t RayTracer::render_stream()
+{
+	TRACE_SCOPE( "stream render" );
+	size_t width = m_framebuffer.width();
+	size_t height = m_settings.height;
+	render_stats_t stats;
+	double startTime = now();
+	PngWriter writer;
+	if ( writer.open( m_settings.stream_file, width, height ) )
+	{
+		printf( "can't write %s\n", m_settings.stream_file.c_str() );
+		return stats;
+	}
+
+	PostProcess post( m_settings.post );
+	std::vector< uint8_t > rgb[ 2 ];
+	std::thread write_thread;
+	image_t band;
+	m_deadline = m_settings.time_budget > 0.0 ? startTime + m_settings.time_budget : 0.0;
+	m_cancel = false;
+	m_rays = 0;
+	stats.min_samples = ~0u;
+	double total = 0.0;
+	size_t bands = 0;
+	for( m_band_y = 0; m_band_y < height; m_band_y += m_band_rows, bands++ )
+	{
+		//последняя полоса может быть ниже остальных
+		size_t rows = std::min( m_band_rows, height - m_band_y );
+		if ( rows != m_framebuffer.height() )
+		{
+			m_framebuffer.init( width, rows, m_tile_size, FRAMEBUFFER_LAYOUT, FRAMEBUFFER_FORMAT, m_settings.numa );
+			resize_aux( width * rows );
+		}
+		double deadline = m_deadline;
+		m_deadline = 0.0;
+		clear_framebuffer();
+		m_deadline = deadline;
+		std::fill( m_aux.begin(), m_aux.end(), aux_pixel_t() );
+
+		m_pass = pass_t( 1, 0, 0, m_aaSamples );
+		if ( !stopped() && run_pass() )
+			stats.passes++;
+
+		develop( band );
+		for( size_t i = 0; i < band.width * band.height; i++ )
+		{
+			stats.min_samples = std::min< uint32_t >( stats.min_samples, band.image[ i ].a );
+			total += band.image[ i ].a;
+		}
+		//полосы начинаются со строк, кратных TILE_SIZE, фаза матрицы дизеринга совпадает с целым кадром
+		std::vector< uint8_t > & out = rgb[ bands & 1 ];
+		out.resize( width * rows * 3 );
+		post.run( band, &out[ 0 ], m_threads.size() );
+		if ( write_thread.joinable() )
+			write_thread.join();
+		write_thread = std::thread( &PngWriter::write_rows, &writer, &out[ 0 ], ( uint32_t )rows );
+	}
+	if ( write_thread.joinable() )
+		write_thread.join();
+	m_band_y = 0;
+	if ( writer.close() )
+		printf( "can't write %s\n", m_settings.stream_file.c_str() );
+
+	stats.time = now() - startTime;
+	stats.complete = stats.passes == bands;
+	stats.mean_samples = total / ( ( double )width * height );
+	stats.rays = m_rays;
+	printf( "Render time: %g, %.0f rays/s\n", stats.time, stats.rays / stats.time );
+	printf( "Bands %u/%zu of %zu rows streamed to %s, samples per pixel min %u mean %g%s\n", stats.passes, bands,
+			m_band_rows, m_settings.stream_file.c_str(), stats.min_samples, stats.mean_samples,
+			stats.complete ? "" : " ( stopped early )" );
+	if ( m_pager.is_open() )
+		m_pager.print_stats();
+	if ( texture_cache_enabled() )
+		print_texture_cache_stats();
+	return stats;
+}
+
+//false, если проход прерван до обработки всех тайлов
+bool RayTracer::run_pass()
+{
+	TRACE_SCOPE( m_pass.clear ? "first touch pass" : "pass" );
 	start_ray_tracing();
 
-	for( size_t i = 0; i < THREADS; i++ )
-		m_threads[ i ] = new std::thread( &RayTracer::thread, this, i );
+	if ( m_settings.scheduler )
+		m_settings.scheduler->run( *this, m_settings.priority, m_settings.weight );
+	else
+	{
+		for( size_t i = 0; i < m_threads.size(); i++ )
+			m_threads[ i ] = new std::thread( &RayTracer::thread, this, i );
+
+		for( size_t i = 0; i < m_threads.size(); i++ )
+		{
+			m_threads[ i ]->join();
+			delete m_threads[ i ];
+		}
+	}
+
+	bool complete = m_tasks_count == 0;
+	for( size_t n = 0; n < m_tasks.size(); n++ )
+		m_tasks[ n ].clear();
+	m_tasks_count = 0;
+	return complete;
+}
+
+const Scene & RayTracer::scene() const
+{
+	return t_scene ? *t_scene : m_scene;
+}
+
+void RayTracer::cancel()
+{
+	m_cancel = true;
+}
+
+void RayTracer::set_camera( const Vector & position )
+{
+	Vector delta = position - m_cameraPos;
+	m_cameraPos = position;
+	m_viewport = Viewport( m_viewport.m_p1 + delta, m_viewport.m_p2 + delta, m_viewport.m_p3 + delta, m_viewport.m_p4 + delta );
+	m_gbuffer_ready = false;
+}
+
+void RayTracer::invalidate_history()
+{
+	m_history.clear();
+}
+
+void RayTracer::set_light( size_t index, const ObjectLight & light )
+{
+	const ObjectLight & old = lights[ index ];
+	bool moved = old.m_type != light.m_type || old.m_sphere_radius != light.m_sphere_radius;
+	const Vector * a[ 3 ] = { &old.m_center, &old.m_u, &old.m_v };
+	const Vector * b[ 3 ] = { &light.m_center, &light.m_u, &light.m_v };
+	for( int k = 0; k < 3; k++ )
+		moved = moved || a[ k ]->x != b[ k ]->x || a[ k ]->y != b[ k ]->y || a[ k ]->z != b[ k ]->z;
+	//цвет и радиус затухания на тени не влияют
+	if ( moved && index < RELIGHT_MAX_LIGHTS )
+		m_visibility_cached &= ~( 1u << index );
+	if ( moved )
+		m_shadow_cache.invalidate( index );
+	lights[ index ] = light;
+	m_lightmap.clear();
+	invalidate_history();
+}
+
+void RayTracer::set_material( uint32_t index, const Material & material )
+{
+	m_scene.set_material( index, material );
+	for( size_t n = 0; n < m_replicas.size(); n++ )
+		if ( m_replicas[ n ] )
+			m_replicas[ n ]->set_material( index, material );
+	invalidate_history();
+}
+
+bool RayTracer::stopped() const
+{
+	return m_cancel || ( m_deadline > 0.0 && now() > m_deadline );
+}
+
+//Переводит накопленные средние в изображение: пиксели, до которых не дошел прерванный
+//прогрессивный рендеринг, берутся из ближайшего узла более грубой сетки. Изображение остается
+//линейным, тональная компрессия и гамма - в PostProcess при сохранении
+void RayTracer::develop( image_t & image )
+{
+	TRACE_SCOPE( "develop" );
+	m_framebuffer.resolve( image );
+	//в предпросмотре признаки есть только в узлах адаптивной сетки
+	bool denoise = m_settings.denoise && !m_settings.preview && !m_aux.empty();
+	//m_aux копируется, только если есть пропуски: заполненные признаки нужны одному этому снимку
+	std::vector< aux_pixel_t > filled;
+	for( size_t y = 0; y < image.height; y++ )
+		for( size_t x = 0; x < image.width; x++ )
+		{
+			size_t i = y * image.width + x;
+			for( size_t stride = 2; image.image[ i ].a == 0.0f && stride <= PROGRESSIVE_STRIDE; stride *= 2 )
+			{
+				size_t node = ( y & ~( stride - 1 ) ) * image.width + ( x & ~( stride - 1 ) );
+				image.image[ i ] = image.image[ node ];
+				if ( !denoise )
+					continue;
+				if ( filled.empty() )
+					filled = m_aux;
+				filled[ i ] = filled[ node ];
+			}
+		}
+
+	if ( denoise )
+	{
+		TRACE_SCOPE( "denoise" );
+		Denoiser denoiser( DENOISE_ITERATIONS, DENOISE_SIGMA_COLOR, DENOISE_SIGMA_NORMAL, DENOISE_SIGMA_DEPTH );
+		denoiser.run( image, filled.empty() ? &m_aux[ 0 ] : &filled[ 0 ], m_threads.size() );
+	}
+}
+
+int RayTracer::save( const std::string & file_name )
+{
+	develop( m_image );
+	m_developed = true;
+	return save_graded_png( file_name, m_image, m_settings.post, m_threads.size() );
+}
+
+int RayTracer::save_linear( const std::string & file_name )
+{
+	if ( !m_developed )
+		develop( m_image );
+	m_developed = true;
+	return save_pfm( file_name, m_image );
+}
 
-	for( size_t i = 0; i < THREADS; i++ )
-		m_threads[ i ]->join();
+bool RayTracer::compile_scene( const std::string & file_name ) const
+{
+	return SceneCache::write( file_name, m_scene, lights );
+}
 
-	clock_gettime( CLOCK_REALTIME, &tp );
-	endTime = tp.tv_sec + tp.tv_nsec / 1000000000.0;
+//имя структуры - имя файла без каталога и расширения, не подходящие для идентификатора символы заменяются на _
+bool RayTracer::compile_scene_header( const std::string & file_name ) const
+{
+	size_t begin = file_name.find_last_of( '/' );
+	begin = begin == std::string::npos ? 0 : begin + 1;
+	std::string name = file_name.substr( begin, file_name.find_last_of( '.' ) - begin );
+	for( size_t i = 0; i < name.size(); i++ )
+		if ( !isalnum( ( unsigned char )name[ i ] ) )
+			name[ i ] = '_';
+	if ( name.empty() || isdigit( ( unsigned char )name[ 0 ] ) )
+		name = "scene_" + name;
+	return StaticScene::write( file_name, name, m_scene, lights );
+}
 
-	double renderTime = endTime - startTime;
-	printf( "Render time: %g\n", renderTime );
+bool RayTracer::compile_geometry( const std::string & file_name ) const
+{
+	return GeometryPager::write( file_name, m_scene, GEOMETRY_CHUNK_PRIMITIVES );
+}
 
-	save_png( "out.png", m_image, 2.2f );
+bool RayTracer::bake_lighting( const std::string & file_name )
+{
+	return m_lightmap.bake( m_scene, lights, LIGHTMAP_DENSITY, m_threads.size() ) && m_lightmap.write( file_name );
 }
 
 RayTracer::~RayTracer()
 {
-//    delete[] buf;
-//
-//    for( auto ptr : objects )
-//    	delete ptr;
+	for( size_t n = 0; n < m_replicas.size(); n++ )
+		delete m_replicas[ n ];
 }
 
-Color RayTracer::ray_tracing( const Ray& ray, const int& depth, int& rays_count, float* distance )
+bool RayTracer::intersect( const Ray & ray, Intersection & intersection )
 {
-	Color ret;
+	if ( m_pager.is_open() )
+		return m_pager.intersect( ray, intersection, t_missing );
+	return scene().intersect( ray, intersection );
+}
 
-    if ( depth == MAX_DEPTH )
-        return ret;
+bool RayTracer::intersect_primary( const Ray & ray, Intersection & intersection )
+{
+	if ( t_candidates )
+		return scene().intersect( *t_candidates, ray, intersection );
+	return intersect( ray, intersection );
+}
 
-    Intersection intr;
-    Ray reflectRay;
-    Ray refractRay;
-    float reflectAmount;
+//лучи выборок тайла проходят через пиксели [ x, x + width ) x [ y, y + height ), узлы предпросмотра -
+//еще через пиксель справа и снизу
+void RayTracer::cull_tile( const tile_t & tile, CandidateSet & set ) const
+{
+	float x0 = tile.x - 1.0f;
+	float y0 = m_band_y + tile.y - 1.0f;
+	float x1 = tile.x + tile.width + 1.0f;
+	float y1 = m_band_y + tile.y + tile.height + 1.0f;
+	Vector corners[ 4 ] = { viewport_point( x0, y0 ), viewport_point( x1, y0 ), viewport_point( x1, y1 ), viewport_point( x0, y1 ) };
+	scene().cull( m_cameraPos, corners, set );
+}
 
-    size_t i_object = ~0;
-    float distance2obj = INFINITY;
-    for( size_t i = 0; i < objects.size(); i++ )
+bool RayTracer::occluded( const Vector & point, const Vector & target, const CandidateSet * occluders )
+{
+	if ( m_pager.is_open() )
+		return m_pager.occluded( Ray( target, point ), point.distance( target ), t_missing );
+	if ( occluders )
+		return scene().occluded( *occluders, Ray( target, point ), point.distance( target ) );
+	return scene().occluded( Ray( target, point ), point.distance( target ) );
+}
+
+//Вызывается между begin_trace() и end_trace() пейджера, на время загрузки трассировка потока
+//выходит из-под read lock. Загруженные чанки закреплены до конца тайла, поэтому повторная
+//трассировка отложенных выборок каждый раз продвигается дальше
+bool RayTracer::fetch_missing()
+{
+	TRACE_SCOPE( "geometry fetch" );
+	m_pager.end_trace();
+	bool ok = m_pager.load( t_missing, t_pinned );
+	t_missing.clear();
+	m_pager.begin_trace();
+	return ok;
+}
+
+float RayTracer::light_visibility( size_t index, const Vector & point, Sampler & sampler )
+{
+	const ObjectLight & light = lights[ index ];
+	//все теневые лучи из point к точкам источника проверяются с одним набором кэша
+	const CandidateSet * occluders = m_shadow_cache.lookup( index, point );
+	if ( !light.is_area() )
+		return occluded( point, light.m_center, occluders ) ? 0.0f : 1.0f;
+
+	//серия берется всегда, чтобы следующие выборки сэмплера не зависели от пути
+	SampleSequence sequence = sampler.get_sequence( AREA_LIGHT_SAMPLES );
+	//большинство точек целиком освещены или целиком в тени, это видно без лучей по набору кэша,
+	//а без кэша - по всей сцене или по загруженным чанкам пейджера
+	shadow_bound_t bound;
+	if ( occluders )
+		bound = scene().shadow_bound( *occluders, point, light.m_center, light.extent() );
+	else if ( m_pager.is_open() )
+		bound = m_pager.shadow_bound( point, light.m_center, light.extent() );
+	else
+		bound = scene().shadow_bound( point, light.m_center, light.extent() );
+	if ( bound != SHADOW_UNKNOWN )
+		return bound == SHADOW_NONE ? 1.0f : 0.0f;
+
+	//точки серии сэмплера стратифицированы: первые AREA_LIGHT_FIRST_SAMPLES лежат по одной в каждой
+	//части источника. Если они согласны, точка целиком освещена или целиком в тени, остальные
+	//выборки трассируются только в полутени
+	uint32_t visible = 0;
+	uint32_t count = 0;
+	for( ; count < AREA_LIGHT_SAMPLES; count++ )
+	{
+		if ( count == AREA_LIGHT_FIRST_SAMPLES && ( visible == 0 || visible == count ) )
+			break;
+		float s, t;
+		sequence.point( count, s, t );
+		if ( !occluded( point, light.sample( point, s, t ), occluders ) )
+			visible++;
+	}
+	return ( float )visible / ( float )count;
+}
+
+Color RayTracer::ray_tracing( const Ray& ray, const int& depth, int& rays_count, Sampler& sampler, Intersection* hit )
+{
+    if ( hit )
     {
-        Intersection in;
-        if ( objects[i]->CheckIntersection( ray, in ) )
-        {
-            float dist = in.point.distance( ray.start_point );
-            if ( dist < distance2obj )
-            {
-                distance2obj = dist;
-                intr = in;
-                i_object = i;
-            }
-        }
+        hit->distance = INFINITY;
+        hit->type = PRIMITIVE_TYPES;
     }
-    if ( i_object == ~0 )
-        return ret;
 
-    reflectRay.start_point = intr.point;
-    refractRay.start_point = intr.point;
+    if ( depth == MAX_DEPTH )
+        return Color();
 
-    objects[ i_object ]->GetReflectRefractVectors( ray, intr, reflectRay.vector, refractRay.vector, reflectAmount );
+    Intersection intr;
+    if ( !( depth == 0 ? intersect_primary( ray, intr ) : intersect( ray, intr ) ) )
+        return Color();
+    //ближе найденного пересечения может лежать незагруженный чанк, выборку все равно повторят
+    if ( !t_missing.empty() )
+        return Color();
 
     rays_count++;
 
-    if ( distance )
-        *distance = distance2obj;
+    if ( hit )
+        *hit = intr;
 
-    int depth_ = depth + 1;
+    const Material & material = scene().material( intr.material );
+    return ( this->*m_shaders[ material.m_features ] )( ray, intr, material, depth + 1, rays_count, sampler );
+}
+
+//Ядро шейдинга для материалов с набором возможностей F. Проверки возможностей - константы
+//времени компиляции, ненужные ветки и вычисления выбрасываются компилятором
+template< uint32_t F >
+Color RayTracer::shade( const Ray& ray, const Intersection& intr, const Material& material, const int& depth_, int& rays_count,
+                        Sampler& sampler )
+{
+    Ray reflectRay;
+    Ray refractRay;
+    float reflectAmount = 1.0f;
+
+    reflectRay.start_point = intr.point;
+    refractRay.start_point = intr.point;
+
+    if ( F & MATERIAL_REFRACTIVE )
+        scene().GetReflectRefractVectors( ray, intr, reflectRay.vector, refractRay.vector, reflectAmount );
+    else
+    {
+        reflectRay.vector = ray.vector.reflect( intr.normal );
+        reflectRay.vector.normalize();
+    }
+
+    //первичное попадание во временном режиме ( ray_tracing с глубиной 0 вызывает ядро с глубиной 1 )
+    const history_pixel_t * reused = depth_ == 1 ? ( const history_pixel_t* )t_reuse : NULL;
+    history_pixel_t * record = depth_ == 1 ? ( history_pixel_t* )t_record : NULL;
+    gbuffer_pixel_t * gbuffer = depth_ == 1 ? ( gbuffer_pixel_t* )t_gbuffer : NULL;
 
     Color diffuse;
     Color specular;
-    for( size_t i = 0; i < lights.size(); i++ )
+    if ( F & ( MATERIAL_DIFFUSE | MATERIAL_SPECULAR ) )
     {
-        float distance2light = lights[ i ].distance( intr.point );
-        Vector fromLight = intr.point - lights[ i ].m_center;
-        Ray to_light( lights[ i ].m_center, intr.point );
-
-        //проверям, в тени какого либо объекта или нет
-        bool i_object_in_shadow = false;
-        for( size_t j = 0; j < objects.size(); j++ )
+        //с запеченным освещением диффузная часть берется из карты целиком, а видимость
+        //источников для бликов - из нее же; так же используется шейдинг прошлого кадра
+        float baked_visibility[ LIGHTMAP_MAX_LIGHTS > TEMPORAL_MAX_LIGHTS ? LIGHTMAP_MAX_LIGHTS : TEMPORAL_MAX_LIGHTS ];
+        bool baked = false;
+        if ( reused )
         {
-            Intersection intr2;
-            if ( objects[ j ]->CheckIntersection( to_light, intr2 ) )
+            diffuse = reused->irradiance;
+            std::copy( reused->visibility, reused->visibility + lights.size(), baked_visibility );
+            baked = true;
+        }
+        else
+            baked = m_lightmap.lookup( intr, diffuse, baked_visibility );
+        for( size_t i = 0; i < lights.size(); i++ )
+        {
+            Vector fromLight = intr.point - lights[ i ].m_center;
+            Ray to_light( lights[ i ].m_center, intr.point );
+
+            //проверям, в тени какого либо объекта или нет
+            //в G-буфере видимость неподвижного источника сохраняется между перезасветками
+            bool cached = !baked && gbuffer && i < RELIGHT_MAX_LIGHTS && ( m_visibility_cached >> i & 1 ) && gbuffer->visibility[ i ] >= 0.0f;
+            float visibility = baked ? baked_visibility[ i ] :
+                               cached ? gbuffer->visibility[ i ] : light_visibility( i, intr.point, sampler );
+            //измерение сэмплера пропускается, чтобы вторичные лучи получили те же выборки, что без истории
+            if ( ( reused || cached ) && lights[ i ].is_area() )
+                sampler.get_sequence( AREA_LIGHT_SAMPLES );
+            if ( gbuffer && i < RELIGHT_MAX_LIGHTS )
+                gbuffer->visibility[ i ] = visibility;
+            if ( record )
+                record->visibility[ i ] = visibility;
+            if ( visibility == 0.0f )
+                continue;
+
+            float attenuation = 1.0f - saturated( fromLight.dot( fromLight ) / lights[ i ].m_radius / lights[ i ].m_radius );
+            if( attenuation < EPSILON )
+                continue;
+
+            if ( ( F & MATERIAL_DIFFUSE ) && !baked )
+            {
+                float angle_cos = to_light.vector.dot( intr.normal );
+                if( angle_cos > 0.0f )
+                    diffuse = diffuse + lights[ i ].m_color * angle_cos * attenuation * visibility;
+            }
+
+            if ( F & MATERIAL_SPECULAR )
             {
-                float distance_ = intr2.point.distance( intr.point );
-                if ( distance_ < distance2light )
-                {
-                    i_object_in_shadow = true;
-                    break;
-                }
+                float angle_cos = to_light.vector.dot( reflectRay.vector );
+                if( angle_cos > 0.0f )
+                    specular = specular + lights[ i ].m_color * material.phong( angle_cos ) * attenuation * visibility;
             }
         }
-        if ( i_object_in_shadow )
-            continue;
-
-        float attenuation = 1.0f - saturated( fromLight.dot( fromLight ) / lights[ i ].m_radius / lights[ i ].m_radius );
-        if( attenuation < EPSILON )
-        	continue;
-
-        float angle_cos = to_light.vector.dot( intr.normal );
-        if( angle_cos > 0.0f )
-            if( !objects[ i_object ]->m_material.m_diffuse.is_black() )
-                diffuse = diffuse + lights[ i ].m_color * angle_cos * attenuation;
-
-        angle_cos = to_light.vector.dot( reflectRay.vector );
-        if( angle_cos > 0.0f )
-            if( !objects[ i_object ]->m_material.m_specular.is_black() )
-                specular = specular + lights[ i ].m_color * pow( angle_cos, objects[ i_object ]->m_material.m_phong ) * attenuation;
     }
 
-    float d = 0.0f;
+    if ( record )
+        record->irradiance = diffuse;
+
+    Color ret = material.m_ambient;
 
-    float T = 1.0f - reflectAmount;
+    if ( F & MATERIAL_DIFFUSE )
+    {
+        if ( F & MATERIAL_TEXTURED )
+            ret = ret + material.m_diffuse * diffuse * ( gbuffer ? gbuffer->texel : scene().texel( intr ) );
+        else
+            ret = ret + material.m_diffuse * diffuse;
+    }
 
-    Color reflect_ray_color = ray_tracing( reflectRay, depth_, rays_count, &d );
-    reflect_ray_color = reflect_ray_color * exp( -objects[i_object]->m_material.m_beta ) * reflectAmount;
+    if ( F & MATERIAL_SPECULAR )
+        ret = ret + material.m_specular * specular;
 
-    Color refract_ray_color;
-    if ( objects[i_object]->m_material.m_refract_amount > 0 && T > EPSILON )
-        refract_ray_color = ray_tracing( refractRay, depth_, rays_count, NULL ) * T;
+    if ( F & MATERIAL_REFLECTIVE )
+    {
+        //слабое отражение мало меняется при небольшом сдвиге камеры
+        Color reflect_ray_color;
+        if ( reused && material.m_reflect_factor * reflectAmount <= TEMPORAL_REFLECTION_WEIGHT )
+            reflect_ray_color = reused->reflected;
+        else
+            reflect_ray_color = ray_tracing( reflectRay, depth_, rays_count, sampler, NULL );
+        if ( record )
+            record->reflected = reflect_ray_color;
+        ret = ret + reflect_ray_color * material.m_reflect_factor * reflectAmount;
+    }
 
-    ret = objects[i_object]->m_material.m_ambient +
-          objects[i_object]->m_material.m_diffuse * diffuse * intr.pixel +
-          objects[i_object]->m_material.m_specular * specular +
-            reflect_ray_color +
-            refract_ray_color ;
+    if ( F & MATERIAL_REFRACTIVE )
+    {
+        float T = 1.0f - reflectAmount;
+        if ( T > EPSILON )
+            ret = ret + ray_tracing( refractRay, depth_, rays_count, sampler, NULL ) * T;
+    }
 
     return ret;
 }
 
+//Тайлы делятся между узлами NUMA горизонтальными полосами: строки изображения одной полосы,
+//а значит и страницы фреймбуфера, обрабатывает один узел
 void RayTracer::start_ray_tracing()
 {
-    float step_y = m_viewport.m_p2.y * 2.0f / ( float )m_image.width;
-    int pixel_index = 0;
-    float z = m_viewport.m_p1.z;
+	size_t tile_rows = ( m_framebuffer.height() + m_tile_size - 1 ) / m_tile_size;
+	for( uint32_t y = 0; y < m_framebuffer.height(); y += m_tile_size )
+		for( uint32_t x = 0; x < m_framebuffer.width(); x += m_tile_size )
+		{
+			uint32_t w = std::min< uint32_t >( m_tile_size, m_framebuffer.width() - x );
+			uint32_t h = std::min< uint32_t >( m_tile_size, m_framebuffer.height() - y );
+			size_t node = ( y / m_tile_size ) * m_tasks.size() / tile_rows;
+			m_tasks[ node ].push_back( tile_t( x, y, w, h ) );
+			m_tasks_count++;
+		}
+	m_tiles_total = m_tasks_count;
+}
 
-    for( int xx = 0; xx < m_image.width; xx++ )
-    {
-    	z -= step_y;
+//точка на плоскости экрана, x и y - координаты в пикселях от левого верхнего угла
+Vector RayTracer::viewport_point( const float & x, const float & y ) const
+{
+	float step = ( m_viewport.m_p2.y - m_viewport.m_p1.y ) / ( float )m_framebuffer.width();
+	return Vector( m_viewport.m_p1.x, m_viewport.m_p1.y + x * step, m_viewport.m_p1.z - y * step );
+}
 
-        float y = m_viewport.m_p1.y;
+//экран - плоскость x = m_p1.x, как в viewport_point
+bool RayTracer::project( const Vector & camera, const Viewport & viewport, const Vector & point, float & x, float & y ) const
+{
+	float step = ( viewport.m_p2.y - viewport.m_p1.y ) / ( float )m_framebuffer.width();
+	Vector d = point - camera;
+	float plane = viewport.m_p1.x - camera.x;
+	//точка за камерой или в плоскости камеры
+	if ( d.x * plane <= 0.0f )
+		return false;
+	float t = plane / d.x;
+	x = ( camera.y + d.y * t - viewport.m_p1.y ) / step;
+	y = ( viewport.m_p1.z - camera.z - d.z * t ) / step;
+	return true;
+}
 
-        for( int yy = 0; yy < m_image.height; yy++ )
-        {
-        	y += step_y;
+//Первичный луч через центр пикселя находит точку нового кадра, она проецируется в прошлый кадр.
+//Пиксель прошлого кадра подходит, если он действителен, в нем тот же объект и грань, а точка,
+//в которой был посчитан его шейдинг, лежит на той же глубине и в новом кадре отстоит от центра
+//пикселя не больше temporal_error. Точка переносится в историю без изменений, поэтому
+//погрешность не накапливается от кадра к кадру
+const RayTracer::history_pixel_t * RayTracer::reproject( uint32_t px, uint32_t py, int & rays_count )
+{
+	if ( m_history.empty() )
+		return NULL;
+	Ray ray( viewport_point( px + 0.5f, py + 0.5f ), m_cameraPos );
+	Intersection hit;
+	bool found = intersect_primary( ray, hit );
+	if ( !t_missing.empty() )
+	{
+		t_missing.clear();
+		return NULL;
+	}
+	if ( !found )
+		return NULL;
+	rays_count++;
 
-            //Vector diffs[4] = { Vector( 0, 0, 0 ), Vector( 0, step_y / 2.0f, 0 ), Vector( 0, step_y / 2.0f, step_y / 2.0f ), Vector( 0, 0, step_y / 2.0f ) };
+	size_t width = m_framebuffer.width();
+	size_t height = m_framebuffer.height();
+	float x, y;
+	if ( !project( m_history_camera, m_history_viewport, hit.point, x, y ) || x < 0.0f || y < 0.0f || x >= width || y >= height )
+		return NULL;
+	const history_pixel_t & prev = m_history[ ( size_t )y * width + ( size_t )x ];
+	if ( !prev.valid || prev.object != object_id( hit ) || prev.face != hit.face )
+		return NULL;
 
-            m_image.image[pixel_index] = Color();
+	float rx, ry;
+	if ( !project( m_cameraPos, m_viewport, prev.point, rx, ry ) )
+		return NULL;
+	float ex = rx - ( px + 0.5f );
+	float ey = ry - ( py + 0.5f );
+	if ( ex * ex + ey * ey > m_settings.temporal_error * m_settings.temporal_error )
+		return NULL;
+	if ( fabs( ( prev.point - m_cameraPos ).length() - hit.distance ) > TEMPORAL_DEPTH_TOLERANCE * hit.distance )
+		return NULL;
 
-            Vector viewport_point( m_viewport.m_p1.x, y, z );
-  		   	//viewport_point = viewport_point + diffs[sample];
-            //Ray first_ray( viewport_point, camera_pos );
+	return &prev;
+}
 
-			m_tasks.push_back( thread_task( pixel_index, viewport_point ) );
-			m_tasks_count++;
-            pixel_index++;
-        }
-    }
+void RayTracer::record_history( uint32_t px, uint32_t py, history_pixel_t & record, const Intersection & hit,
+								const history_pixel_t * reused, bool valid )
+{
+	if ( !valid || hit.type == PRIMITIVE_TYPES )
+		return;
+	record.point = reused ? reused->point : hit.point;
+	record.object = object_id( hit );
+	record.face = hit.face;
+	record.valid = true;
+	m_next_history[ ( size_t )py * m_framebuffer.width() + px ] = record;
+	if ( reused )
+		m_reused++;
 }
 
-void RayTracer::thread( uint8_t thread_index )
+void RayTracer::resize_aux( size_t pixels )
 {
-	int rays_count = 0;
-	while( 1 )
+	if ( m_settings.denoise )
+		m_aux.resize( pixels );
+	else
+		std::vector< aux_pixel_t >().swap( m_aux );
+}
+
+void RayTracer::store_aux( uint32_t x, uint32_t y, const Intersection & hit )
+{
+	if ( m_aux.empty() )
+		return;
+	aux_pixel_t & aux = m_aux[ ( ( size_t )y - m_band_y ) * m_framebuffer.width() + x ];
+	aux = aux_pixel_t();
+	if ( hit.type == PRIMITIVE_TYPES )
+		return;
+	//у зеркал и стекла без диффузной части цвет пикселя - отражение сцены, а не шум,
+	//такие пиксели денойзер пропускает
+	if ( !( scene().material( hit.material ).m_features & MATERIAL_DIFFUSE ) )
+		return;
+	aux.albedo = scene().albedo( hit );
+	aux.nx = hit.normal.x;
+	aux.ny = hit.normal.y;
+	aux.nz = hit.normal.z;
+	aux.depth = hit.distance;
+	aux.object = object_id( hit );
+}
+
+Color RayTracer::trace_sample( uint32_t px, uint32_t py, uint32_t sample, Intersection * hit, int & rays_count )
+{
+	//нулевая выборка в центре пикселя, остальные - первое измерение сэмплера
+	Sampler sampler( px, py, sample );
+	float dx, dy;
+	sampler.get_2d( dx, dy );
+	if ( sample == 0 )
+	{
+		dx = 0.5f;
+		dy = 0.5f;
+	}
+	Ray first_ray( viewport_point( px + dx, py + dy ), m_cameraPos );
+	if ( sample != 0 || !m_settings.relight || m_settings.preview || m_gbuffer.empty() )
+		return ray_tracing( first_ray, 0, rays_count, sampler, hit );
+
+	//перезасветка: первичный луч нулевой выборки трассируется только при заполнении G-буфера,
+	//дальше попадание берется из него и шейдится с текущими источниками и материалами
+	gbuffer_pixel_t & g = m_gbuffer[ ( size_t )py * m_framebuffer.width() + px ];
+	if ( !m_gbuffer_ready )
 	{
-		thread_task task;
+		Intersection intr;
+		bool found = intersect_primary( first_ray, intr );
+		if ( !t_missing.empty() )
+			return Color();
+		g = gbuffer_pixel_t();
+		if ( found )
 		{
-			std::lock_guard<std::recursive_mutex> lock( m_mutex );
+			g.hit = intr;
+			g.texel = scene().texel( intr );
+		}
+	}
+	if ( hit )
+		*hit = g.hit;
+	if ( g.hit.type == PRIMITIVE_TYPES )
+		return Color();
 
-			if( m_tasks_count % 10000 == 0 )
-				printf( "thread%u tasks done %u/%u\n", thread_index, m_tasks_count, m_buf_size );
+	rays_count++;
+	const Material & material = scene().material( g.hit.material );
+	t_gbuffer = &g;
+	Color color = ( this->*m_shaders[ material.m_features ] )( first_ray, g.hit, material, 1, rays_count, sampler );
+	t_gbuffer = NULL;
+	return color;
+}
 
-			if( m_tasks_count == 0 )
-				break;
+//Добавляет выборки прохода m_pass к пикселям тайла. В буфере и фреймбуфере хранится среднее,
+//в альфа-канале - число выборок. При подкачке геометрии выборки, которым не хватило чанков,
+//откладываются до конца тайла: недостающие чанки всех лучей тайла загружаются одной пачкой
+void RayTracer::render_tile( const tile_t & tile, Color * buffer, int & rays_count )
+{
+	struct deferred_sample_t
+	{
+		uint32_t    x;
+		uint32_t    y;
+		uint32_t    sample;
+	};
+	std::vector< deferred_sample_t > deferred;
+	std::vector< uint32_t > missing;
 
-			task = m_tasks.front();
-			m_tasks.pop_front();
+	const pass_t & pass = m_pass;
+	m_framebuffer.fetch_tile( tile, buffer, TILE_SIZE );
 
-			m_tasks_count--;
-		}
+	for( uint32_t y = 0; y < tile.height; y++ )
+		for( uint32_t x = 0; x < tile.width; x++ )
+		{
+			uint32_t px = tile.x + x;
+			uint32_t py = m_band_y + tile.y + y;
+			if ( px % pass.stride || py % pass.stride )
+				continue;
+			//уже посчитан на предыдущем, более грубом проходе
+			if ( pass.skip_stride && px % pass.skip_stride == 0 && py % pass.skip_stride == 0 )
+				continue;
 
-		Ray first_ray( task.pointOnViewport, m_cameraPos );
+			Color & c = buffer[ y * TILE_SIZE + x ];
+			float count = c.a;
+			Color sum = c * count;
+			const history_pixel_t * reused = m_temporal && pass.first_sample == 0 ? reproject( px, py, rays_count ) : NULL;
+			history_pixel_t record;
+			Intersection first_hit;
+			first_hit.type = PRIMITIVE_TYPES;
+			bool complete = true;
+			for( uint32_t s = 0; s < pass.samples; s++ )
+			{
+				uint32_t sample = pass.first_sample + s;
+				Intersection hit;
+				if ( m_temporal && sample == 0 )
+				{
+					t_reuse = reused;
+					t_record = &record;
+				}
+				Color color = trace_sample( px, py, sample, sample == 0 ? &hit : NULL, rays_count );
+				t_reuse = NULL;
+				t_record = NULL;
+				if ( !t_missing.empty() )
+				{
+					deferred_sample_t d = { x, y, sample };
+					deferred.push_back( d );
+					missing.insert( missing.end(), t_missing.begin(), t_missing.end() );
+					t_missing.clear();
+					complete = false;
+					continue;
+				}
+				sum = sum + color;
+				if ( sample == 0 )
+				{
+					store_aux( px, py, hit );
+					first_hit = hit;
+				}
+			}
+			//отложенные выборки уже учтены в count и добавляются к среднему позже
+			count += pass.samples;
+			c = sum / count;
+			c.a = count;
+			//пиксель с отложенными выборками в историю не попадает
+			if ( m_temporal )
+				record_history( px, py, record, first_hit, reused, complete );
+		}
 
-		const uint32_t & j = task.pixel_index;
-		m_image.image[ j ] = m_image.image[ j ] + ray_tracing( first_ray, 0, rays_count, nullptr );
-		//if ( j == m_aaSamples - 1 )
+	while( !deferred.empty() )
+	{
+		t_missing.swap( missing );
+		if ( !fetch_missing() )
+			break;
+		std::vector< deferred_sample_t > retry;
+		retry.swap( deferred );
+		for( size_t i = 0; i < retry.size(); i++ )
 		{
-			m_image.image[ j ].tone_mapping();
+			const deferred_sample_t & d = retry[ i ];
+			Intersection hit;
+			uint32_t py = m_band_y + tile.y + d.y;
+			Color color = trace_sample( tile.x + d.x, py, d.sample, d.sample == 0 ? &hit : NULL, rays_count );
+			if ( !t_missing.empty() )
+			{
+				deferred.push_back( d );
+				missing.insert( missing.end(), t_missing.begin(), t_missing.end() );
+				t_missing.clear();
+				continue;
+			}
+			Color & c = buffer[ d.y * TILE_SIZE + d.x ];
+			float count = c.a;
+			c = c + color / count;
+			c.a = count;
+			if ( d.sample == 0 )
+				store_aux( tile.x + d.x, py, hit );
+		}
+	}
+
+	m_framebuffer.commit_tile( tile, buffer, TILE_SIZE );
+}
+
+const RayTracer::preview_sample_t & RayTracer::preview_sample( const tile_t & tile, preview_sample_t * samples,
+															   uint32_t x, uint32_t y, int & rays_count )
+{
+	preview_sample_t & s = samples[ y * ( TILE_SIZE + 1 ) + x ];
+	if ( !s.traced )
+	{
+		//узлы на правой и нижней границе изображения прижимаются к последнему пикселю
+		uint32_t px = std::min< uint32_t >( tile.x + x, m_framebuffer.width() - 1 );
+		uint32_t py = std::min< uint32_t >( tile.y + y, m_framebuffer.height() - 1 );
+		//нулевая выборка трассирует центр пикселя, измерения источников света совпадают с
+		//обычным рендерингом; предпросмотр ждет недостающие чанки сразу
+		Intersection hit;
+		s.color = trace_sample( px, py, 0, &hit, rays_count );
+		while( !t_missing.empty() && fetch_missing() )
+			s.color = trace_sample( px, py, 0, &hit, rays_count );
+		t_missing.clear();
+		s.depth = hit.distance;
+		s.object = object_id( hit );
+		s.traced = true;
+	}
+	return s;
+}
+
+//Блок size x size с левым верхним углом ( x0, y0 ): если выборки в углах согласны по объекту, цвету
+//и глубине, пиксели блока интерполируются, иначе блок делится на четыре
+void RayTracer::preview_block( const tile_t & tile, preview_sample_t * samples, uint32_t x0, uint32_t y0, uint32_t size,
+							   Color * buffer, int & rays_count )
+{
+	const preview_sample_t & s00 = preview_sample( tile, samples, x0, y0, rays_count );
+	if ( size == 1 )
+	{
+		buffer[ y0 * TILE_SIZE + x0 ] = s00.color;
+		return;
+	}
+	const preview_sample_t & s10 = preview_sample( tile, samples, x0 + size, y0, rays_count );
+	const preview_sample_t & s01 = preview_sample( tile, samples, x0, y0 + size, rays_count );
+	const preview_sample_t & s11 = preview_sample( tile, samples, x0 + size, y0 + size, rays_count );
+
+	bool uniform = s00.object == s10.object && s00.object == s01.object && s00.object == s11.object;
+	if ( uniform )
+	{
+		float min_depth = std::min( std::min( s00.depth, s10.depth ), std::min( s01.depth, s11.depth ) );
+		float max_depth = std::max( std::max( s00.depth, s10.depth ), std::max( s01.depth, s11.depth ) );
+		if ( max_depth - min_depth > PREVIEW_DEPTH_THRESHOLD * min_depth )
+			uniform = false;
+	}
+	if ( uniform )
+	{
+		const Color * c[ 4 ] = { &s00.color, &s10.color, &s01.color, &s11.color };
+		for( size_t i = 0; i < 4 && uniform; i++ )
+			for( size_t j = i + 1; j < 4 && uniform; j++ )
+			{
+				Color d = *c[ i ] - *c[ j ];
+				if ( fabs( d.r ) > PREVIEW_COLOR_THRESHOLD || fabs( d.g ) > PREVIEW_COLOR_THRESHOLD || fabs( d.b ) > PREVIEW_COLOR_THRESHOLD )
+					uniform = false;
+			}
+	}
+
+	if ( !uniform )
+	{
+		uint32_t half = size / 2;
+		for( uint32_t y = y0; y < y0 + size && y < tile.height; y += half )
+			for( uint32_t x = x0; x < x0 + size && x < tile.width; x += half )
+				preview_block( tile, samples, x, y, half, buffer, rays_count );
+		return;
+	}
 
-			m_image.image[ j ] = m_image.image[ j ] / m_aaSamples;
+	for( uint32_t y = y0; y < y0 + size && y < tile.height; y++ )
+		for( uint32_t x = x0; x < x0 + size && x < tile.width; x++ )
+		{
+			float fx = ( float )( x - x0 ) / size;
+			float fy = ( float )( y - y0 ) / size;
+			buffer[ y * TILE_SIZE + x ] = ( s00.color * ( 1.0f - fx ) + s10.color * fx ) * ( 1.0f - fy ) +
+										  ( s01.color * ( 1.0f - fx ) + s11.color * fx ) * fy;
 		}
+}
+
+//Быстрый предпросмотр: грубая сетка с шагом PREVIEW_STRIDE, уточняемая только там, где соседние
+//выборки различаются
+void RayTracer::render_preview_tile( const tile_t & tile, Color * buffer, int & rays_count )
+{
+	preview_sample_t samples[ ( TILE_SIZE + 1 ) * ( TILE_SIZE + 1 ) ];
+	for( size_t i = 0; i < ( TILE_SIZE + 1 ) * ( TILE_SIZE + 1 ); i++ )
+		samples[ i ].traced = false;
+
+	for( uint32_t y = 0; y < tile.height; y += PREVIEW_STRIDE )
+		for( uint32_t x = 0; x < tile.width; x += PREVIEW_STRIDE )
+			preview_block( tile, samples, x, y, PREVIEW_STRIDE, buffer, rays_count );
+
+	for( uint32_t y = 0; y < tile.height; y++ )
+		for( uint32_t x = 0; x < tile.width; x++ )
+			buffer[ y * TILE_SIZE + x ].a = 1.0f;
+
+	m_framebuffer.commit_tile( tile, buffer, TILE_SIZE );
+}
+
+//пиксели тайла копятся в локальном буфере, выровненном по кэш-линии, и пишутся
+//в общий фреймбуфер целиком, потоки не делят кэш-линии при рендеринге
+struct tile_buffer_t
+{
+	Color pixels[ TILE_SIZE * TILE_SIZE ];
+} __attribute__ ( ( aligned( CACHE_LINE ) ) );
+
+bool RayTracer::next_tile( tile_t & tile, size_t worker )
+{
+	std::unique_lock<std::recursive_mutex> lock( m_mutex, std::defer_lock );
+	{
+		TRACE_SCOPE( "lock wait" );
+		lock.lock();
+	}
+
+	if( !m_pass.clear && !m_quiet && m_tasks_count % 100 == 0 )
+		printf( "thread%zu tiles left %zu/%zu\n", worker, m_tasks_count, m_tiles_total );
+
+	if( m_tasks_count == 0 || stopped() )
+		return false;
+
+	//своя очередь пуста - берем из следующих узлов
+	size_t n = m_settings.numa ? numa_node_of_thread( worker ) : 0;
+	while( m_tasks[ n ].empty() )
+		n = ( n + 1 ) % m_tasks.size();
+	tile = m_tasks[ n ].front();
+	m_tasks[ n ].pop_front();
+
+	m_tasks_count--;
+	return true;
+}
+
+void RayTracer::process_tile( const tile_t & task, Color * buffer, CandidateSet & candidates, int & rays_count )
+{
+	TRACE_SCOPE_XY( m_pass.clear ? "clear tile" : "tile", task.x, task.y );
+	if ( m_pass.clear )
+	{
+		m_framebuffer.clear_tile( task );
+		return;
+	}
+	if ( m_pager.is_open() )
+		m_pager.begin_trace();
+	//при подкачке геометрии примитивы лежат в чанках пейджера, отсекать нечего
+	else if ( TILE_FRUSTUM_CULLING )
+	{
+		cull_tile( task, candidates );
+		t_candidates = &candidates;
 	}
-	printf( "Thread%u done, rays calculated=%d\n", thread_index, rays_count );
+	if ( m_pass.preview )
+		render_preview_tile( task, buffer, rays_count );
+	else
+		render_tile( task, buffer, rays_count );
+	t_candidates = NULL;
+	if ( m_pager.is_open() )
+	{
+		m_pager.end_trace();
+		m_pager.release( t_pinned );
+	}
+}
+
+void RayTracer::thread( uint8_t thread_index )
+{
+	tile_buffer_t buffer;
+	CandidateSet candidates;
+
+	char trace_name[ 32 ];
+	snprintf( trace_name, sizeof( trace_name ), "worker %u", thread_index );
+	trace_thread( thread_index + 1, trace_name );
+
+	if ( m_settings.numa )
+	{
+		pin_current_thread( numa_cpu_of_thread( thread_index ) );
+		t_scene = m_replicas[ numa_node_of_thread( thread_index ) ];
+	}
+
+	int rays_count = 0;
+	tile_t task;
+	while( next_tile( task, thread_index ) )
+		process_tile( task, buffer.pixels, candidates, rays_count );
+	t_scene = NULL;
+	m_rays += rays_count;
+	if ( !m_pass.clear && !m_quiet )
+		printf( "Thread%u done, rays calculated=%d\n", thread_index, rays_count );
+}
+
+//Потоки планировщика переходят между рендерингами от тайла к тайлу, поэтому сцена узла
+//NUMA выбирается на каждый тайл, а буферы потока не принадлежат RayTracer. С NUMA поток
+//привязывается к процессору по своему номеру, как в thread(), при первом тайле
+bool RayTracer::run_next( size_t worker )
+{
+	static thread_local tile_buffer_t buffer;
+	static thread_local CandidateSet candidates;
+	static thread_local bool pinned = false;
+	tile_t task;
+	if ( !next_tile( task, worker ) )
+		return false;
+	if ( m_settings.numa )
+	{
+		if ( !pinned )
+			pinned = pin_current_thread( numa_cpu_of_thread( worker ) );
+		t_scene = m_replicas[ numa_node_of_thread( worker ) ];
+	}
+	int rays_count = 0;
+	process_tile( task, buffer.pixels, candidates, rays_count );
+	t_scene = NULL;
+	m_rays += rays_count;
+	return true;
 }
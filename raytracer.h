@@ -5,50 +5,421 @@
 #include <thread>
 #include <mutex>
 #include <list>
+#include <string>
+#include <atomic>
 
-#include "Object.hpp"
+#include "Scene.hpp"
 #include "Color.hpp"
+#include "Framebuffer.hpp"
+#include "Sampler.hpp"
+#include "Denoiser.hpp"
+#include "Numa.hpp"
+#include "SceneCache.hpp"
+#include "StaticScene.hpp"
+#include "GeometryPager.hpp"
+#include "Trace.hpp"
+#include "Lightmap.hpp"
+#include "PostProcess.hpp"
+#include "ShadowCache.hpp"
+#include "Scheduler.hpp"
 
+//число потоков и сторона тайла по умолчанию, если для машины и сцены нет настроек автотюнинга
 #define THREADS 2
 #define MAX_DEPTH  5
+//выборок на протяженном источнике света и сколько из них трассируется до проверки на полутень,
+//степени двойки
+#define AREA_LIGHT_SAMPLES 16
+#define AREA_LIGHT_FIRST_SAMPLES 4
+//MATH_PRECISE или MATH_FAST, см. FastMath.hpp
+#define MATH_QUALITY MATH_FAST
+//сторона тайла, единицы работы потока; автотюнинг выбирает тайлы не больше этого
+#define TILE_SIZE 32
+//первичные лучи тайла пересекаются только с примитивами, видимыми через тайл ( см. Scene::cull )
+#define TILE_FRUSTUM_CULLING 1
+//ячеек по стороне грани кубической карты кэша теневых лучей источника, 0 - без кэша
+#define SHADOW_CACHE_RESOLUTION 16
+//см. Framebuffer.hpp
+#define FRAMEBUFFER_LAYOUT FRAMEBUFFER_LINEAR
+#define FRAMEBUFFER_FORMAT FRAMEBUFFER_FLOAT32
+//шаг сетки первого прохода прогрессивного рендеринга, степень двойки
+#define PROGRESSIVE_STRIDE 8
+//шаг начальной сетки предпросмотра, степень двойки не больше TILE_SIZE
+#define PREVIEW_STRIDE 8
+//пороги различия выборок в углах блока предпросмотра, при превышении блок делится
+#define PREVIEW_COLOR_THRESHOLD 0.02f
+#define PREVIEW_DEPTH_THRESHOLD 0.05f
+//денойзер: число итераций à-trous ( радиус ядра 2^( N+1 ) - 2 ), допуски по освещенности,
+//нормали и относительной глубине
+#define DENOISE_ITERATIONS 4
+#define DENOISE_SIGMA_COLOR 0.1f
+#define DENOISE_SIGMA_NORMAL 0.3f
+#define DENOISE_SIGMA_DEPTH 0.05f
+//примитивов в чанке файла геометрии и кэш чанков по умолчанию, см. GeometryPager.hpp
+#define GEOMETRY_CHUNK_PRIMITIVES 4096
+#define GEOMETRY_CACHE_MB 256
+//текселей запеченного освещения на единицу длины поверхности
+#define LIGHTMAP_DENSITY 16.0f
+//допуск относительной глубины, при котором точка прошлого кадра считается той же поверхностью
+#define TEMPORAL_DEPTH_TOLERANCE 0.01f
+//отражение с весом не больше этого берется из прошлого кадра, а не трассируется заново
+#define TEMPORAL_REFLECTION_WEIGHT 0.02f
+//больше источников - временной режим выключается
+#define TEMPORAL_MAX_LIGHTS 8
+//видимость скольких источников хранится в G-буфере режима перезасветки
+#define RELIGHT_MAX_LIGHTS 8
+//потоковый режим: полоса изображения в памяти - столько строк тайлов, чтобы на каждый поток
+//рендеринга в ней было не меньше STREAM_BAND_TILES_PER_THREAD тайлов ( но не больше всего изображения )
+#define STREAM_BAND_TILES_PER_THREAD 16
+//предел стороны изображения, как у PNG: координаты пикселя - uint32_t, индексы пикселей считаются в size_t
+#define MAX_IMAGE_SIDE 0x7fffffffu
+//файл настроек автотюнинга по умолчанию, ширина калибровочного рендеринга и число его повторов
+//для каждой настройки ( берется лучший )
+#define AUTOTUNE_FILE "raytracer.tune"
+#define AUTOTUNE_WIDTH 160
+#define AUTOTUNE_REPEATS 2
 
-class RayTracer
+//результат RayTracer::autotune
+enum autotune_result_t
+{
+    //лучшая настройка применена и записана в tuning_file
+    AUTOTUNE_SAVED,
+    //применена, но не записана: tuning_file пуст или не пишется
+    AUTOTUNE_NOT_SAVED,
+    //прерван cancel(), остались прежние настройки, ничего не записано
+    AUTOTUNE_CANCELLED
+};
+
+struct render_settings_t
+{
+    size_t      width;
+    size_t      height;
+    //выборок на пиксель, в прогрессивном режиме - верхний предел
+    uint32_t    samples;
+    bool        progressive;
+    //быстрый предпросмотр с адаптивным прореживанием первичных лучей
+    bool        preview;
+    //ограничение времени рендеринга в секундах, 0 - без ограничения
+    double      time_budget;
+    //префикс файлов промежуточных снимков после каждого прохода, пустой - не сохранять
+    std::string snapshot_prefix;
+    //см. Sampler.hpp
+    sampler_type_t  sampler;
+    uint32_t        seed;
+    //фильтровать шум при сохранении по буферам признаков первичных попаданий
+    bool        denoise;
+    //привязка потоков к процессорам узлов NUMA, копия сцены на каждом узле и размещение
+    //страниц фреймбуфера потоками, которые рендерят тайлы
+    bool        numa;
+    //прямоугольные источники вместо сферических того же размера
+    bool        rect_lights;
+    //столько маленьких сфер сеткой на полу, сцена для замеров отсечения и кэша теней
+    uint32_t    scatter;
+    //скомпилированная сцена ( см. SceneCache.hpp ), пустой - сцена строится в prepare_scene()
+    std::string scene_cache;
+    //файл геометрии, подкачиваемой с диска, пустой - вся геометрия в памяти
+    std::string geometry_file;
+    //предел памяти под чанки геометрии в байтах
+    size_t      geometry_cache;
+    //предел памяти кэша тайлов текстур в байтах, 0 - текстуры читаются целиком, см. TextureCache.hpp
+    size_t      texture_cache;
+    //запеченное прямое освещение ( см. Lightmap.hpp ), пустой - теневые лучи трассируются
+    std::string lightmap;
+    //экспозиция, тональная компрессия, гамма и дизеринг при сохранении PNG
+    post_settings_t post;
+    //повторное использование шейдинга первичных попаданий прошлого кадра при движении камеры
+    //( кроме прогрессивного режима и предпросмотра ), temporal_error - допуск смещения точки
+    //шейдинга в пикселях
+    bool        temporal;
+    float       temporal_error;
+    //перезасветка: первичные попадания первого рендеринга сохраняются в G-буфер, следующие
+    //рендеринги после правки источников и материалов шейдят их без первичных лучей
+    bool        relight;
+    //не пустой - изображение рендерится горизонтальными полосами тайлов, каждая готовая полоса
+    //сразу проходит постобработку и дописывается в этот PNG; в памяти только одна полоса, и
+    //размер изображения ограничен форматом, а не памятью. Прогрессивный режим, предпросмотр,
+    //временной режим и перезасветка требуют всего кадра и выключаются, денойзер тоже: фильтр
+    //по отдельной полосе оставил бы швы на ее границах
+    std::string stream_file;
+    //настройки автотюнинга ( см. RayTracer::autotune ): запись для этой машины и сцены применяется
+    //при создании RayTracer, пустой - THREADS и TILE_SIZE
+    std::string tuning_file;
+    //общий пул потоков нескольких рендерингов ( см. Scheduler.hpp ), NULL - свои потоки.
+    //priority - больший вытесняет меньшие на границе тайла, weight - доля потоков среди
+    //рендерингов одного приоритета
+    Scheduler*  scheduler;
+    uint32_t    priority;
+    float       weight;
+
+    render_settings_t()
+        : width( 1024 ), height( 1024 ), samples( 1 ), progressive( false ), preview( false ), time_budget( 0.0 ),
+          sampler( SAMPLER_SOBOL ), seed( 0 ), denoise( false ), numa( false ), rect_lights( false ), scatter( 0 ),
+          geometry_cache( ( size_t )GEOMETRY_CACHE_MB << 20 ), texture_cache( 0 ), temporal( false ), temporal_error( 0.5f ),
+          relight( false ), tuning_file( AUTOTUNE_FILE ), scheduler( NULL ), priority( 0 ), weight( 1.0f )
+    {}
+};
+
+struct render_stats_t
+{
+    uint32_t    passes;
+    uint32_t    min_samples;
+    double      mean_samples;
+    double      time;
+    //false, если рендеринг остановлен по времени или отменен
+    bool        complete;
+    uint64_t    rays;
+
+    render_stats_t()
+        : passes( 0 ), min_samples( 0 ), mean_samples( 0.0 ), time( 0.0 ), complete( false ), rays( 0 )
+    {}
+};
+
+class RayTracer : public SchedulerJob
 {
 private:
-    std::vector< Object* > objects;
+    struct pass_t
+    {
+        //трассируются пиксели с координатами, кратными stride
+        uint32_t    stride;
+        //кроме кратных skip_stride, посчитанных предыдущим проходом
+        uint32_t    skip_stride;
+        uint32_t    first_sample;
+        uint32_t    samples;
+        //проход адаптивного предпросмотра
+        bool        preview;
+        //тайлы только обнуляются, первое касание страниц фреймбуфера
+        bool        clear;
+
+        pass_t( uint32_t stride_, uint32_t skip_stride_, uint32_t first_sample_, uint32_t samples_ )
+            : stride( stride_ ), skip_stride( skip_stride_ ), first_sample( first_sample_ ), samples( samples_ ),
+              preview( false ), clear( false )
+        {}
+        pass_t()
+            : stride( 1 ), skip_stride( 0 ), first_sample( 0 ), samples( 1 ), preview( false ), clear( false )
+        {}
+    };
+
+    //Шейдинг первичного попадания нулевой выборки пикселя, не зависящий от направления взгляда:
+    //диффузная освещенность и видимость источников в точке point. reflected - цвет отражения,
+    //он повторно используется, только если вес отражения мал
+    struct history_pixel_t
+    {
+        Vector      point;
+        Color       irradiance;
+        Color       reflected;
+        float       visibility[ TEMPORAL_MAX_LIGHTS ];
+        uint32_t    object;
+        uint32_t    face;
+        bool        valid;
+
+        history_pixel_t()
+            : object( ~0u ), face( 0 ), valid( false )
+        {}
+    };
+
+    //Первичное попадание нулевой выборки пикселя и цвет текстуры в нем. visibility - видимость
+    //источников, посчитанная при последнем шейдинге, < 0 - еще не считалась
+    struct gbuffer_pixel_t
+    {
+        Intersection    hit;
+        Color           texel;
+        float           visibility[ RELIGHT_MAX_LIGHTS ];
+
+        gbuffer_pixel_t()
+        {
+            hit.type = PRIMITIVE_TYPES;
+            hit.distance = INFINITY;
+            std::fill( visibility, visibility + RELIGHT_MAX_LIGHTS, -1.0f );
+        }
+    };
+
+    struct preview_sample_t
+    {
+        Color       color;
+        float       depth;
+        uint32_t    object;
+        bool        traced;
+    };
+
+    render_settings_t           m_settings;
+    SceneCache                  m_scene_cache;
+    Scene                       m_scene;
+    //копии m_scene по узлам NUMA, пустой без settings.numa
+    std::vector< Scene* >       m_replicas;
+    //открыт, если геометрия подкачивается с диска, тогда в m_scene только материалы
+    GeometryPager               m_pager;
+    //пустая, если освещение не запечено
+    Lightmap                    m_lightmap;
+    //наборы возможных затенителей по направлениям от источников, см. ShadowCache.hpp
+    ShadowCache                 m_shadow_cache;
     std::vector< ObjectLight > lights;
-    size_t 			m_buf_size;
+    Framebuffer     m_framebuffer;
+    //глубина, нормаль, альбедо и объект первичного луча нулевой выборки, построчно
+    std::vector< aux_pixel_t >  m_aux;
+    //фреймбуфер и m_aux хранят строки изображения [ m_band_y, m_band_y + высота фреймбуфера ),
+    //вне потокового режима - все изображение, m_band_y = 0
+    size_t                      m_band_y;
+    size_t                      m_band_rows;
     image_t			m_image;
+    //m_image уже проявлен ( develop ) после последнего рендеринга
+    bool                        m_developed;
     uint32_t		m_aaSamples;
     Vector			m_cameraPos;
     Viewport		m_viewport;
+    //история прошлого кадра и камера, которой он снят; m_next_history заполняет текущий кадр
+    std::vector< history_pixel_t >  m_history;
+    std::vector< history_pixel_t >  m_next_history;
+    Vector                      m_history_camera;
+    Viewport                    m_history_viewport;
+    //текущий рендеринг записывает историю
+    bool                        m_temporal;
+    std::atomic< size_t >       m_reused;
+    //G-буфер перезасветки, m_gbuffer_ready - заполнен полным рендерингом при текущей камере
+    std::vector< gbuffer_pixel_t >  m_gbuffer;
+    bool                        m_gbuffer_ready;
+    //биты источников, видимость которых в G-буфере актуальна ( геометрия источника не менялась )
+    uint32_t                    m_visibility_cached;
 
-    struct thread_task
-    {
-    	uint32_t 	pixel_index;
-    	Vector		pointOnViewport;
-    	thread_task( uint32_t pixel_index_, const Vector & pointOnViewport_ )
-    		: pixel_index( pixel_index_ ), pointOnViewport( pointOnViewport_ )
-    	{}
-    	thread_task()
-    		: pixel_index( 0 )
-    	{}
-    };
-
-    std::list< thread_task >	m_tasks;
+    //очереди тайлов по узлам NUMA, поток берет тайлы своего узла, затем чужих
+    std::vector< std::list< tile_t > >	m_tasks;
     size_t						m_tasks_count;
+    size_t						m_tiles_total;
+    pass_t                      m_pass;
+    double                      m_deadline;
+    std::atomic< bool >         m_cancel;
     std::recursive_mutex 		m_mutex;
-    std::thread* 				m_threads[ THREADS ];
+    std::vector< std::thread* > m_threads;
+    //рабочих потоков и сторона тайла, по умолчанию THREADS и TILE_SIZE
+    uint32_t                    m_tile_size;
+    //отпечаток сцены для настроек автотюнинга
+    uint64_t                    m_fingerprint;
+    //лучей, посчитанных потоками за рендеринг
+    std::atomic< uint64_t >     m_rays;
+    //калибровочные рендеринги автотюнинга не печатают ход рендеринга
+    bool                        m_quiet;
 
     void thread( uint8_t thread_index );
+    //следующий тайл прохода для потока worker, false - тайлов нет или рендеринг остановлен
+    bool next_tile( tile_t & tile, size_t worker );
+    //buffer - TILE_SIZE * TILE_SIZE пикселей, candidates - рабочий набор потока
+    void process_tile( const tile_t & tile, Color * buffer, CandidateSet & candidates, int & rays_count );
+    //один тайл прохода на потоке settings.scheduler
+    virtual bool run_next( size_t worker );
+    //запускает m_threads.size() потоков ( или задание в settings.scheduler ) на проход m_pass
+    //и ждет их завершения
+    bool run_pass();
+    //сцена, с которой работает текущий поток
+    const Scene & scene() const;
+    bool stopped() const;
+    void develop( image_t & image );
+    Vector viewport_point( const float & x, const float & y ) const;
+    //обратное к viewport_point для камеры camera: координаты в пикселях точки экрана на луче к point
+    bool project( const Vector & camera, const Viewport & viewport, const Vector & point, float & x, float & y ) const;
+    //шейдинг прошлого кадра для центра пикселя, NULL - пиксель шейдится заново
+    const history_pixel_t * reproject( uint32_t px, uint32_t py, int & rays_count );
+    void record_history( uint32_t px, uint32_t py, history_pixel_t & record, const Intersection & hit,
+                         const history_pixel_t * reused, bool valid );
+    //буфер кадра ( в потоковом режиме - полоса по числу потоков ) и m_aux под размер из m_settings
+    void init_framebuffer();
+    //m_aux нужен только денойзеру, без settings.denoise он пуст и store_aux ничего не пишет
+    void resize_aux( size_t pixels );
+    //x, y - пиксель изображения, он должен лежать в текущей полосе
+    void store_aux( uint32_t x, uint32_t y, const Intersection & hit );
+    //выборка sample пикселя ( px, py ), недействительна, если после нее t_missing не пуст
+    Color trace_sample( uint32_t px, uint32_t py, uint32_t sample, Intersection * hit, int & rays_count );
+    //загружает чанки геометрии, которых не хватило лучам потока
+    bool fetch_missing();
+    void render_tile( const tile_t & tile, Color * buffer, int & rays_count );
+    const preview_sample_t & preview_sample( const tile_t & tile, preview_sample_t * samples,
+                                             uint32_t x, uint32_t y, int & rays_count );
+    void preview_block( const tile_t & tile, preview_sample_t * samples, uint32_t x0, uint32_t y0, uint32_t size,
+                        Color * buffer, int & rays_count );
+    void render_preview_tile( const tile_t & tile, Color * buffer, int & rays_count );
 
-    Color ray_tracing( const Ray & ray, const int & depth, int & rays_count, float *distance );
+    bool intersect( const Ray & ray, Intersection & intersection );
+    //первичный луч текущего тайла: только с примитивами тайла, если их набор построен
+    bool intersect_primary( const Ray & ray, Intersection & intersection );
+    //набор примитивов, видимых из камеры через тайл с запасом в пиксель
+    void cull_tile( const tile_t & tile, CandidateSet & set ) const;
+    //occluders - набор из кэша теневых лучей, NULL - вся сцена
+    bool occluded( const Vector & point, const Vector & target, const CandidateSet * occluders = NULL );
+    float light_visibility( size_t light, const Vector & point, Sampler & sampler );
+    typedef Color ( RayTracer::*shader_t )( const Ray &, const Intersection &, const Material &, const int &, int &, Sampler & );
+    //ядра шейдинга, индекс - Material::m_features
+    shader_t                    m_shaders[ MATERIAL_FEATURES ];
+
+    template< uint32_t F >
+    Color shade( const Ray & ray, const Intersection & intr, const Material & material, const int & depth, int & rays_count,
+                 Sampler & sampler );
+    template< uint32_t F >
+    void init_shaders();
+
+    //hit - первичное пересечение луча, type == PRIMITIVE_TYPES при промахе
+    Color ray_tracing( const Ray & ray, const int & depth, int & rays_count, Sampler & sampler, Intersection * hit );
     void start_ray_tracing();
+    //очищает фреймбуфер перед рендерингом, при NUMA - потоками, которые будут рендерить тайлы
+    void clear_framebuffer();
+    //рендеринг полосами с записью в settings.stream_file
+    render_stats_t render_stream();
     void prepare_scene();
-    RayTracer()
-     	 : m_buf_size( 0 ), m_aaSamples( 1 ), m_tasks_count( 0 )
-    {}
+    void replicate_scene( size_t node );
+    //запись для этой машины и сцены из settings.tuning_file
+    bool load_tuning();
 public:
-    RayTracer( size_t width, size_t height );
+    //глобальные системы ( выборки, текстуры, NUMA ) настраиваются один раз, по settings первого
+    //RayTracer процесса
+    RayTracer( const render_settings_t & settings );
     ~RayTracer();
+
+    render_stats_t render();
+    //прерывает текущий render() ( или autotune() ), можно вызывать из другого потока и из
+    //обработчика сигнала; следующий render() идет как обычно
+    void cancel();
+    //переносит камеру вместе с экраном в точку position, направление взгляда не меняется
+    void set_camera( const Vector & position );
+    const Vector & camera() const
+    {
+        return m_cameraPos;
+    }
+    //следующий кадр трассируется целиком, например после изменения сцены
+    void invalidate_history();
+
+    //правка источников и материалов между рендерингами; сдвиг или изменение размера источника
+    //сбрасывает его видимость в G-буфере, запеченное освещение после правки источника не используется
+    size_t lights_count() const
+    {
+        return lights.size();
+    }
+    const ObjectLight & light( size_t index ) const
+    {
+        return lights[ index ];
+    }
+    void set_light( size_t index, const ObjectLight & light );
+    size_t materials_count() const
+    {
+        return m_scene.materials_count();
+    }
+    const Material & material( uint32_t index ) const
+    {
+        return m_scene.material( index );
+    }
+    void set_material( uint32_t index, const Material & material );
+    //Рендерит сцену в низком разрешении ( AUTOTUNE_WIDTH ) с каждым сочетанием числа потоков и
+    //стороны тайла из сетки, выбирает настройку с наибольшим числом лучей в секунду, применяет ее
+    //и записывает в settings.tuning_file под ключом машины и отпечатком сцены
+    autotune_result_t autotune();
+    //сторона тайла приводится к степени двойки от PREVIEW_STRIDE до TILE_SIZE: на тайле строится
+    //сетка предпросмотра, а раскладки фреймбуфера TILED и MORTON повторяют тайлы рендеринга
+    void set_tuning( uint32_t threads, uint32_t tile_size );
+    //сохраняет лучшее изображение на данный момент
+    int save( const std::string & file_name );
+    //то же изображение до постобработки, в PFM, см. --regrade; после save() не проявляется заново
+    int save_linear( const std::string & file_name );
+    //записывает сцену в файл кэша для settings.scene_cache
+    bool compile_scene( const std::string & file_name ) const;
+    //записывает сцену в C++ заголовок для сборки с -DSTATIC_SCENE
+    bool compile_scene_header( const std::string & file_name ) const;
+    //записывает геометрию сцены в файл для settings.geometry_file
+    bool compile_geometry( const std::string & file_name ) const;
+    //запекает прямое освещение сцены в файл для settings.lightmap
+    bool bake_lighting( const std::string & file_name );
 };